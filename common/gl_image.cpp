@@ -0,0 +1,77 @@
+#include "gl_image.h"
+
+#include <GL/gl.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include "stb_image.h"
+
+namespace {
+
+std::chrono::steady_clock::time_point launch_time;
+
+} // namespace
+
+bool load_image(const std::string &filename, CacheFile &file) {
+    uint64_t hash;
+    if (!hash_file(filename, hash)) return false;
+    const std::string path = cache_path(filename, "gl", hash);
+    if (open_cache(path, hash, file) && file.images.size() == 1) return true;
+    file.images.clear();
+
+    stbi_set_flip_vertically_on_load(true); // Переворот текстуры по вертикали
+    int width, height, channels;
+    unsigned char *data = stbi_load(filename.c_str(), &width, &height, &channels, 0);
+    if (!data) return false;
+    file.decoded.emplace_back(data, data + size_t(width) * height * channels);
+    stbi_image_free(data);
+
+    CachedImage image;
+    image.channels = channels;
+    image.levels.push_back({width, height, file.decoded.back().data()});
+    while (image.levels.back().width > 1 || image.levels.back().height > 1) {
+        const CachedLevel src = image.levels.back();
+        const int w = std::max(1, src.width / 2), h = std::max(1, src.height / 2);
+        std::vector<unsigned char> dst(size_t(w) * h * channels);
+        for (int j = 0; j < h; j++) {
+            const int j0 = std::min(2 * j, src.height - 1), j1 = std::min(2 * j + 1, src.height - 1);
+            for (int i = 0; i < w; i++) {
+                const int i0 = std::min(2 * i, src.width - 1), i1 = std::min(2 * i + 1, src.width - 1);
+                for (int c = 0; c < channels; c++) {
+                    const int sum = src.data[(size_t(j0) * src.width + i0) * channels + c] + src.data[(size_t(j0) * src.width + i1) * channels + c]
+                                  + src.data[(size_t(j1) * src.width + i0) * channels + c] + src.data[(size_t(j1) * src.width + i1) * channels + c];
+                    dst[(size_t(j) * w + i) * channels + c] = static_cast<unsigned char>((sum + 2) / 4);
+                }
+            }
+        }
+        file.decoded.push_back(std::move(dst));
+        image.levels.push_back({w, h, file.decoded.back().data()});
+    }
+    file.images.push_back(image);
+    write_cache(path, hash, file.images); // не записалось — в следующий раз просто декодируем снова
+    return true;
+}
+
+void upload_mip_chain(const CachedImage &image) {
+    static const GLenum formats[5] = {GL_RGB, GL_LUMINANCE, GL_LUMINANCE_ALPHA, GL_RGB, GL_RGBA}; // по числу каналов
+    const GLenum format = formats[image.channels >= 1 && image.channels <= 4 ? image.channels : 0];
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1); // строки RGB-уровней не выровнены на 4 байта
+    for (size_t level = 0; level < image.levels.size(); level++) {
+        glTexImage2D(GL_TEXTURE_2D, level, GL_RGB, image.levels[level].width, image.levels[level].height, 0,
+                     format, GL_UNSIGNED_BYTE, image.levels[level].data);
+    }
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+}
+
+void mark_launch() {
+    launch_time = std::chrono::steady_clock::now();
+}
+
+void report_first_frame() {
+    static bool reported = false;
+    if (reported) return;
+    reported = true;
+    printf("First frame: %.1f ms after launch\n",
+           std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - launch_time).count());
+}
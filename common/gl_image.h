@@ -0,0 +1,22 @@
+#ifndef GL_IMAGE_H
+#define GL_IMAGE_H
+
+#include <string>
+#include "image_cache.h"
+
+// Текстуры OpenGL из кэша изображений — общие для lab3 и lab6 (lab5 рисует без OpenGL и этот файл не собирает)
+
+// Изображение для OpenGL: перевёрнуто по вертикали, с mip-уровнями (среднее 2x2) в исходном числе каналов.
+// При попадании — отображённая запись кэша, при промахе — stbi_load, уровни в file.decoded и новая запись.
+// false — исходник не декодируется.
+bool load_image(const std::string &filename, CacheFile &file);
+
+// Все уровни image в привязанную GL_TEXTURE_2D (внутренний формат GL_RGB) и трилинейная фильтрация
+void upload_mip_chain(const CachedImage &image);
+
+// Время до первого кадра: mark_launch() — в начале main, report_first_frame() — после каждого glutSwapBuffers
+// (печатает только после первого)
+void mark_launch();
+void report_first_frame();
+
+#endif // GL_IMAGE_H
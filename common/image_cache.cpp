@@ -0,0 +1,136 @@
+#include "image_cache.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+constexpr char MAGIC[8] = {'L', 'A', 'B', 'I', 'M', 'G', 'C', '1'};
+constexpr size_t ALIGN = 64;
+
+struct FileHeader {
+    char magic[8];
+    uint64_t hash;
+    uint32_t images, levels; // levels — всего по всем изображениям
+};
+
+struct LevelEntry {
+    uint32_t image, channels, width, height;
+    uint64_t offset; // от начала файла
+};
+
+size_t align_up(const size_t n) { return (n + ALIGN - 1) / ALIGN * ALIGN; }
+
+} // namespace
+
+CacheFile::~CacheFile() {
+    if (map) munmap(map, map_bytes);
+}
+
+bool hash_file(const std::string &path, uint64_t &hash) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) return false;
+    hash = 0xcbf29ce484222325ull;
+    char buffer[1 << 16];
+    while (in) {
+        in.read(buffer, sizeof buffer);
+        for (std::streamsize i = 0; i < in.gcount(); i++) {
+            hash ^= static_cast<unsigned char>(buffer[i]);
+            hash *= 0x100000001b3ull;
+        }
+    }
+    return true;
+}
+
+std::string cache_path(const std::string &source, const char *tag, const uint64_t hash) {
+    const fs::path src(source);
+    char hex[17];
+    std::snprintf(hex, sizeof hex, "%016llx", static_cast<unsigned long long>(hash));
+    return (src.parent_path() / ".cache" / (src.filename().string() + "." + tag + "." + hex + ".bin")).string();
+}
+
+bool open_cache(const std::string &path, const uint64_t hash, CacheFile &file) {
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(FileHeader))
+        map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return false;
+    file.map = map;
+    file.map_bytes = st.st_size;
+
+    const unsigned char *base = static_cast<const unsigned char *>(map);
+    FileHeader header;
+    std::memcpy(&header, base, sizeof header);
+    if (std::memcmp(header.magic, MAGIC, sizeof MAGIC) != 0 || header.hash != hash
+        || sizeof header + size_t(header.levels) * sizeof(LevelEntry) > file.map_bytes)
+        return false;
+    file.images.assign(header.images, CachedImage{});
+    for (uint32_t i = 0; i < header.levels; i++) {
+        LevelEntry e;
+        std::memcpy(&e, base + sizeof header + i * sizeof e, sizeof e);
+        if (e.image >= header.images || e.offset + size_t(e.width) * e.height * e.channels > file.map_bytes) return false;
+        file.images[e.image].channels = e.channels;
+        file.images[e.image].levels.push_back({int(e.width), int(e.height), base + e.offset});
+    }
+    return true;
+}
+
+bool write_cache(const std::string &path, const uint64_t hash, const std::vector<CachedImage> &images) {
+    std::error_code ec;
+    const fs::path target(path);
+    fs::create_directories(target.parent_path(), ec);
+
+    FileHeader header;
+    std::memcpy(header.magic, MAGIC, sizeof MAGIC);
+    header.hash = hash;
+    header.images = static_cast<uint32_t>(images.size());
+    header.levels = 0;
+    for (const CachedImage &img : images) header.levels += static_cast<uint32_t>(img.levels.size());
+
+    std::vector<LevelEntry> entries;
+    size_t offset = align_up(sizeof header + header.levels * sizeof(LevelEntry));
+    for (uint32_t i = 0; i < images.size(); i++) {
+        for (const CachedLevel &l : images[i].levels) {
+            entries.push_back({i, uint32_t(images[i].channels), uint32_t(l.width), uint32_t(l.height), offset});
+            offset = align_up(offset + size_t(l.width) * l.height * images[i].channels);
+        }
+    }
+
+    const fs::path tmp = target.string() + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::binary);
+        out.write(reinterpret_cast<const char *>(&header), sizeof header);
+        out.write(reinterpret_cast<const char *>(entries.data()), entries.size() * sizeof(LevelEntry));
+        size_t k = 0;
+        for (const CachedImage &img : images) {
+            for (const CachedLevel &l : img.levels) {
+                out.seekp(entries[k++].offset);
+                out.write(reinterpret_cast<const char *>(l.data), size_t(l.width) * l.height * img.channels);
+            }
+        }
+        if (!out) return false;
+    }
+    fs::rename(tmp, target, ec);
+    if (ec) return false;
+
+    // Записи того же исходника с другим хэшем больше никогда не совпадут
+    const std::string name = target.filename().string();
+    const std::string prefix = name.substr(0, name.size() - std::strlen("0123456789abcdef.bin"));
+    for (const fs::directory_entry &entry : fs::directory_iterator(target.parent_path(), ec)) {
+        const std::string other = entry.path().filename().string();
+        if (other != name && other.size() == name.size() && other.compare(0, prefix.size(), prefix) == 0)
+            fs::remove(entry.path(), ec);
+    }
+    return true;
+}
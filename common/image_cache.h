@@ -0,0 +1,51 @@
+#ifndef IMAGE_CACHE_H
+#define IMAGE_CACHE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Кэш декодированных изображений с mip-уровнями. Файл кэша лежит в .cache/ рядом с исходником,
+// в имени — хэш содержимого исходника, поэтому изменённая картинка просто не найдёт старую запись.
+// Формат: заголовок, таблица уровней, затем пиксели уровней подряд (каждый с границы 64 байт) —
+// файл целиком отображается через mmap и читается без разбора.
+
+struct CachedLevel {
+    int width = 0, height = 0;
+    const unsigned char *data = nullptr; // width * height * channels байт, строки сверху вниз
+};
+
+struct CachedImage {
+    int channels = 0;
+    std::vector<CachedLevel> levels;
+};
+
+// Отображённый файл кэша; указатели уровней живут, пока жив объект
+struct CacheFile {
+    std::vector<CachedImage> images;
+    std::vector<std::vector<unsigned char>> decoded; // уровни, собранные при промахе кэша
+
+    CacheFile() = default;
+    CacheFile(const CacheFile &) = delete;
+    CacheFile &operator=(const CacheFile &) = delete;
+    ~CacheFile();
+
+private:
+    friend bool open_cache(const std::string &, const uint64_t, CacheFile &);
+    void *map = nullptr;
+    size_t map_bytes = 0;
+};
+
+// FNV-1a по содержимому файла; false, если файл не читается
+bool hash_file(const std::string &path, uint64_t &hash);
+
+// Путь записи: <каталог исходника>/.cache/<имя>.<tag>.<хэш>.bin; tag различает способы подготовки одного файла
+std::string cache_path(const std::string &source, const char *tag, const uint64_t hash);
+
+// false — записи нет или она повреждена (тогда исходник декодируется заново)
+bool open_cache(const std::string &path, const uint64_t hash, CacheFile &file);
+
+// Пишет запись атомарно (временный файл и rename) и удаляет записи того же исходника и tag со старым хэшем
+bool write_cache(const std::string &path, const uint64_t hash, const std::vector<CachedImage> &images);
+
+#endif // IMAGE_CACHE_H
@@ -3,6 +3,7 @@
 #include <GL/glut.h>
 #include <cmath>
 #include <cstdio>
+#include "gl_image.h"
 
 // Переменные камеры
 float angle = 0.0f;    // Угол для вращения камеры
@@ -25,26 +26,19 @@ bool autoRotate = true;
 
 // Функция для загрузки текстуры
 void loadTexture(const char* filename, GLuint& texture) {
-    stbi_set_flip_vertically_on_load(true); // Переворот текстуры по вертикали
-    int width, height, channels;
-    unsigned char* data = stbi_load(filename, &width, &height, &channels, 0);
-    if (!data) {
+    CacheFile image; // декодированные пиксели с mip-уровнями; JPEG разбирается, только если файл изменился
+    if (!load_image(filename, image)) {
         printf("Failed to load texture: %s\n", filename);
         exit(1);
     }
+    const CachedImage& img = image.images[0];
 
-    printf("Loaded texture: %dx%d, Channels: %d\n", width, height, channels);
+    printf("Loaded texture: %dx%d, Channels: %d, %zu mip levels%s\n", img.levels[0].width, img.levels[0].height,
+           img.channels, img.levels.size(), image.decoded.empty() ? " (cached)" : "");
 
     glGenTextures(1, &texture);
     glBindTexture(GL_TEXTURE_2D, texture);
-
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, 
-                 channels == 4 ? GL_RGBA : GL_RGB, GL_UNSIGNED_BYTE, data);
-
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-    stbi_image_free(data);
+    upload_mip_chain(img);
 }
 
 // Функция для отрисовки фона
@@ -249,6 +243,8 @@ void display() {
     // glPopMatrix();
 
     glutSwapBuffers();
+
+    report_first_frame();
 }
 
 
@@ -340,6 +336,7 @@ void normalKeyboard(unsigned char key, int x, int y) {
 
 // Главная функция
 int main(int argc, char** argv) {
+    mark_launch();
     glutInit(&argc, argv);
     glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH);
     glutInitWindowSize(800, 600);
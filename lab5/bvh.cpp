@@ -0,0 +1,197 @@
+#include "bvh.h"
+
+#include <atomic>
+#include <chrono>
+#include <omp.h>
+
+namespace {
+
+constexpr int BINS           = 16;   // число корзин SAH на ось
+constexpr int MAX_LEAF       = 4;    // до стольких примитивов лист создаётся без оценки разбиения
+constexpr int MAX_DEPTH      = 48;   // стек обхода в BVH::traverse рассчитан на 64 уровня
+constexpr int TASK_THRESHOLD = 4096; // поддеревья меньше этого строятся в текущей задаче
+
+struct Bin {
+    AABB box;
+    int count = 0;
+};
+
+struct Builder {
+    const std::vector<AABB> &boxes;
+    std::vector<vec3> centers;
+    std::vector<BVHNode> &nodes;
+    std::vector<int> &indices;
+    std::atomic<int> used{1};
+    std::atomic<int> depth{0};
+
+    Builder(const std::vector<AABB> &b, std::vector<BVHNode> &n, std::vector<int> &i)
+        : boxes(b), centers(b.size()), nodes(n), indices(i) {
+        for (size_t k = 0; k < boxes.size(); k++) centers[k] = boxes[k].center();
+    }
+
+    void make_leaf(BVHNode &node, int first, int count, int level) {
+        node.first = first;
+        node.count = count;
+        int d = depth.load();
+        while (level > d && !depth.compare_exchange_weak(d, level)) {}
+    }
+
+    void build(int node_idx, int first, int count, int level) {
+        BVHNode &node = nodes[node_idx];
+        AABB centroid_box;
+        for (int i = first; i < first + count; i++) {
+            node.box.grow(boxes[indices[i]]);
+            centroid_box.grow(centers[indices[i]]);
+        }
+        if (count <= MAX_LEAF || level >= MAX_DEPTH) return make_leaf(node, first, count, level);
+
+        // Поиск лучшей плоскости разбиения по всем трём осям
+        int best_axis = -1, best_split = 0;
+        float best_cost = 1e30f;
+        for (int axis = 0; axis < 3; axis++) {
+            float cmin = centroid_box.lo[axis], extent = centroid_box.hi[axis] - cmin;
+            if (extent <= 0) continue;
+            float scale = BINS / extent;
+            Bin bins[BINS];
+            for (int i = first; i < first + count; i++) {
+                int b = std::min(BINS - 1, int((centers[indices[i]][axis] - cmin) * scale));
+                bins[b].count++;
+                bins[b].box.grow(boxes[indices[i]]);
+            }
+            // Проход справа налево накапливает площади правых частей
+            float right_area[BINS - 1];
+            int right_count[BINS - 1];
+            AABB acc;
+            int n = 0;
+            for (int b = BINS - 1; b > 0; b--) {
+                acc.grow(bins[b].box);
+                n += bins[b].count;
+                right_area[b - 1] = acc.area();
+                right_count[b - 1] = n;
+            }
+            acc = AABB{};
+            n = 0;
+            for (int b = 0; b < BINS - 1; b++) {
+                acc.grow(bins[b].box);
+                n += bins[b].count;
+                float cost = n * acc.area() + right_count[b] * right_area[b];
+                if (n && right_count[b] && cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_split = b;
+                }
+            }
+        }
+
+        int mid = first + count / 2; // все центры совпали — делим пополам, чтобы не получить огромный лист
+        if (best_axis >= 0) {
+            // Маленький узел остаётся листом, если разбиение не дешевле прямого перебора
+            if (count <= 16 && best_cost >= count * node.box.area())
+                return make_leaf(node, first, count, level);
+            float cmin = centroid_box.lo[best_axis];
+            float scale = BINS / (centroid_box.hi[best_axis] - cmin);
+            int *p = std::partition(indices.data() + first, indices.data() + first + count, [&](int prim) {
+                return std::min(BINS - 1, int((centers[prim][best_axis] - cmin) * scale)) <= best_split;
+            });
+            mid = int(p - indices.data());
+        }
+
+        int left = used.fetch_add(2);
+        node.first = left;
+        node.count = 0;
+        if (count > TASK_THRESHOLD) {
+#pragma omp task
+            build(left, first, mid - first, level + 1);
+            build(left + 1, mid, first + count - mid, level + 1);
+#pragma omp taskwait
+        } else {
+            build(left, first, mid - first, level + 1);
+            build(left + 1, mid, first + count - mid, level + 1);
+        }
+    }
+};
+
+} // namespace
+
+BVH build_bvh(const std::vector<AABB> &boxes) {
+    auto start = std::chrono::steady_clock::now();
+    BVH bvh;
+    const int n = static_cast<int>(boxes.size());
+    if (!n) return bvh;
+
+    bvh.indices.resize(n);
+    for (int i = 0; i < n; i++) bvh.indices[i] = i;
+    bvh.nodes.resize(2 * n - 1);
+
+    Builder builder(boxes, bvh.nodes, bvh.indices);
+#pragma omp parallel
+#pragma omp single
+    builder.build(0, 0, n, 1);
+
+    bvh.nodes.resize(builder.used.load());
+    bvh.depth = builder.depth.load();
+    bvh.build_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    return bvh;
+}
+
+namespace {
+
+int collapse(const BVH &bvh, const int node, std::vector<WideBVHNode> &out) {
+    // Набираем до SIMD_WIDTH потомков, раскрывая внутренние узлы с наибольшей площадью
+    int children[SIMD_WIDTH] = {bvh.nodes[node].first, bvh.nodes[node].first + 1};
+    int n = 2;
+    while (n < SIMD_WIDTH) {
+        int best = -1;
+        float best_area = -1;
+        for (int k = 0; k < n; k++) {
+            const BVHNode &c = bvh.nodes[children[k]];
+            if (!c.count && c.box.area() > best_area) { best = k; best_area = c.box.area(); }
+        }
+        if (best < 0) break;
+        int expanded = children[best];
+        children[best] = bvh.nodes[expanded].first;
+        children[n++] = bvh.nodes[expanded].first + 1;
+    }
+
+    const int idx = static_cast<int>(out.size());
+    out.emplace_back();
+    for (int k = 0; k < SIMD_WIDTH; k++) {
+        WideBVHNode &w = out[idx];
+        if (k >= n) {
+            // Пустой слот: точка далеко за сценой, проверка луча с ней всегда неудачна
+            w.lo_x[k] = w.lo_y[k] = w.lo_z[k] = w.hi_x[k] = w.hi_y[k] = w.hi_z[k] = 1e30f;
+            w.child[k] = -1;
+            w.count[k] = 0;
+            continue;
+        }
+        const BVHNode &c = bvh.nodes[children[k]];
+        w.lo_x[k] = c.box.lo.x; w.lo_y[k] = c.box.lo.y; w.lo_z[k] = c.box.lo.z;
+        w.hi_x[k] = c.box.hi.x; w.hi_y[k] = c.box.hi.y; w.hi_z[k] = c.box.hi.z;
+        w.count[k] = c.count;
+        w.child[k] = c.count ? c.first : -1;
+    }
+    for (int k = 0; k < n; k++) {
+        const BVHNode &c = bvh.nodes[children[k]];
+        if (!c.count) {
+            int child = collapse(bvh, children[k], out); // out может переаллоцироваться, ссылку берём заново
+            out[idx].child[k] = child;
+        }
+    }
+    return idx;
+}
+
+} // namespace
+
+WideBVH build_wide_bvh(const BVH &bvh) {
+    WideBVH wide;
+    wide.indices = bvh.indices;
+    if (bvh.nodes.empty()) return wide;
+    if (bvh.nodes[0].count) {
+        wide.root_leaf = true;
+        wide.root_count = bvh.nodes[0].count;
+        return wide;
+    }
+    wide.nodes.reserve(bvh.nodes.size() / 2 + 1);
+    collapse(bvh, 0, wide.nodes);
+    return wide;
+}
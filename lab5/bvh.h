@@ -0,0 +1,152 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <vector>
+#include <algorithm>
+#include "geometry.h"
+#include "simd.h"
+
+// Ограничивающий параллелепипед, выровненный по осям
+struct AABB {
+    vec3 lo = { 1e30f,  1e30f,  1e30f};
+    vec3 hi = {-1e30f, -1e30f, -1e30f};
+
+    void grow(const vec3 &p) {
+        lo = {std::min(lo.x, p.x), std::min(lo.y, p.y), std::min(lo.z, p.z)};
+        hi = {std::max(hi.x, p.x), std::max(hi.y, p.y), std::max(hi.z, p.z)};
+    }
+    void grow(const AABB &b) { grow(b.lo); grow(b.hi); }
+    vec3 center() const { return (lo + hi) * .5f; }
+    float area() const {
+        vec3 e = hi - lo;
+        if (e.x < 0) return 0;
+        return 2 * (e.x*e.y + e.y*e.z + e.z*e.x);
+    }
+};
+
+// Расстояние входа луча в AABB или 1e30, если луч проходит мимо (или дальше tmax)
+inline float ray_box_distance(const AABB &b, const vec3 &orig, const vec3 &inv_dir, const float tmax) {
+    float tx1 = (b.lo.x - orig.x) * inv_dir.x, tx2 = (b.hi.x - orig.x) * inv_dir.x;
+    float tmin = std::min(tx1, tx2), tfar = std::max(tx1, tx2);
+    float ty1 = (b.lo.y - orig.y) * inv_dir.y, ty2 = (b.hi.y - orig.y) * inv_dir.y;
+    tmin = std::max(tmin, std::min(ty1, ty2)); tfar = std::min(tfar, std::max(ty1, ty2));
+    float tz1 = (b.lo.z - orig.z) * inv_dir.z, tz2 = (b.hi.z - orig.z) * inv_dir.z;
+    tmin = std::max(tmin, std::min(tz1, tz2)); tfar = std::min(tfar, std::max(tz1, tz2));
+    return (tfar >= tmin && tfar > 0 && tmin < tmax) ? tmin : 1e30f;
+}
+
+struct BVHNode {
+    AABB box;
+    int first = 0; // лист: первый элемент в BVH::indices; внутренний узел: левый потомок (правый = first+1)
+    int count = 0; // число примитивов в листе, 0 у внутреннего узла
+};
+
+struct BVH {
+    std::vector<BVHNode> nodes;   // nodes[0] — корень
+    std::vector<int>     indices; // номера примитивов в порядке листьев
+    int    depth    = 0;
+    double build_ms = 0;
+
+    // Обход от ближнего потомка к дальнему. leaf(first, count, tmax) проверяет примитивы
+    // indices[first .. first+count) и при попадании уменьшает tmax — дальние узлы после этого отсекаются.
+    // Если leaf выставит tmax = -1, обход сразу заканчивается (запросы «есть ли хоть одно пересечение»).
+    template <typename F>
+    void traverse(const vec3 &orig, const vec3 &dir, float &tmax, F &&leaf) const;
+};
+
+// Сборка по биннингованной эвристике площадей поверхностей (SAH), поддеревья строятся задачами OpenMP
+BVH build_bvh(const std::vector<AABB> &boxes);
+
+// Узел широкого BVH: SIMD_WIDTH потомков (BVH8 с AVX, BVH4 с SSE), границы в SoA,
+// так что луч проверяется со всеми потомками одной SIMD-операцией. Узел занимает целое число кэш-линий.
+struct alignas(64) WideBVHNode {
+    float lo_x[SIMD_WIDTH], lo_y[SIMD_WIDTH], lo_z[SIMD_WIDTH];
+    float hi_x[SIMD_WIDTH], hi_y[SIMD_WIDTH], hi_z[SIMD_WIDTH];
+    int child[SIMD_WIDTH]; // внутренний потомок: индекс узла; лист: первый элемент в indices; пустой слот: -1
+    int count[SIMD_WIDTH]; // число примитивов листа, 0 у внутреннего потомка
+};
+
+// Широкое BVH для одиночных некогерентных лучей (отражения, преломления, тени)
+struct WideBVH {
+    std::vector<WideBVHNode> nodes;
+    std::vector<int> indices; // совпадает с BVH::indices
+    bool root_leaf = false;   // дерево из одного листа: примитивы indices[0 .. root_count)
+    int root_count = 0;
+
+    // Тот же контракт, что у BVH::traverse
+    template <typename F>
+    void traverse(const vec3 &orig, const vec3 &dir, float &tmax, F &&leaf) const;
+};
+
+// Схлопывает бинарное дерево: у каждого узла раскрываются потомки с наибольшей площадью, пока их не станет SIMD_WIDTH
+WideBVH build_wide_bvh(const BVH &bvh);
+
+template <typename F>
+void BVH::traverse(const vec3 &orig, const vec3 &dir, float &tmax, F &&leaf) const {
+    if (nodes.empty()) return;
+    const vec3 inv_dir = {1.f / dir.x, 1.f / dir.y, 1.f / dir.z};
+    struct Entry { int node; float t; };
+    Entry stack[64];
+    int sp = 0;
+
+    float t = ray_box_distance(nodes[0].box, orig, inv_dir, tmax);
+    if (t == 1e30f) return;
+    stack[sp++] = {0, t};
+    while (sp && tmax > 0) {
+        Entry e = stack[--sp];
+        if (e.t >= tmax) continue; // за время обхода нашлось более близкое пересечение
+        const BVHNode *n = &nodes[e.node];
+        while (!n->count) {
+            int a = n->first, b = n->first + 1;
+            float ta = ray_box_distance(nodes[a].box, orig, inv_dir, tmax);
+            float tb = ray_box_distance(nodes[b].box, orig, inv_dir, tmax);
+            if (ta > tb) { std::swap(a, b); std::swap(ta, tb); }
+            if (ta == 1e30f) { n = nullptr; break; }
+            if (tb != 1e30f) stack[sp++] = {b, tb};
+            n = &nodes[a];
+        }
+        if (!n) continue;
+        leaf(n->first, n->count, tmax);
+    }
+}
+
+template <typename F>
+void WideBVH::traverse(const vec3 &orig, const vec3 &dir, float &tmax, F &&leaf) const {
+    if (root_leaf) { leaf(0, root_count, tmax); return; }
+    if (nodes.empty()) return;
+    const vfloat ox(orig.x), oy(orig.y), oz(orig.z);
+    const vfloat ix(1.f / dir.x), iy(1.f / dir.y), iz(1.f / dir.z);
+    struct Entry { int child, count; float t; };
+    Entry stack[64 * SIMD_WIDTH];
+    int sp = 0;
+    stack[sp++] = {0, 0, 0.f};
+    while (sp && tmax > 0) {
+        Entry e = stack[--sp];
+        if (e.t >= tmax) continue;
+        if (e.count) { leaf(e.child, e.count, tmax); continue; }
+
+        const WideBVHNode &n = nodes[e.child];
+        vfloat t1 = (vfloat::load(n.lo_x) - ox) * ix, t2 = (vfloat::load(n.hi_x) - ox) * ix;
+        vfloat tmin = vmin(t1, t2), tfar = vmax(t1, t2);
+        t1 = (vfloat::load(n.lo_y) - oy) * iy; t2 = (vfloat::load(n.hi_y) - oy) * iy;
+        tmin = vmax(tmin, vmin(t1, t2)); tfar = vmin(tfar, vmax(t1, t2));
+        t1 = (vfloat::load(n.lo_z) - oz) * iz; t2 = (vfloat::load(n.hi_z) - oz) * iz;
+        tmin = vmax(tmin, vmin(t1, t2)); tfar = vmin(tfar, vmax(t1, t2));
+        int mask = movemask((tmin <= tfar) & (tfar > vfloat(0.f)) & (tmin < vfloat(tmax)));
+        if (!mask) continue;
+
+        // Попавшие потомки кладём в стек от дальнего к ближнему
+        alignas(32) float dist[SIMD_WIDTH];
+        tmin.store(dist);
+        const int base = sp;
+        for (; mask; mask &= mask - 1) {
+            int k = __builtin_ctz(mask);
+            Entry c = {n.child[k], n.count[k], dist[k]};
+            int j = sp++;
+            while (j > base && stack[j - 1].t < c.t) { stack[j] = stack[j - 1]; j--; }
+            stack[j] = c;
+        }
+    }
+}
+
+#endif // BVH_H
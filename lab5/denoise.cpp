@@ -0,0 +1,182 @@
+#include "denoise.h"
+
+#include <algorithm>
+#include <cmath>
+#include "simd.h"
+
+namespace {
+
+constexpr int ITERATIONS = 5;
+constexpr int PAD = 48; // поля слева и справа строки: 2 * 2^(ITERATIONS - 1) + SIMD_WIDTH - 1 с запасом
+constexpr float KERNEL[5] = {1.f / 16, 1.f / 4, 3.f / 8, 1.f / 4, 1.f / 16};
+
+constexpr float SIGMA_LUMINANCE = 3.f; // допуск разницы яркости в стандартных отклонениях шума
+constexpr float SIGMA_DEPTH = 0.05f;    // допустимая относительная разница глубины на пиксель расстояния
+constexpr int NORMAL_POWER_LOG2 = 7; // вес нормали — max(0, cos)^128
+constexpr float MIN_ALBEDO = 0.02f;  // тёмные поверхности не делятся почти на ноль
+constexpr float MIN_SIGMA = 1e-4f;
+
+// exp(-d) ≈ (1 + d/16)^-16: та же форма спада без экспоненты в векторах; хвост при d ~ 10 ещё мал
+// (у (1 + d/4)^-4 он в сто раз толще, и за пять проходов соседи за краями набирают заметный вес)
+inline vfloat falloff(const vfloat d) {
+    vfloat t = vfloat(1.f) + d * vfloat(1.f / 16);
+    for (int k = 0; k < 4; k++) t = t * t;
+    return vrcp(t);
+}
+
+inline vfloat luminance(const vfloat r, const vfloat g, const vfloat b) {
+    return vfloat(0.2126f) * r + vfloat(0.7152f) * g + vfloat(0.0722f) * b;
+}
+
+// Плоскости каналов со строками ширины stride: пиксель (x, y) лежит в y * stride + PAD + x.
+// Поля нулевые, нулевая нормаль в поле даёт вес 0, поэтому краевых проверок по x нет
+struct Planes {
+    int stride;
+    std::vector<float> data[4];
+    Planes(const int width, const int height, const int planes = 3) : stride(width + 2 * PAD) {
+        for (int k = 0; k < planes; k++) data[k].assign(size_t(stride) * height, 0.f);
+    }
+    float *operator[](const int c) { return data[c].data() + PAD; }
+    const float *operator[](const int c) const { return data[c].data() + PAD; }
+};
+
+// Геометрический вес соседа q для дорожек p: нормали и относительная глубина
+struct Geometry {
+    vfloat nx, ny, nz, z, inv_z;
+    Geometry(const Planes &normal, const Planes &depth, const size_t p)
+        : nx(vfloat::load(normal[0] + p)), ny(vfloat::load(normal[1] + p)), nz(vfloat::load(normal[2] + p)),
+          z(vfloat::load(depth[0] + p)), inv_z(vfloat(1.f) / vmax(z, vfloat(1e-6f))) {}
+    // (cos нормалей)^128 и показатель для falloff по глубине
+    vfloat normal_weight(const Planes &normal, const size_t q) const {
+        vfloat cos = vmax(nx * vfloat::load(normal[0] + q) + ny * vfloat::load(normal[1] + q) + nz * vfloat::load(normal[2] + q),
+                          vfloat(0.f));
+        for (int k = 0; k < NORMAL_POWER_LOG2; k++) cos = cos * cos;
+        return cos;
+    }
+    vfloat depth_distance(const Planes &depth, const size_t q, const float scale) const {
+        return vabs(z - vfloat::load(depth[0] + q)) * inv_z * vfloat(scale);
+    }
+};
+
+} // namespace
+
+void denoise(const float *hdr, const FeatureBuffer &features, const float *variance, const int width, const int height,
+             float *out) {
+    // color: демодулированный RGB и в плоскости 3 — дисперсия яркости
+    Planes color(width, height, 4), filtered(width, height, 4), normal(width, height), depth(width, height, 1);
+    const int stride = color.stride;
+    auto albedo = [&](const size_t p, const int c) { return std::max(features.albedo[p * 3 + c], MIN_ALBEDO); };
+
+#pragma omp parallel for schedule(static)
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            const size_t p = size_t(y) * width + x, q = size_t(y) * stride + x;
+            const vec3 n = {features.normal[p * 3], features.normal[p * 3 + 1], features.normal[p * 3 + 2]};
+            const float len = n.norm();
+            for (int c = 0; c < 3; c++) {
+                color[c][q] = hdr[p * 3 + c] / albedo(p, c);
+                normal[c][q] = len > 0 ? n[c] / len : 0.f;
+            }
+            depth[0][q] = features.depth[p];
+            if (variance) {
+                const float a = 0.2126f * albedo(p, 0) + 0.7152f * albedo(p, 1) + 0.0722f * albedo(p, 2);
+                color[3][q] = variance[p] / (a * a);
+            }
+        }
+    }
+
+    auto depth_scales = [](const int step, float scale[5][5]) {
+        // Допуск по глубине растёт с расстоянием до соседа
+        for (int dy = -2; dy <= 2; dy++)
+            for (int dx = -2; dx <= 2; dx++)
+                scale[dy + 2][dx + 2] = dx || dy ? 1.f / (SIGMA_DEPTH * step * (std::abs(dx) + std::abs(dy))) : 0.f;
+    };
+
+    // Без дисперсии сэмплов (один сэмпл на пиксель) она оценивается по соседям 5x5 той же поверхности
+    if (!variance) {
+        float scale[5][5];
+        depth_scales(1, scale);
+#pragma omp parallel for schedule(static)
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x += SIMD_WIDTH) {
+                const size_t p = size_t(y) * stride + x;
+                const Geometry geometry(normal, depth, p);
+                vfloat sum_w(0.f), sum_l(0.f), sum_l2(0.f);
+                for (int dy = -2; dy <= 2; dy++) {
+                    if (y + dy < 0 || y + dy >= height) continue;
+                    for (int dx = -2; dx <= 2; dx++) {
+                        const size_t q = p + ptrdiff_t(dy) * stride + dx;
+                        const vfloat l = luminance(vfloat::load(color[0] + q), vfloat::load(color[1] + q), vfloat::load(color[2] + q));
+                        const vfloat w = dx || dy ? geometry.normal_weight(normal, q) * falloff(geometry.depth_distance(depth, q, scale[dy + 2][dx + 2]))
+                                                  : vfloat(1.f);
+                        sum_w = sum_w + w;
+                        sum_l = sum_l + w * l;
+                        sum_l2 = sum_l2 + w * l * l;
+                    }
+                }
+                const vfloat inv = vfloat(1.f) / sum_w, mean = sum_l * inv;
+                vmax(sum_l2 * inv - mean * mean, vfloat(0.f)).store(color[3] + p);
+            }
+        }
+    }
+
+    // Проходы à-trous (Schied et al., SVGF): яркость соседа сравнивается с допуском SIGMA_LUMINANCE * sqrt(дисперсии),
+    // дисперсия фильтруется вместе с цветом с квадратами весов
+    for (int it = 0; it < ITERATIONS; it++) {
+        const int step = 1 << it;
+        float scale[5][5];
+        depth_scales(step, scale);
+#pragma omp parallel for schedule(static)
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x += SIMD_WIDTH) {
+                const size_t p = size_t(y) * stride + x;
+                const Geometry geometry(normal, depth, p);
+                const vfloat r = vfloat::load(color[0] + p), g = vfloat::load(color[1] + p), b = vfloat::load(color[2] + p);
+                const vfloat v = vfloat::load(color[3] + p);
+                const vfloat l = luminance(r, g, b);
+                // Допуск — по дисперсии, сглаженной гауссианой 3x3: у оценки по двум-трём сэмплам она сама шумная
+                vfloat smooth(0.f);
+                for (int dy = -1; dy <= 1; dy++) {
+                    const size_t row = size_t(std::clamp(y + dy, 0, height - 1)) * stride + x;
+                    for (int dx = -1; dx <= 1; dx++)
+                        smooth = smooth + vfloat((dx ? .25f : .5f) * (dy ? .25f : .5f)) * vfloat::load(color[3] + row + dx);
+                }
+                const vfloat inv_sigma = vfloat(1.f) / (vfloat(SIGMA_LUMINANCE) * vsqrt(smooth) + vfloat(MIN_SIGMA));
+                // Центр входит всегда с весом ядра, даже в поле или без нормали — сумма весов не нулевая
+                const vfloat center(KERNEL[2] * KERNEL[2]);
+                vfloat sum_w = center, sum_r = r * center, sum_g = g * center, sum_b = b * center, sum_v = v * center * center;
+                for (int dy = -2; dy <= 2; dy++) {
+                    const int yy = y + dy * step;
+                    if (yy < 0 || yy >= height) continue;
+                    for (int dx = -2; dx <= 2; dx++) {
+                        if (!dx && !dy) continue;
+                        const size_t q = size_t(yy) * stride + x + dx * step;
+                        const vfloat qr = vfloat::load(color[0] + q), qg = vfloat::load(color[1] + q), qb = vfloat::load(color[2] + q);
+                        const vfloat dl = vabs(l - luminance(qr, qg, qb)) * inv_sigma;
+                        const vfloat w = vfloat(KERNEL[dy + 2] * KERNEL[dx + 2]) * geometry.normal_weight(normal, q)
+                                       * falloff(dl + geometry.depth_distance(depth, q, scale[dy + 2][dx + 2]));
+                        sum_w = sum_w + w;
+                        sum_r = sum_r + w * qr;
+                        sum_g = sum_g + w * qg;
+                        sum_b = sum_b + w * qb;
+                        sum_v = sum_v + w * w * vfloat::load(color[3] + q);
+                    }
+                }
+                const vfloat inv = vfloat(1.f) / sum_w;
+                (sum_r * inv).store(filtered[0] + p);
+                (sum_g * inv).store(filtered[1] + p);
+                (sum_b * inv).store(filtered[2] + p);
+                (sum_v * inv * inv).store(filtered[3] + p);
+            }
+        }
+        std::swap(color.data, filtered.data);
+    }
+
+#pragma omp parallel for schedule(static)
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            const size_t p = size_t(y) * width + x, q = size_t(y) * stride + x;
+            for (int c = 0; c < 3; c++) out[p * 3 + c] = color[c][q] * albedo(p, c);
+        }
+    }
+}
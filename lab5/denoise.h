@@ -0,0 +1,43 @@
+#ifndef DENOISE_H
+#define DENOISE_H
+
+#include <cstddef>
+#include <vector>
+#include "geometry.h"
+
+// Признаки первичного попадания пикселя (AOV): нормаль, цвет поверхности без освещения и расстояние.
+// У промаха нормаль — направление назад по лучу, цвет — сам фон (после деления на него фильтровать
+// нечего, и панорама не размывается), расстояние — MISS_DEPTH
+struct PixelFeatures {
+    vec3 normal, albedo;
+    float depth;
+};
+
+constexpr float MISS_DEPTH = 1e4f;
+
+// Признаки кадра: normal и albedo — по 3 float на пиксель, depth — по одному
+struct FeatureBuffer {
+    std::vector<float> normal, albedo, depth;
+    FeatureBuffer() = default;
+    explicit FeatureBuffer(const size_t pixels) : normal(pixels * 3), albedo(pixels * 3), depth(pixels) {}
+    void set(const size_t pixel, const PixelFeatures &f) {
+        for (int c = 0; c < 3; c++) { normal[pixel * 3 + c] = f.normal[c]; albedo[pixel * 3 + c] = f.albedo[c]; }
+        depth[pixel] = f.depth;
+    }
+    void add(const size_t pixel, const PixelFeatures &f) {
+        for (int c = 0; c < 3; c++) { normal[pixel * 3 + c] += f.normal[c]; albedo[pixel * 3 + c] += f.albedo[c]; }
+        depth[pixel] += f.depth;
+    }
+};
+
+// Вейвлетный фильтр à-trous с остановкой на краях (Dammertz et al., «Edge-Avoiding À-Trous Wavelet
+// Transform»): 5 проходов ядра B3-сплайна 5x5 с шагом 1, 2, 4, 8, 16 пикселей. Вес соседа падает с разницей
+// нормалей, относительной разницей глубины и разницей яркости, отнесённой к шуму пикселя (как в SVGF):
+// чистые места не размываются. Цвет перед фильтром делится на albedo и после умножается обратно,
+// поэтому текстуры и шахматка остаются резкими — фильтруется только освещение.
+// variance — дисперсия средней яркости пикселя по его сэмплам; nullptr — оценить по соседям 5x5 (1 сэмпл).
+// hdr и out — линейный RGB float (могут совпадать); параллельно по строкам, SIMD_WIDTH пикселей за раз
+void denoise(const float *hdr, const FeatureBuffer &features, const float *variance, const int width, const int height,
+             float *out);
+
+#endif // DENOISE_H
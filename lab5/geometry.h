@@ -0,0 +1,53 @@
+#ifndef GEOMETRY_H
+#define GEOMETRY_H
+
+#include <algorithm>
+#include <cmath>
+
+struct vec3 {
+    float x=0, y=0, z=0;
+          float& operator[](const int i)       { return i==0 ? x : (1==i ? y : z); }
+    const float& operator[](const int i) const { return i==0 ? x : (1==i ? y : z); }
+    vec3  operator*(const float v) const { return {x*v, y*v, z*v};       }
+    float operator*(const vec3& v) const { return x*v.x + y*v.y + z*v.z; }
+    vec3  operator+(const vec3& v) const { return {x+v.x, y+v.y, z+v.z}; }
+    vec3  operator-(const vec3& v) const { return {x-v.x, y-v.y, z-v.z}; }
+    vec3  operator-()              const { return {-x, -y, -z};          }
+    float norm() const { return std::sqrt(x*x+y*y+z*z); }
+    vec3 normalized() const { return (*this)*(1.f/norm()); }
+};
+
+inline vec3 cross(const vec3 v1, const vec3 v2) {
+    return { v1.y*v2.z - v1.z*v2.y, v1.z*v2.x - v1.x*v2.z, v1.x*v2.y - v1.y*v2.x };
+}
+
+// Ортонормированный базис вокруг единичного n (Duff et al., «Building an Orthonormal Basis, Revisited»)
+inline void basis(const vec3 &n, vec3 &t, vec3 &b) {
+    const float sign = std::copysign(1.f, n.z);
+    const float a = -1 / (sign + n.z), c = n.x * n.y * a;
+    t = {1 + sign * n.x * n.x * a, sign * c, -sign * n.x};
+    b = {c, sign + n.y * n.y * a, -n.y};
+}
+
+// Направление вокруг единичной оси axis: cos угла с осью и азимут
+inline vec3 around(const vec3 &axis, const float cos_theta, const float phi) {
+    vec3 t, b;
+    basis(axis, t, b);
+    const float sin_theta = std::sqrt(std::max(0.f, 1 - cos_theta * cos_theta));
+    return t * (sin_theta * std::cos(phi)) + b * (sin_theta * std::sin(phi)) + axis * cos_theta;
+}
+
+struct Material {
+    float refractive_index = 1;
+    float albedo[4] = {2,0,0,0};
+    vec3 diffuse_color = {0,0,0};
+    float specular_exponent = 0;
+};
+
+struct Sphere {
+    vec3 center;
+    float radius;
+    Material material;
+};
+
+#endif // GEOMETRY_H
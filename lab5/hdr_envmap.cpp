@@ -0,0 +1,219 @@
+#include "hdr_envmap.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <string>
+#include <stb_image.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "texture.h"
+
+namespace {
+
+constexpr char MAGIC[8] = {'L', '5', 'H', 'D', 'R', 'C', 'U', 'B'};
+constexpr uint32_t VERSION = 1;
+constexpr size_t HEADER_BYTES = 4096; // тайлы начинаются с границы страницы
+constexpr int TILE = HdrCubeMap::TILE;
+
+struct FileHeader {
+    char magic[8];
+    uint32_t version, face_size, tile, reserved;
+    uint64_t hash; // hash_file исходного .hdr
+};
+
+// Уровни и номера тайлов однозначно следуют из размера грани — в файле хранится только он
+std::vector<HdrCubeMap::Level> make_levels(const int face_size, size_t &tiles_per_face) {
+    std::vector<HdrCubeMap::Level> levels;
+    tiles_per_face = 0;
+    for (int size = face_size;; size = std::max(1, size / 2)) {
+        HdrCubeMap::Level l;
+        l.size = size;
+        l.tiles_per_row = (size + TILE - 1) / TILE;
+        l.first_tile = tiles_per_face;
+        tiles_per_face += size_t(l.tiles_per_row) * l.tiles_per_row;
+        levels.push_back(l);
+        if (size == 1) break;
+    }
+    return levels;
+}
+
+// RGBE: общий порядок трёх каналов в старшем байте, как в самом формате .hdr
+uint32_t encode_rgbe(const float r, const float g, const float b) {
+    const float m = std::max(r, std::max(g, b));
+    if (m < 1e-32f) return 0;
+    int e;
+    const float f = std::frexp(m, &e) * 256.f / m;
+    auto q = [f](const float c) { return static_cast<uint32_t>(std::min(255.f, std::max(0.f, c * f))); };
+    return q(r) | q(g) << 8 | q(b) << 16 | uint32_t(e + 128) << 24;
+}
+
+struct RgbeTable {
+    float scale[256];
+    RgbeTable() {
+        scale[0] = 0;
+        for (int e = 1; e < 256; e++) scale[e] = std::ldexp(1.f, e - 136);
+    }
+};
+const RgbeTable rgbe_table;
+
+inline vec3 decode_rgbe(const uint32_t t) {
+    const float s = rgbe_table.scale[t >> 24];
+    return {(t & 255) * s, (t >> 8 & 255) * s, (t >> 16 & 255) * s};
+}
+
+// Билинейная выборка float-панорамы: по u повторяется, по v зажата
+vec3 sample_equirect(const float *rgb, const int width, const int height, const float u, const float v) {
+    float x = u * width - .5f, y = v * height - .5f;
+    float fx = std::floor(x), fy = std::floor(y);
+    float tx = x - fx, ty = y - fy;
+    int x0 = static_cast<int>(fx), y0 = static_cast<int>(fy);
+    int xa = (x0 % width + width) % width, xb = (xa + 1) % width;
+    int ya = std::min(std::max(y0, 0), height - 1), yb = std::min(std::max(y0 + 1, 0), height - 1);
+    auto at = [&](const int i, const int j) {
+        const float *p = rgb + (size_t(j) * width + i) * 3;
+        return vec3{p[0], p[1], p[2]};
+    };
+    return (at(xa, ya) * (1 - tx) + at(xb, ya) * tx) * (1 - ty) + (at(xa, yb) * (1 - tx) + at(xb, yb) * tx) * ty;
+}
+
+} // namespace
+
+HdrCubeMap::~HdrCubeMap() {
+    if (map) munmap(map, map_bytes);
+}
+
+size_t HdrCubeMap::touched_tiles() const {
+    size_t n = 0;
+    for (size_t i = 0; i < tile_count(); i++) n += touched[i].load(std::memory_order_relaxed);
+    return n;
+}
+
+vec3 HdrCubeMap::fetch(const int face, const int level, int x, int y) const {
+    const Level &l = levels[level];
+    x = std::min(std::max(x, 0), l.size - 1);
+    y = std::min(std::max(y, 0), l.size - 1);
+    const size_t tile = face * tiles_per_face + l.first_tile + size_t(y / TILE) * l.tiles_per_row + x / TILE;
+    if (!touched[tile].load(std::memory_order_relaxed)) touched[tile].store(1, std::memory_order_relaxed);
+    return decode_rgbe(texels[tile * TILE * TILE + (y % TILE) * TILE + x % TILE]);
+}
+
+vec3 HdrCubeMap::bilinear(const int face, const int level, const float u, const float v) const {
+    const int size = levels[level].size;
+    float x = u * size - .5f, y = v * size - .5f;
+    float fx = std::floor(x), fy = std::floor(y);
+    float tx = x - fx, ty = y - fy;
+    int x0 = static_cast<int>(fx), y0 = static_cast<int>(fy);
+    return (fetch(face, level, x0, y0) * (1 - tx) + fetch(face, level, x0 + 1, y0) * tx) * (1 - ty)
+         + (fetch(face, level, x0, y0 + 1) * (1 - tx) + fetch(face, level, x0 + 1, y0 + 1) * tx) * ty;
+}
+
+vec3 HdrCubeMap::sample(const vec3 &dir, const float lod) const {
+    float u, v;
+    const int face = cube_face(dir, u, v);
+    const float l = std::min(std::max(lod, 0.f), static_cast<float>(levels.size() - 1));
+    const int l0 = static_cast<int>(l);
+    const float t = l - l0;
+    vec3 c = bilinear(face, l0, u, v);
+    if (t > 0 && l0 + 1 < static_cast<int>(levels.size())) c = c * (1 - t) + bilinear(face, l0 + 1, u, v) * t;
+    return c;
+}
+
+bool convert_hdr_envmap(const char *hdr_path, const char *tiled_path, const uint64_t hash) {
+    int width, height, n;
+    float *rgb = stbi_loadf(hdr_path, &width, &height, &n, 3);
+    if (!rgb) return false;
+    const int face_size = std::max(1, static_cast<int>(std::lround(width / M_PI)));
+
+    size_t tiles_per_face;
+    const std::vector<HdrCubeMap::Level> levels = make_levels(face_size, tiles_per_face);
+    // Пишется во временный файл и переименовывается целиком: прерванная конвертация не оставит обрезанный файл
+    const std::string tmp_path = std::string(tiled_path) + ".tmp";
+    std::ofstream out(tmp_path, std::ios::binary);
+    FileHeader header = {};
+    std::memcpy(header.magic, MAGIC, sizeof MAGIC);
+    header.version = VERSION;
+    header.face_size = face_size;
+    header.tile = TILE;
+    header.hash = hash;
+    std::vector<char> pad(HEADER_BYTES, 0);
+    std::memcpy(pad.data(), &header, sizeof header);
+    out.write(pad.data(), pad.size());
+
+    // Грань за гранью: float-уровни в памяти, на диск — только RGBE-тайлы
+    std::vector<uint32_t> tiles(tiles_per_face * TILE * TILE);
+    for (int face = 0; face < 6 && out; face++) {
+        std::vector<vec3> src(size_t(face_size) * face_size);
+#pragma omp parallel for
+        for (int j = 0; j < face_size; j++) {
+            for (int i = 0; i < face_size; i++) {
+                float u, v;
+                equirect_uv(cube_face_dir(face, (i + .5f) / face_size, (j + .5f) / face_size).normalized(), u, v);
+                src[size_t(j) * face_size + i] = sample_equirect(rgb, width, height, u, v);
+            }
+        }
+        std::fill(tiles.begin(), tiles.end(), 0);
+        for (size_t level = 0; level < levels.size(); level++) {
+            const HdrCubeMap::Level &l = levels[level];
+            if (level > 0) { // среднее 2x2 предыдущего уровня
+                const int prev = levels[level - 1].size;
+                std::vector<vec3> dst(size_t(l.size) * l.size);
+                for (int j = 0; j < l.size; j++) {
+                    int j0 = std::min(2 * j, prev - 1), j1 = std::min(2 * j + 1, prev - 1);
+                    for (int i = 0; i < l.size; i++) {
+                        int i0 = std::min(2 * i, prev - 1), i1 = std::min(2 * i + 1, prev - 1);
+                        dst[size_t(j) * l.size + i] = (src[size_t(j0) * prev + i0] + src[size_t(j0) * prev + i1]
+                                                     + src[size_t(j1) * prev + i0] + src[size_t(j1) * prev + i1]) * .25f;
+                    }
+                }
+                src.swap(dst);
+            }
+            for (int j = 0; j < l.size; j++) {
+                for (int i = 0; i < l.size; i++) {
+                    const vec3 &c = src[size_t(j) * l.size + i];
+                    const size_t tile = l.first_tile + size_t(j / TILE) * l.tiles_per_row + i / TILE;
+                    tiles[tile * TILE * TILE + (j % TILE) * TILE + i % TILE] = encode_rgbe(c.x, c.y, c.z);
+                }
+            }
+        }
+        out.write(reinterpret_cast<const char *>(tiles.data()), tiles.size() * sizeof(uint32_t));
+    }
+    stbi_image_free(rgb);
+    out.close();
+    if (!out || std::rename(tmp_path.c_str(), tiled_path) != 0) {
+        std::remove(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool open_hdr_envmap(const char *tiled_path, const uint64_t hash, HdrCubeMap &cube) {
+    const int fd = open(tiled_path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    FileHeader header;
+    if (fstat(fd, &st) != 0 || size_t(st.st_size) < HEADER_BYTES || pread(fd, &header, sizeof header, 0) != sizeof header
+        || std::memcmp(header.magic, MAGIC, sizeof MAGIC) != 0 || header.version != VERSION || header.tile != uint32_t(TILE)
+        || header.hash != hash) {
+        close(fd);
+        return false;
+    }
+    size_t tiles_per_face;
+    std::vector<HdrCubeMap::Level> levels = make_levels(static_cast<int>(header.face_size), tiles_per_face);
+    const size_t expected = HEADER_BYTES + 6 * tiles_per_face * TILE * TILE * sizeof(uint32_t);
+    void *map = size_t(st.st_size) == expected ? mmap(nullptr, expected, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED) return false;
+    madvise(map, expected, MADV_RANDOM); // без упреждающего чтения: в память попадают только тронутые тайлы
+    cube.levels = std::move(levels);
+    cube.tiles_per_face = tiles_per_face;
+    cube.map = map;
+    cube.map_bytes = expected;
+    cube.texels = reinterpret_cast<const uint32_t *>(static_cast<const char *>(map) + HEADER_BYTES);
+    cube.touched.reset(new std::atomic<uint8_t>[cube.tile_count()]());
+    return true;
+}
@@ -0,0 +1,57 @@
+#ifndef HDR_ENVMAP_H
+#define HDR_ENVMAP_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "geometry.h"
+
+// HDR-окружение вне оперативной памяти. Панорама .hdr один раз переводится в кубическую карту
+// с mip-уровнями и пишется на диск тайлами TILE x TILE текселей RGBE (4 байта, общий порядок).
+// Файл отображается через mmap без предзагрузки: страница тайла читается с диска,
+// только когда её впервые коснётся выборка.
+struct HdrCubeMap {
+    static constexpr int TILE = 64; // тайл 64x64x4 = 16 КБ — четыре страницы подряд
+
+    struct Level {
+        int size = 0, tiles_per_row = 0;
+        size_t first_tile = 0; // номер первого тайла уровня внутри грани
+    };
+
+    HdrCubeMap() = default;
+    HdrCubeMap(const HdrCubeMap &) = delete;
+    HdrCubeMap &operator=(const HdrCubeMap &) = delete;
+    ~HdrCubeMap();
+
+    bool mapped() const { return texels != nullptr; }
+    int face_size() const { return levels.empty() ? 0 : levels[0].size; }
+    size_t tile_count() const { return 6 * tiles_per_face; }
+    size_t touched_tiles() const;
+    size_t file_bytes() const { return map_bytes; }
+
+    // lod — log2 следа выборки в текселях грани
+    vec3 sample(const vec3 &dir, const float lod) const;
+
+    std::vector<Level> levels;
+    size_t tiles_per_face = 0;
+    const uint32_t *texels = nullptr; // начало тайлов в отображении
+    void *map = nullptr;
+    size_t map_bytes = 0;
+    std::unique_ptr<std::atomic<uint8_t>[]> touched; // по флагу на тайл — для статистики подкачки
+
+private:
+    vec3 fetch(const int face, const int level, int x, int y) const;
+    vec3 bilinear(const int face, const int level, const float u, const float v) const;
+};
+
+// Переводит .hdr (stbi_loadf) в тайловый файл с хэшем исходника hash (hash_file из кэша изображений); грань — width/pi текселей, как у make_cubemap.
+// false — при ошибке чтения/записи.
+bool convert_hdr_envmap(const char *hdr_path, const char *tiled_path, const uint64_t hash);
+
+// Отображает тайловый файл в память. false — файла нет, он другой версии, от другого исходника (хэш не hash)
+// или обрезан: тогда его надо сконвертировать заново
+bool open_hdr_envmap(const char *tiled_path, const uint64_t hash, HdrCubeMap &cube);
+
+#endif // HDR_ENVMAP_H
@@ -0,0 +1,539 @@
+#include "image_output.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <immintrin.h>
+#include <iostream>
+#include <omp.h>
+#include <stb_image_write.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+namespace {
+
+void put_be32(std::vector<unsigned char> &out, const uint32_t v) {
+    out.insert(out.end(), {static_cast<unsigned char>(v >> 24), static_cast<unsigned char>(v >> 16),
+                           static_cast<unsigned char>(v >> 8), static_cast<unsigned char>(v)});
+}
+
+bool write_file(const std::string &path, const std::vector<unsigned char> &data) {
+    std::ofstream out(path, std::ios::binary);
+    out.write(reinterpret_cast<const char *>(data.data()), data.size());
+    return static_cast<bool>(out);
+}
+
+std::vector<unsigned char> encode_ppm(const int width, const int height, const unsigned char *rgb) {
+    const std::string header = "P6\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n";
+    std::vector<unsigned char> out(header.begin(), header.end());
+    out.insert(out.end(), rgb, rgb + size_t(width) * height * 3);
+    return out;
+}
+
+// QOI (qoiformat.org): серии, индекс из 64 недавних цветов, малые разности с предыдущим пикселем.
+// Состояние кодера переживает полосу, поэтому кадр можно кодировать по частям.
+struct QoiState {
+    uint32_t index[64] = {};
+    unsigned char pr = 0, pg = 0, pb = 0; // предыдущий пиксель, альфа всегда 255
+    int run = 0;
+};
+
+void qoi_header(std::vector<unsigned char> &out, const int width, const int height) {
+    out.insert(out.end(), {'q', 'o', 'i', 'f'});
+    put_be32(out, width);
+    put_be32(out, height);
+    out.push_back(3); // RGB
+    out.push_back(0); // sRGB
+}
+
+// last — пиксели заканчивают кадр: дописываются незакрытая серия и конечный маркер
+void qoi_pixels(QoiState &st, const unsigned char *rgb, const size_t count, const bool last, std::vector<unsigned char> &out) {
+    for (size_t i = 0; i < count; i++) {
+        const unsigned char r = rgb[i * 3], g = rgb[i * 3 + 1], b = rgb[i * 3 + 2];
+        if (r == st.pr && g == st.pg && b == st.pb) {
+            if (++st.run == 62) { out.push_back(0xc0 | (st.run - 1)); st.run = 0; }
+            continue;
+        }
+        if (st.run) { out.push_back(0xc0 | (st.run - 1)); st.run = 0; }
+        const uint32_t color = r | g << 8 | b << 16 | 255u << 24;
+        const int slot = (r * 3 + g * 5 + b * 7 + 255 * 11) % 64;
+        if (st.index[slot] == color) {
+            out.push_back(slot);
+        } else {
+            st.index[slot] = color;
+            const int dr = int8_t(r - st.pr), dg = int8_t(g - st.pg), db = int8_t(b - st.pb);
+            const int dr_dg = dr - dg, db_dg = db - dg;
+            if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1)
+                out.push_back(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+            else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7)
+                out.insert(out.end(), {static_cast<unsigned char>(0x80 | (dg + 32)), static_cast<unsigned char>((dr_dg + 8) << 4 | (db_dg + 8))});
+            else
+                out.insert(out.end(), {0xfe, r, g, b});
+        }
+        st.pr = r; st.pg = g; st.pb = b;
+    }
+    if (!last) return;
+    if (st.run) { out.push_back(0xc0 | (st.run - 1)); st.run = 0; }
+    out.insert(out.end(), {0, 0, 0, 0, 0, 0, 0, 1});
+}
+
+std::vector<unsigned char> encode_qoi(const int width, const int height, const unsigned char *rgb) {
+    std::vector<unsigned char> out;
+    out.reserve(14 + size_t(width) * height * 4 + 8);
+    qoi_header(out, width, height);
+    QoiState st;
+    qoi_pixels(st, rgb, size_t(width) * height, true, out);
+    return out;
+}
+
+// IEEE half из float с округлением к ближайшему (F16C, если есть)
+inline uint16_t to_half(const float f) {
+#if defined(__F16C__)
+    return static_cast<uint16_t>(_mm_extract_epi16(_mm_cvtps_ph(_mm_set_ss(f), _MM_FROUND_TO_NEAREST_INT), 0));
+#else
+    uint32_t x;
+    std::memcpy(&x, &f, sizeof x);
+    const uint32_t sign = x >> 16 & 0x8000, abs = x & 0x7fffffff;
+    if (abs >= 0x7f800000) return static_cast<uint16_t>(sign | 0x7c00 | (abs > 0x7f800000 ? 0x200 : 0)); // inf, NaN
+    if (abs >= 0x477ff000) return static_cast<uint16_t>(sign | 0x7c00); // за пределом half — бесконечность
+    if (abs < 0x38800000) { // денормализованное half
+        const uint32_t mant = (abs & 0x7fffff) | 0x800000;
+        const int shift = 126 - int(abs >> 23);
+        if (shift > 24) return static_cast<uint16_t>(sign);
+        const uint32_t half = mant >> shift, rest = mant & ((1u << shift) - 1), mid = 1u << (shift - 1);
+        return static_cast<uint16_t>(sign | (half + (rest > mid || (rest == mid && (half & 1)))));
+    }
+    const uint32_t h = ((abs - 0x38000000) >> 13), rest = abs & 0x1fff;
+    return static_cast<uint16_t>(sign | (h + (rest > 0x1000 || (rest == 0x1000 && (h & 1)))));
+#endif
+}
+
+// OpenEXR, однослойный scanline-файл: каналы B, G, R (по алфавиту) в half, без сжатия, по строке в блоке
+size_t exr_line_bytes(const int width) { return 8 + size_t(width) * 3 * 2; }
+
+void exr_header(std::vector<unsigned char> &out, const int width, const int height) {
+    auto raw = [&out](const void *data, const size_t size) {
+        out.insert(out.end(), static_cast<const unsigned char *>(data), static_cast<const unsigned char *>(data) + size);
+    };
+    auto i32 = [&raw](const int32_t v) { raw(&v, 4); };
+    auto attribute = [&](const char *name, const char *type, const int32_t size) {
+        raw(name, std::strlen(name) + 1);
+        raw(type, std::strlen(type) + 1);
+        i32(size);
+    };
+    i32(20000630); // магическое число
+    i32(2);        // версия 2, одна часть, scanline
+    attribute("channels", "chlist", 3 * 18 + 1);
+    for (const char *channel : {"B", "G", "R"}) {
+        raw(channel, 2);
+        i32(1); // HALF
+        i32(0); // pLinear и резерв
+        i32(1); // xSampling
+        i32(1); // ySampling
+    }
+    out.push_back(0);
+    attribute("compression", "compression", 1);
+    out.push_back(0); // NO_COMPRESSION
+    for (const char *window : {"dataWindow", "displayWindow"}) {
+        attribute(window, "box2i", 16);
+        i32(0); i32(0); i32(width - 1); i32(height - 1);
+    }
+    attribute("lineOrder", "lineOrder", 1);
+    out.push_back(0); // INCREASING_Y
+    const float one = 1, zero = 0;
+    attribute("pixelAspectRatio", "float", 4);
+    raw(&one, 4);
+    attribute("screenWindowCenter", "v2f", 8);
+    raw(&zero, 4); raw(&zero, 4);
+    attribute("screenWindowWidth", "float", 4);
+    raw(&one, 4);
+    out.push_back(0); // конец заголовка
+
+    // Таблица смещений строк: размер строки постоянен, поэтому она известна до рендера
+    const uint64_t start = out.size() + uint64_t(height) * 8;
+    for (int y = 0; y < height; y++) {
+        const uint64_t offset = start + y * exr_line_bytes(width);
+        raw(&offset, 8);
+    }
+}
+
+// Строки first_row... кадра из RGB float
+void exr_lines(const float *hdr, const int first_row, const int rows, const int width, std::vector<unsigned char> &out) {
+    const size_t begin = out.size();
+    out.resize(begin + rows * exr_line_bytes(width));
+#pragma omp parallel for schedule(static)
+    for (int y = 0; y < rows; y++) {
+        unsigned char *line = &out[begin + y * exr_line_bytes(width)];
+        const int32_t header[2] = {first_row + y, int32_t(width * 3 * 2)};
+        std::memcpy(line, header, 8);
+        uint16_t *half = reinterpret_cast<uint16_t *>(line + 8);
+        const float *src = hdr + size_t(y) * width * 3;
+        for (int x = 0; x < width; x++) {
+            half[x]             = to_half(src[x * 3 + 2]);
+            half[width + x]     = to_half(src[x * 3 + 1]);
+            half[2 * width + x] = to_half(src[x * 3]);
+        }
+    }
+}
+
+std::vector<unsigned char> encode_exr(const int width, const int height, const float *hdr) {
+    std::vector<unsigned char> out;
+    exr_header(out, width, height);
+    exr_lines(hdr, 0, height, width, out);
+    return out;
+}
+
+#ifdef HAVE_ZLIB
+// Уровень 1: после фильтров строк файл всё равно меньше, чем у stb, а сжатие в разы быстрее уровня 6
+constexpr int PNG_LEVEL = 1;
+
+inline unsigned char paeth(const int a, const int b, const int c) {
+    const int p = a + b - c, pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+    return static_cast<unsigned char>(pa <= pb && pa <= pc ? a : pb <= pc ? b : c);
+}
+
+// Строка с фильтром PNG, у которого сумма |байт| меньше (та же эвристика, что у stb).
+// Каждый фильтр — отдельный простой цикл, чтобы компилятор его векторизовал.
+void filter_row(const unsigned char *row, const unsigned char *prev, const int bytes, unsigned char *out,
+                std::vector<unsigned char> &trial) {
+    trial.resize(bytes);
+    unsigned char *f = trial.data();
+    long best_sum = -1;
+    for (int type = 0; type < 5; type++) {
+        if (!prev && (type == 2 || type == 4)) continue; // у первой строки Up = None, Paeth = Sub
+        switch (type) {
+            case 0: std::copy(row, row + bytes, f); break;
+            case 1:
+                for (int i = 0; i < 3; i++) f[i] = row[i];
+                for (int i = 3; i < bytes; i++) f[i] = row[i] - row[i - 3];
+                break;
+            case 2: for (int i = 0; i < bytes; i++) f[i] = row[i] - prev[i]; break;
+            case 3:
+                for (int i = 0; i < 3; i++) f[i] = row[i] - ((prev ? prev[i] : 0) >> 1);
+                for (int i = 3; i < bytes; i++) f[i] = row[i] - ((row[i - 3] + (prev ? prev[i] : 0)) >> 1);
+                break;
+            case 4:
+                for (int i = 0; i < 3; i++) f[i] = row[i] - prev[i];
+                for (int i = 3; i < bytes; i++) f[i] = row[i] - paeth(row[i - 3], prev[i], prev[i - 3]);
+                break;
+        }
+        long sum = 0;
+        for (int i = 0; i < bytes; i++) sum += std::abs(static_cast<signed char>(f[i]));
+        if (best_sum < 0 || sum < best_sum) {
+            best_sum = sum;
+            out[0] = static_cast<unsigned char>(type);
+            std::copy(f, f + bytes, out + 1);
+        }
+    }
+}
+
+// Фильтрует rows строк параллельно; prev — строка над первой (nullptr в начале кадра)
+std::vector<unsigned char> filter_rows(const unsigned char *rgb, const unsigned char *prev, const int width, const int rows) {
+    const int stride = width * 3;
+    std::vector<unsigned char> filtered(size_t(rows) * (stride + 1));
+#pragma omp parallel
+    {
+        std::vector<unsigned char> trial;
+#pragma omp for schedule(static)
+        for (int y = 0; y < rows; y++)
+            filter_row(rgb + size_t(y) * stride, y ? rgb + size_t(y - 1) * stride : prev, stride,
+                       &filtered[size_t(y) * (stride + 1)], trial);
+    }
+    return filtered;
+}
+
+// Дописывает в out сжатые отфильтрованные строки и продолжает adler32 несжатых данных.
+// Полоса — самостоятельный raw-deflate без общего словаря; все, кроме последней в потоке (last), кончаются
+// Z_SYNC_FLUSH (выравнивание на байт, без флага последнего блока), поэтому полосы склеиваются простой конкатенацией
+bool deflate_rows(const std::vector<unsigned char> &filtered, const int row_bytes, const bool last,
+                  std::vector<unsigned char> &out, uLong &checksum) {
+    const int rows = static_cast<int>(filtered.size() / row_bytes);
+    const int rows_per_strip = std::max(16, rows / (4 * omp_get_max_threads()));
+    const int strips = (rows + rows_per_strip - 1) / rows_per_strip;
+    std::vector<std::vector<unsigned char>> packed(strips);
+    std::vector<uLong> adler(strips), length(strips);
+    bool failed = false;
+#pragma omp parallel for schedule(dynamic, 1) reduction(||:failed)
+    for (int s = 0; s < strips; s++) {
+        const unsigned char *begin = &filtered[size_t(s) * rows_per_strip * row_bytes];
+        const size_t size = size_t(std::min(rows_per_strip, rows - s * rows_per_strip)) * row_bytes;
+        const bool end = last && s + 1 == strips;
+        z_stream z = {};
+        if (deflateInit2(&z, PNG_LEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) { failed = true; continue; }
+        packed[s].resize(deflateBound(&z, size) + 16);
+        z.next_in = const_cast<unsigned char *>(begin);
+        z.avail_in = static_cast<uInt>(size);
+        z.next_out = packed[s].data();
+        z.avail_out = static_cast<uInt>(packed[s].size());
+        if (deflate(&z, end ? Z_FINISH : Z_SYNC_FLUSH) != (end ? Z_STREAM_END : Z_OK)) failed = true; // не затирать прежние ошибки потока
+        packed[s].resize(z.total_out);
+        deflateEnd(&z);
+        adler[s] = adler32(1, begin, static_cast<uInt>(size));
+        length[s] = size;
+    }
+    if (failed) return false;
+    for (int s = 0; s < strips; s++) {
+        out.insert(out.end(), packed[s].begin(), packed[s].end());
+        checksum = adler32_combine(checksum, adler[s], length[s]);
+    }
+    return true;
+}
+
+void png_chunk(std::vector<unsigned char> &out, const std::vector<unsigned char> &typed) { // тип + данные
+    put_be32(out, static_cast<uint32_t>(typed.size() - 4));
+    out.insert(out.end(), typed.begin(), typed.end());
+    put_be32(out, crc32(0, typed.data(), static_cast<uInt>(typed.size())));
+}
+
+void png_header(std::vector<unsigned char> &out, const int width, const int height) {
+    out.insert(out.end(), {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'});
+    std::vector<unsigned char> ihdr = {'I', 'H', 'D', 'R'};
+    put_be32(ihdr, width);
+    put_be32(ihdr, height);
+    ihdr.insert(ihdr.end(), {8, 2, 0, 0, 0}); // 8 бит, RGB, deflate, адаптивные фильтры, без чересстрочности
+    png_chunk(out, ihdr);
+}
+
+std::vector<unsigned char> encode_png(const int width, const int height, const unsigned char *rgb) {
+    std::vector<unsigned char> idat = {'I', 'D', 'A', 'T', 0x78, 0x9c};
+    uLong checksum = adler32(0, nullptr, 0);
+    if (!deflate_rows(filter_rows(rgb, nullptr, width, height), width * 3 + 1, true, idat, checksum)) return {};
+    put_be32(idat, checksum);
+
+    std::vector<unsigned char> out;
+    png_header(out, width, height);
+    png_chunk(out, idat);
+    png_chunk(out, {'I', 'E', 'N', 'D'});
+    return out;
+}
+#endif
+
+} // namespace
+
+bool parse_image_format(const std::string &name, ImageFormat &format) {
+    if (name == "png") format = ImageFormat::png;
+    else if (name == "ppm") format = ImageFormat::ppm;
+    else if (name == "qoi") format = ImageFormat::qoi;
+    else if (name == "exr") format = ImageFormat::exr;
+    else return false;
+    return true;
+}
+
+const char *image_extension(const ImageFormat format) {
+    switch (format) {
+        case ImageFormat::ppm: return ".ppm";
+        case ImageFormat::qoi: return ".qoi";
+        case ImageFormat::exr: return ".exr";
+        default:               return ".png";
+    }
+}
+
+bool write_image(const std::string &path, const ImageFormat format, const int width, const int height,
+                 const unsigned char *rgb, const float *hdr) {
+    if (format == ImageFormat::exr) return hdr && write_file(path, encode_exr(width, height, hdr));
+    if (format == ImageFormat::ppm) return write_file(path, encode_ppm(width, height, rgb));
+    if (format == ImageFormat::qoi) return write_file(path, encode_qoi(width, height, rgb));
+#ifdef HAVE_ZLIB
+    const std::vector<unsigned char> png = encode_png(width, height, rgb);
+    return !png.empty() && write_file(path, png);
+#else
+    return stbi_write_png(path.c_str(), width, height, 3, rgb, width * 3) != 0;
+#endif
+}
+
+ImageWriter::ImageWriter() : worker(&ImageWriter::run, this) {}
+
+ImageWriter::~ImageWriter() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    changed.notify_all();
+    worker.join();
+}
+
+void ImageWriter::submit(const std::string &path, const ImageFormat format, const int width, const int height,
+                         std::vector<unsigned char> rgb, std::vector<float> hdr) {
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        if (queue.size() >= MAX_QUEUED) {
+            auto start = std::chrono::steady_clock::now();
+            changed.wait(guard, [this] { return queue.size() < MAX_QUEUED; });
+            blocked_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        }
+        queue.push_back({path, format, width, height, std::move(rgb), std::move(hdr)});
+    }
+    changed.notify_all();
+}
+
+void ImageWriter::wait() {
+    std::unique_lock<std::mutex> guard(lock);
+    changed.wait(guard, [this] { return queue.empty() && !busy; });
+}
+
+bool ImageWriter::idle() {
+    std::lock_guard<std::mutex> guard(lock);
+    return queue.empty() && !busy;
+}
+
+void ImageWriter::run() {
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+        changed.wait(guard, [this] { return stopping || !queue.empty(); });
+        if (queue.empty()) return; // stopping и всё записано
+        Job job = std::move(queue.front());
+        queue.pop_front();
+        busy = true;
+        guard.unlock();
+        changed.notify_all(); // в очереди освободилось место для submit
+
+        auto start = std::chrono::steady_clock::now();
+        const bool ok = write_image(job.path, job.format, job.width, job.height, job.rgb.data(), job.hdr.data());
+        const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        if (!ok) std::cerr << "Error: unable to write the image " << job.path << std::endl;
+        std::error_code ec;
+        const size_t size = ok ? std::filesystem::file_size(job.path, ec) : 0;
+
+        guard.lock();
+        busy = false;
+        images += ok;
+        total_ms += ms;
+        total_bytes += ec ? 0 : size;
+        changed.notify_all();
+    }
+}
+
+struct BandWriter::Encoder {
+    QoiState qoi;
+#ifdef HAVE_ZLIB
+    std::vector<unsigned char> last_row; // строка над текущей полосой для фильтров PNG
+    uLong checksum = adler32(0, nullptr, 0);
+#endif
+};
+
+BandWriter::BandWriter(const std::string &path, const ImageFormat format, const int width, const int height,
+                       const int band_rows)
+    : format(format), width(width), height(height), band_rows(band_rows),
+      bands((height + band_rows - 1) / band_rows), out(path, std::ios::binary), encoder(new Encoder) {
+#ifndef HAVE_ZLIB
+    if (format == ImageFormat::png) {
+        std::cerr << "Error: streaming PNG output needs zlib, use --format ppm or qoi" << std::endl;
+        good = false;
+    }
+#endif
+    if (!out) {
+        std::cerr << "Error: unable to write the image " << path << std::endl;
+        good = false;
+    }
+    std::vector<unsigned char> header;
+    if (format == ImageFormat::ppm) {
+        const std::string text = "P6\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n";
+        header.assign(text.begin(), text.end());
+    }
+    else if (format == ImageFormat::qoi) qoi_header(header, width, height);
+    else if (format == ImageFormat::exr) exr_header(header, width, height);
+#ifdef HAVE_ZLIB
+    else png_header(header, width, height);
+#endif
+    out.write(reinterpret_cast<const char *>(header.data()), header.size());
+    total_bytes = header.size();
+    worker = std::thread(&BandWriter::run, this);
+}
+
+BandWriter::~BandWriter() {
+    finish();
+    delete encoder;
+}
+
+void BandWriter::submit(const int band, std::vector<unsigned char> rgb, std::vector<float> hdr) {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        Band data{std::move(rgb), std::move(hdr)};
+        queued_bytes += data.bytes();
+        peak_bytes = std::max(peak_bytes, queued_bytes);
+        queue.emplace(band, std::move(data));
+    }
+    changed.notify_all();
+}
+
+void BandWriter::wait_queued(const size_t max_bytes) {
+    std::unique_lock<std::mutex> guard(lock);
+    changed.wait(guard, [&] { return queued_bytes <= max_bytes || next == bands; });
+}
+
+bool BandWriter::finish() {
+    if (worker.joinable()) {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            // Ждём, пока поток записи не дойдёт до конца или до полосы, которая так и не пришла
+            changed.wait(guard, [this] { return next == bands || (!busy && (queue.empty() || queue.begin()->first != next)); });
+            if (next < bands) good = false; // кадр неполный
+            stopping = true;
+        }
+        changed.notify_all();
+        worker.join();
+        out.close();
+    }
+    return good && static_cast<bool>(out);
+}
+
+void BandWriter::run() {
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+        changed.wait(guard, [this] { return stopping || (!queue.empty() && queue.begin()->first == next); });
+        if (stopping) return;
+        Band data = std::move(queue.begin()->second);
+        queue.erase(queue.begin());
+        busy = true;
+        guard.unlock();
+
+        auto start = std::chrono::steady_clock::now();
+        const bool ok = good && write_band(next, data);
+        const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        guard.lock();
+        busy = false;
+        if (!ok) good = false;
+        queued_bytes -= data.bytes();
+        total_ms += ms;
+        next++;
+        changed.notify_all();
+    }
+}
+
+bool BandWriter::write_band(const int band, const Band &band_data) {
+    const int rows = std::min(band_rows, height - band * band_rows);
+    const bool last = band + 1 == bands;
+    const std::vector<unsigned char> &rgb = band_data.rgb;
+    std::vector<unsigned char> data;
+    if (format == ImageFormat::exr) {
+        exr_lines(band_data.hdr.data(), band * band_rows, rows, width, data);
+    } else if (format == ImageFormat::ppm) {
+        out.write(reinterpret_cast<const char *>(rgb.data()), rgb.size());
+        total_bytes += rgb.size();
+        return static_cast<bool>(out);
+    } else if (format == ImageFormat::qoi) {
+        qoi_pixels(encoder->qoi, rgb.data(), size_t(width) * rows, last, data);
+    } else {
+#ifdef HAVE_ZLIB
+        // Каждая полоса — свой чанк IDAT; вместе они дают один поток zlib
+        std::vector<unsigned char> idat = {'I', 'D', 'A', 'T'};
+        if (band == 0) idat.insert(idat.end(), {0x78, 0x9c});
+        const std::vector<unsigned char> filtered =
+            filter_rows(rgb.data(), band ? encoder->last_row.data() : nullptr, width, rows);
+        if (!deflate_rows(filtered, width * 3 + 1, last, idat, encoder->checksum)) return false;
+        if (last) put_be32(idat, encoder->checksum);
+        encoder->last_row.assign(rgb.end() - width * 3, rgb.end());
+        png_chunk(data, idat);
+        if (last) png_chunk(data, {'I', 'E', 'N', 'D'});
+#endif
+    }
+    out.write(reinterpret_cast<const char *>(data.data()), data.size());
+    total_bytes += data.size();
+    return static_cast<bool>(out);
+}
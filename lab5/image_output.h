@@ -0,0 +1,115 @@
+#ifndef IMAGE_OUTPUT_H
+#define IMAGE_OUTPUT_H
+
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Формат результата: PNG (сжатие), PPM (без сжатия), QOI (быстрое сжатие без энтропийного кодера)
+// или EXR — линейный HDR-кадр в half float без сжатия и без тональной компрессии (для композитинга)
+enum class ImageFormat { png, ppm, qoi, exr };
+
+bool parse_image_format(const std::string &name, ImageFormat &format);
+const char *image_extension(const ImageFormat format);
+
+// Кодирует кадр и пишет файл; false — если файл не записался. EXR берёт линейный RGB float из hdr,
+// остальные форматы — RGB8 из rgb.
+// PNG: строки фильтруются параллельно, затем полосы строк сжимаются deflate независимо на всех потоках
+// OpenMP и склеиваются в один поток zlib (как в pigz). Без zlib — однопоточный stbi_write_png.
+bool write_image(const std::string &path, const ImageFormat format, const int width, const int height,
+                 const unsigned char *rgb, const float *hdr = nullptr);
+
+// Фоновая запись кадров: submit отдаёт готовый кадр и возвращается, кодирование идёт
+// в отдельном потоке параллельно рендеру следующего кадра. Кадры пишутся в порядке submit.
+// Очередь ограничена MAX_QUEUED кадрами: если запись отстаёт от рендера, submit ждёт,
+// и в памяти не копятся несжатые кадры.
+class ImageWriter {
+public:
+    ImageWriter();
+    ~ImageWriter(); // дописывает очередь
+
+    void submit(const std::string &path, const ImageFormat format, const int width, const int height,
+                std::vector<unsigned char> rgb, std::vector<float> hdr = {});
+    void wait(); // все отправленные кадры записаны
+    bool idle(); // очередь пуста и ничего не кодируется
+
+    int written() const { return images; }
+    double encode_ms() const { return total_ms; }
+    double stall_ms() const { return blocked_ms; } // сколько submit ждал места в очереди
+    size_t bytes() const { return total_bytes; }
+
+private:
+    static constexpr size_t MAX_QUEUED = 2;
+
+    struct Job {
+        std::string path;
+        ImageFormat format;
+        int width, height;
+        std::vector<unsigned char> rgb;
+        std::vector<float> hdr;
+    };
+
+    void run();
+
+    std::mutex lock;
+    std::condition_variable changed;
+    std::deque<Job> queue;
+    bool busy = false, stopping = false;
+    int images = 0;
+    double total_ms = 0, blocked_ms = 0;
+    size_t total_bytes = 0;
+    std::thread worker;
+};
+
+// Потоковая запись кадра полосами по band_rows строк: весь кадр в памяти не нужен. Полосы приходят
+// в любом порядке из любых потоков, ждут в очереди и пишутся в файл строго сверху вниз в отдельном потоке.
+// PNG — по чанку IDAT на полосу (нужна zlib), QOI — с состоянием кодера между полосами, PPM — как есть,
+// EXR — строки half float (размер строки постоянен, поэтому таблица смещений пишется сразу).
+class BandWriter {
+public:
+    BandWriter(const std::string &path, const ImageFormat format, const int width, const int height, const int band_rows);
+    ~BandWriter(); // дописывает пришедшие полосы
+
+    bool ok() const { return good; }
+    // band_rows строк (последняя полоса — остаток): RGB8 в rgb, для EXR — RGB float в hdr
+    void submit(const int band, std::vector<unsigned char> rgb, std::vector<float> hdr = {});
+    void wait_queued(const size_t max_bytes); // ждёт, пока в очереди останется не больше max_bytes
+    bool finish(); // все полосы записаны; false — файл не записался
+
+    double encode_ms() const { return total_ms; }
+    size_t bytes() const { return total_bytes; }
+    size_t peak_queued() const { return peak_bytes; } // максимум байт полос, ждавших записи
+
+private:
+    struct Encoder;
+    struct Band {
+        std::vector<unsigned char> rgb;
+        std::vector<float> hdr;
+        size_t bytes() const { return rgb.size() + hdr.size() * sizeof(float); }
+    };
+
+    void run();
+    bool write_band(const int band, const Band &data);
+
+    const ImageFormat format;
+    const int width, height, band_rows, bands;
+    std::ofstream out;
+    Encoder *encoder = nullptr;
+    bool good = true;
+
+    std::mutex lock;
+    std::condition_variable changed;
+    std::map<int, Band> queue; // готовые полосы по номеру
+    int next = 0; // следующая полоса для записи
+    bool busy = false, stopping = false;
+    size_t queued_bytes = 0, peak_bytes = 0, total_bytes = 0;
+    double total_ms = 0;
+    std::thread worker;
+};
+
+#endif // IMAGE_OUTPUT_H
@@ -0,0 +1,212 @@
+#include "irradiance_cache.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+constexpr int MIN_RECORDS = 2; // столько согласных записей нужно, чтобы не пускать теневые лучи
+constexpr int MAX_LIGHTS = 32; // видимость остальных источников не кэшируется
+constexpr float MIN_PACKET_COS = 0.9f; // нормали пакета расходятся сильнее — он не ищется в кэше
+
+} // namespace
+
+IrradianceCache::IrradianceCache(const vec3 &lo, const vec3 &hi) {
+    Node root;
+    root.center = (lo + hi) * .5f;
+    const vec3 extent = hi - lo;
+    root.half = std::max(extent.x, std::max(extent.y, extent.z)) * .5f + 1e-3f;
+    nodes.push_back(root);
+    pending.emplace_back();
+}
+
+void IrradianceCache::insert(const std::vector<IrradianceRecord> &batch) {
+    for (const IrradianceRecord &record : batch) insert(0, record);
+    record_count += batch.size();
+    blocks.clear();
+    for (size_t n = 0; n < nodes.size(); n++) {
+        const std::vector<IrradianceRecord> &records = pending[n];
+        nodes[n].first = uint32_t(blocks.size());
+        nodes[n].count = uint32_t((records.size() + SIMD_WIDTH - 1) / SIMD_WIDTH);
+        for (size_t k = 0; k < size_t(nodes[n].count) * SIMD_WIDTH; k++) {
+            if (k % SIMD_WIDTH == 0) blocks.emplace_back();
+            Block &b = blocks.back();
+            const int lane = int(k % SIMD_WIDTH);
+            const IrradianceRecord &r = k < records.size() ? records[k] : IrradianceRecord{{1e30f, 1e30f, 1e30f}, {0, 0, 0}, 1, 0};
+            b.x[lane] = r.point.x; b.y[lane] = r.point.y; b.z[lane] = r.point.z;
+            b.nx[lane] = r.normal.x; b.ny[lane] = r.normal.y; b.nz[lane] = r.normal.z;
+            b.inv_radius[lane] = 1.f / r.radius;
+            b.visible[lane] = r.visible;
+        }
+    }
+}
+
+// Спуск до уровня записи по всем детям, которых касается куб вокруг её шара
+void IrradianceCache::insert(const int n, const IrradianceRecord &record) {
+    const vec3 c = nodes[n].center, &p = record.point;
+    const float child_half = nodes[n].half * .5f;
+    const vec3 d = p - c;
+    const bool inside = std::max(std::abs(d.x), std::max(std::abs(d.y), std::abs(d.z))) <= nodes[n].half;
+    if (child_half < record.radius || (n == 0 && !inside)) { // у корня — и записи вне сцены
+        pending[n].push_back(record);
+        return;
+    }
+    for (int octant = 0; octant < 8; octant++) {
+        const vec3 child_center = {c.x + (octant & 1 ? child_half : -child_half), c.y + (octant & 2 ? child_half : -child_half),
+                                   c.z + (octant & 4 ? child_half : -child_half)};
+        const vec3 e = p - child_center;
+        if (std::max(std::abs(e.x), std::max(std::abs(e.y), std::abs(e.z))) > child_half + record.radius) continue;
+        if (nodes[n].children[octant] < 0) {
+            Node child;
+            child.center = child_center;
+            child.half = child_half;
+            nodes[n].children[octant] = int(nodes.size());
+            nodes.push_back(child);
+            pending.emplace_back();
+        }
+        insert(nodes[n].children[octant], record);
+    }
+}
+
+int IrradianceCache::search(const vec3 &point, const vec3 &N, uint32_t &visible) const {
+    int found = 0;
+    const vfloat qx(point.x), qy(point.y), qz(point.z), qnx(N.x), qny(N.y), qnz(N.z), one(1.f);
+    for (int n = nodes.empty() ? -1 : 0; n >= 0;) {
+        const Node &node = nodes[n];
+        for (const Block *b = blocks.data() + node.first, *end = b + node.count; b < end; b++) {
+            // Ошибка Уорда a + sqrt(1 - cos) < 1 без второго корня: 1 - cos < (1 - a)², где a < 1
+            const vfloat dx = qx - vfloat::load(b->x), dy = qy - vfloat::load(b->y), dz = qz - vfloat::load(b->z);
+            const vfloat ir = vfloat::load(b->inv_radius);
+            const vfloat a2 = (dx * dx + dy * dy + dz * dz) * (ir * ir);
+            int mask = movemask(a2 < one);
+            if (!mask) continue;
+            const vfloat cos_theta = qnx * vfloat::load(b->nx) + qny * vfloat::load(b->ny) + qnz * vfloat::load(b->nz);
+            const vfloat rest = one - vsqrt(a2);
+            mask &= movemask(one - cos_theta < rest * rest);
+            for (; mask; mask &= mask - 1) {
+                const uint32_t bits = b->visible[__builtin_ctz(mask)];
+                if (found && bits != visible) return -1; // граница тени между записями
+                visible = bits;
+                found++;
+            }
+        }
+        const vec3 c = node.center;
+        n = node.children[(point.x > c.x) | (point.y > c.y) << 1 | (point.z > c.z) << 2];
+    }
+    return found;
+}
+
+bool IrradianceCache::lookup(const vec3 &point, const vec3 &N, uint32_t &visible) const {
+    return search(point, N, visible) >= MIN_RECORDS;
+}
+
+bool IrradianceCache::lookup_packet(const Hit hits[SIMD_WIDTH], const int mask, uint32_t &visible) const {
+    visible = 0;
+    if (!mask || nodes.empty()) return false;
+    // Шар вокруг коробки точек (центр c, радиус rho) и конус нормалей вокруг нормали первой точки (полураствор alpha)
+    const vec3 axis = hits[__builtin_ctz(mask)].N;
+    vec3 lo = hits[__builtin_ctz(mask)].point, hi = lo;
+    float cos_alpha = 1;
+    for (int m = mask & (mask - 1); m; m &= m - 1) {
+        const Hit &hit = hits[__builtin_ctz(m)];
+        for (int a = 0; a < 3; a++) {
+            lo[a] = std::min(lo[a], hit.point[a]);
+            hi[a] = std::max(hi[a], hit.point[a]);
+        }
+        cos_alpha = std::min(cos_alpha, hit.N * axis);
+    }
+    if (cos_alpha < MIN_PACKET_COS) return false; // точки на разных поверхностях
+    const vec3 c = (lo + hi) * .5f;
+    const float rho = (hi - lo).norm() * .5f, sin_alpha = std::sqrt(std::max(0.f, 1 - cos_alpha * cos_alpha));
+
+    const vfloat qx(c.x), qy(c.y), qz(c.z), qnx(axis.x), qny(axis.y), qnz(axis.z), vrho(rho), one(1.f), zero(0.f);
+    const vfloat vcos_alpha(cos_alpha), vsin_alpha(sin_alpha);
+    bool seen = false; // visible уже задана записью
+    int covering = 0, stack[256], sp = 0; // в стеке — не больше семи братьев на уровень
+    for (int n = 0;;) {
+        const Node &node = nodes[n];
+        for (const Block *b = blocks.data() + node.first, *end = b + node.count; b < end; b++) {
+            // Расстояние от точки пакета до записи — в [d - rho, d + rho], угол между нормалями — в [theta - alpha, theta + alpha].
+            // Блок считается целиком, без ветвлений по записям: у пакета их обычно меньше десятка
+            const vfloat dx = qx - vfloat::load(b->x), dy = qy - vfloat::load(b->y), dz = qz - vfloat::load(b->z);
+            const vfloat ir = vfloat::load(b->inv_radius), d2 = (dx * dx + dy * dy + dz * dz) * (ir * ir), reach = one + vrho * ir;
+            const vfloat d = vsqrt(d2), a_near = vmax(zero, d - vrho * ir), a_far = d + vrho * ir;
+            const vfloat cos_theta = qnx * vfloat::load(b->nx) + qny * vfloat::load(b->ny) + qnz * vfloat::load(b->nz);
+            const vfloat sin_theta = vsqrt(vmax(zero, one - cos_theta * cos_theta));
+            const vfloat cos_near = select(cos_theta >= vcos_alpha, one, cos_theta * vcos_alpha + sin_theta * vsin_alpha);
+            const vfloat cos_far = cos_theta * vcos_alpha - sin_theta * vsin_alpha;
+            const vfloat near_rest = one - a_near, far_rest = one - a_far;
+            const int maybe = movemask((d2 < reach * reach) & (one - cos_near < near_rest * near_rest));
+            const int all = maybe & movemask((a_far < one) & (one - cos_far < far_rest * far_rest));
+            if (maybe && !seen) {
+                visible = b->visible[__builtin_ctz(maybe)];
+                seen = true;
+            }
+            if (maybe & ~equal_mask(b->visible, visible)) return false; // граница тени рядом с пакетом
+            covering += __builtin_popcount(all);
+        }
+        // Дальше — ребёнок с центром шара и, если шар задевает плоскости раздела, дети по другую сторону
+        const vec3 cc = node.center;
+        const int octant = (c.x > cc.x) | (c.y > cc.y) << 1 | (c.z > cc.z) << 2;
+        const int straddle = (std::abs(c.x - cc.x) < rho) | (std::abs(c.y - cc.y) < rho) << 1 | (std::abs(c.z - cc.z) < rho) << 2;
+        for (int s = straddle; s; s = (s - 1) & straddle) // непустые подмножества осей
+            if (node.children[octant ^ s] >= 0) stack[sp++] = node.children[octant ^ s];
+        n = node.children[octant];
+        if (n < 0) {
+            if (!sp) break;
+            n = stack[--sp];
+        }
+    }
+    return covering >= MIN_RECORDS;
+}
+
+bool IrradianceCache::uncovered(const vec3 &point, const vec3 &N) const {
+    uint32_t visible;
+    const int found = search(point, N, visible);
+    return found >= 0 && found < MIN_RECORDS;
+}
+
+size_t IrradianceCache::bytes() const {
+    size_t total = nodes.size() * sizeof(Node) + blocks.size() * sizeof(Block);
+    for (const std::vector<IrradianceRecord> &records : pending) total += records.size() * sizeof(IrradianceRecord);
+    return total;
+}
+
+void scene_bounds(const CompiledScene &scene, vec3 &lo, vec3 &hi) {
+    lo = {1e30f, 1e30f, 1e30f};
+    hi = {-1e30f, -1e30f, -1e30f};
+    auto grow = [&](const vec3 &p) {
+        for (int a = 0; a < 3; a++) {
+            lo[a] = std::min(lo[a], p[a]);
+            hi[a] = std::max(hi[a], p[a]);
+        }
+    };
+    for (int i = 0; i < scene.sphere_count(); i++) {
+        const vec3 c = {scene.sphere_x[i], scene.sphere_y[i], scene.sphere_z[i]}, r = {scene.sphere_r[i], scene.sphere_r[i], scene.sphere_r[i]};
+        grow(c - r);
+        grow(c + r);
+    }
+    for (int i = 0; i < scene.plane_count(); i++) {
+        const int a = scene.plane_axis[i], u = (a + 1) % 3, v = (a + 2) % 3;
+        vec3 p;
+        p[a] = scene.plane_offset[i];
+        p[u] = scene.plane_u0[i];
+        p[v] = scene.plane_v0[i];
+        grow(p);
+        p[u] = scene.plane_u1[i];
+        p[v] = scene.plane_v1[i];
+        grow(p);
+    }
+}
+
+IrradianceRecord make_irradiance_record(const CompiledScene &scene, const Hit &hit, const float radius, long long &shadow_rays) {
+    IrradianceRecord record = {hit.point, hit.N, radius, 0};
+    const int lights = std::min(scene.light_count(), MAX_LIGHTS);
+    for (int i = 0; i < lights; i++) {
+        const vec3 to_light = scene.light(i) - hit.point;
+        const float dist = to_light.norm();
+        if (!scene_occluded(scene, hit.point, to_light * (1.f / dist), dist)) record.visible |= 1u << i;
+    }
+    shadow_rays += lights;
+    return record;
+}
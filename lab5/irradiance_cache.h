@@ -0,0 +1,76 @@
+#ifndef IRRADIANCE_CACHE_H
+#define IRRADIANCE_CACHE_H
+
+#include <cstdint>
+#include <vector>
+#include "geometry.h"
+#include "scene.h"
+#include "simd.h"
+
+// Запись кэша: точка, нормаль, радиус действия и видимость первых 32 источников (бит i — источник i открыт)
+struct IrradianceRecord {
+    vec3 point, normal;
+    float radius;
+    uint32_t visible;
+};
+
+// Кэш освещённости (Ward et al., «A Ray Tracing Solution for Diffuse Interreflection») с записями в октодереве.
+// Освещение точечными источниками whitted без теней — дешёвая формула (cos и блик), дорогое в нём — теневые лучи,
+// поэтому запись хранит видимость источников, а освещение по ней досчитывается в самой точке точно.
+// Запись годится для точки, если ошибка Уорда |P - Pi| / Ri + sqrt(1 - N·Ni) меньше 1. Видимость берётся,
+// только если годных записей не меньше двух и все они согласны: у границы тени записи расходятся,
+// и точка считается теневыми лучами. Так размытых теней нет, а ошибка — только у деталей мельче шага записей.
+//
+// Запись лежит во всех узлах своего уровня (половина стороны не меньше радиуса), которые задевает её шар, —
+// не больше восьми. Поэтому поиск не смотрит соседей: он спускается одним путём узлов, содержащих точку,
+// и проверяет их записи. Записи узла лежат подряд блоками по SIMD_WIDTH и проверяются блоком за раз,
+// как фотоны в листьях каустической карты
+class IrradianceCache {
+public:
+    IrradianceCache() = default;
+    IrradianceCache(const vec3 &lo, const vec3 &hi); // корень — куб вокруг коробки сцены
+
+    // Пачка записей (волна заполнения); после вставки записи узлов заново укладываются подряд
+    void insert(const std::vector<IrradianceRecord> &batch);
+    // true и видимость источников в visible, если записи рядом согласны
+    bool lookup(const vec3 &point, const vec3 &N, uint32_t &visible) const;
+    // То же для точек попадания пакета hits[mask] одним спуском: true, если каждой точке годятся хотя бы две записи
+    // и все записи, годные хоть одной точке, согласны. Записи проверяются против шара вокруг точек и конуса их нормалей —
+    // оценка с запасом, поэтому ответ «да» совпадает с ответом lookup для каждой точки, а на границах чаще «нет»
+    bool lookup_packet(const Hit hits[SIMD_WIDTH], const int mask, uint32_t &visible) const;
+    // Годных записей меньше двух. У границы тени записи есть, но расходятся — новая запись там не поможет
+    bool uncovered(const vec3 &point, const vec3 &N) const;
+
+    size_t size() const { return record_count; }
+    size_t node_count() const { return nodes.size(); }
+    size_t bytes() const;
+
+private:
+    struct Node {
+        vec3 center;
+        float half;
+        int children[8] = {-1, -1, -1, -1, -1, -1, -1, -1};
+        uint32_t first = 0, count = 0; // блоки записей узла в blocks
+    };
+    // SIMD_WIDTH записей для поиска: поля подряд по записям, весь блок — несколько соседних кэш-линий
+    struct alignas(32) Block {
+        float x[SIMD_WIDTH], y[SIMD_WIDTH], z[SIMD_WIDTH], nx[SIMD_WIDTH], ny[SIMD_WIDTH], nz[SIMD_WIDTH];
+        float inv_radius[SIMD_WIDTH];
+        uint32_t visible[SIMD_WIDTH];
+    };
+    void insert(const int node, const IrradianceRecord &record);
+    int search(const vec3 &point, const vec3 &N, uint32_t &visible) const; // число годных записей, -1 — они расходятся
+
+    std::vector<Node> nodes;
+    std::vector<std::vector<IrradianceRecord>> pending; // записи узлов при вставке, по номеру узла
+    std::vector<Block> blocks; // хвост последнего блока узла — записи, которые всегда далеко
+    size_t record_count = 0;
+};
+
+// Коробка сцены: сферы и прямоугольники плоскостей
+void scene_bounds(const CompiledScene &scene, vec3 &lo, vec3 &hi);
+
+// Запись радиуса radius в точке попадания: по теневому лучу к каждому из первых 32 источников (прибавляются к shadow_rays)
+IrradianceRecord make_irradiance_record(const CompiledScene &scene, const Hit &hit, const float radius, long long &shadow_rays);
+
+#endif // IRRADIANCE_CACHE_H
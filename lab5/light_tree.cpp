@@ -0,0 +1,108 @@
+#include "light_tree.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include "rng.h"
+
+namespace {
+
+constexpr uint32_t LIGHTS_STREAM = 4; // поток Rng разброса источников (у пикселей 0..2, у фотонов 3)
+
+inline float luminance(const vec3 &c) { return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z; }
+
+} // namespace
+
+LightTree::LightTree(std::vector<PointLight> all) : lights(std::move(all)) {
+    if (lights.empty()) return;
+    auto start = std::chrono::steady_clock::now();
+    nodes.reserve(2 * lights.size() - 1);
+    build(0, int(lights.size()), 0);
+    build_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Поддерево по источникам [begin, end): делится пополам по медиане вдоль длинной оси коробки
+int LightTree::build(const int begin, const int end, const int depth) {
+    const int index = int(nodes.size());
+    nodes.emplace_back();
+    max_depth = std::max(max_depth, depth);
+    vec3 lo = {1e30f, 1e30f, 1e30f}, hi = {-1e30f, -1e30f, -1e30f};
+    Node node = {{0, 0, 0}, {0, 0, 0}, 0, -1 - begin};
+    for (int i = begin; i < end; i++) {
+        for (int a = 0; a < 3; a++) {
+            lo[a] = std::min(lo[a], lights[i].position[a]);
+            hi[a] = std::max(hi[a], lights[i].position[a]);
+        }
+        node.power += luminance(lights[i].color);
+    }
+    node.center = (lo + hi) * .5f;
+    node.half = (hi - lo) * .5f;
+    if (end - begin > 1) {
+        int axis = 0;
+        for (int a = 1; a < 3; a++)
+            if (node.half[a] > node.half[axis]) axis = a;
+        const int mid = (begin + end) / 2;
+        std::nth_element(lights.begin() + begin, lights.begin() + mid, lights.begin() + end,
+                         [axis](const PointLight &a, const PointLight &b) { return a.position[axis] < b.position[axis]; });
+        build(begin, mid, depth + 1);
+        node.right = build(mid, end, depth + 1);
+    }
+    nodes[index] = node;
+    return index;
+}
+
+float LightTree::importance(const Node &node, const vec3 &point, const vec3 &N) const {
+    const vec3 &center = node.center, &half = node.half;
+    const vec3 d = center - point;
+    const vec3 outside = {std::max(0.f, std::abs(d.x) - half.x), std::max(0.f, std::abs(d.y) - half.y),
+                          std::max(0.f, std::abs(d.z) - half.z)}; // от коробки до точки по осям (0 внутри)
+    float cos_bound = 1;
+    const float box_dist2 = outside * outside;
+    if (box_dist2 > 0) {
+        // Наибольшее N·(x - point) по коробке — в её углу; делённое на расстояние до коробки — граница косинуса
+        const float reach = N * d + std::abs(N.x) * half.x + std::abs(N.y) * half.y + std::abs(N.z) * half.z;
+        if (reach <= 0) return 0;
+        cos_bound = std::min(1.f, reach / std::sqrt(box_dist2));
+    }
+    const float dist2 = std::max(std::max(d * d, half * half), 1.f); // не ближе радиуса коробки и зажима спада
+    return node.power * cos_bound / dist2;
+}
+
+int LightTree::sample(const vec3 &point, const vec3 &N, float u, float &pmf) const {
+    pmf = 1;
+    if (nodes.empty() || importance(nodes[0], point, N) <= 0) return -1;
+    int n = 0;
+    while (nodes[n].right >= 0) {
+        const int left = n + 1, right = nodes[n].right;
+        const float il = importance(nodes[left], point, N), ir = importance(nodes[right], point, N);
+        if (il + ir <= 0) return -1; // граница косинуса родителя шире, чем у потомков
+        const float p = il / (il + ir);
+        // Число u переиспользуется: его положение внутри выбранной доли растягивается обратно на [0, 1)
+        if (u < p) {
+            u /= p;
+            pmf *= p;
+            n = left;
+        } else {
+            u = (u - p) / (1 - p);
+            pmf *= 1 - p;
+            n = right;
+        }
+        u = std::min(u, 0x1.fffffep-1f);
+    }
+    return -1 - nodes[n].right;
+}
+
+std::vector<PointLight> scatter_lights(const int count, const vec3 &lo, const vec3 &hi, const float total) {
+    constexpr vec3 tints[] = {{1, .85f, .6f}, {.6f, .8f, 1}, {1, .55f, .45f}, {.75f, 1, .65f}, {1, 1, 1}};
+    std::vector<PointLight> lights(count);
+    float sum = 0;
+    for (int i = 0; i < count; i++) {
+        Rng rng(uint32_t(i), 0, LIGHTS_STREAM);
+        for (int a = 0; a < 3; a++) lights[i].position[a] = lo[a] + (hi[a] - lo[a]) * rng.next_float();
+        const float strength = .25f + 1.5f * rng.next_float();
+        lights[i].color = tints[std::min(4, int(rng.next_float() * 5))] * strength;
+        sum += luminance(lights[i].color);
+    }
+    for (PointLight &light : lights) light.color = light.color * (total / sum);
+    return lights;
+}
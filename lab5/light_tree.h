@@ -0,0 +1,52 @@
+#ifndef LIGHT_TREE_H
+#define LIGHT_TREE_H
+
+#include <vector>
+#include "geometry.h"
+
+// Точечный источник со спадом: освещённость color / max(d², 1) (без зажима у самого источника — бесконечность)
+struct PointLight {
+    vec3 position;
+    vec3 color; // сила света по каналам
+};
+
+// Иерархия источников (Conty Estevez, Kulla, «Importance Sampling of Many Lights with Adaptive Tree Splitting»):
+// бинарное дерево по коробкам источников, в узле — суммарная мощность. Выбор спускается от корня, на каждом
+// узле выбирая потомка пропорционально оценке его вклада в точку: мощность / квадрат расстояния до коробки
+// на верхнюю границу косинуса к нормали. Вероятность выбранного источника — произведение вероятностей
+// по пути, поэтому оценка вклад / вероятность несмещённая, а её цена — глубина дерева.
+// Оценка узла нулевая, только если вся коробка под касательной плоскостью — там источники ничего не дают
+class LightTree {
+public:
+    LightTree() = default;
+    explicit LightTree(std::vector<PointLight> lights); // источники переупорядочиваются по листьям
+
+    // Источник для точки с нормалью N по числу u из [0, 1) и его вероятность в pmf; -1 — все источники под горизонтом
+    int sample(const vec3 &point, const vec3 &N, float u, float &pmf) const;
+
+    const PointLight &light(const int i) const { return lights[i]; }
+    bool empty() const { return lights.empty(); }
+    size_t size() const { return lights.size(); }
+    size_t node_count() const { return nodes.size(); }
+    int depth() const { return max_depth; }
+    double build_ms = 0;
+
+private:
+    struct Node {
+        vec3 center, half; // коробка источников
+        float power; // сумма яркостей источников поддерева
+        int right;   // левый потомок — следующий узел; у листа right = -1 - номер источника
+    };
+    int build(const int begin, const int end, const int depth);
+    float importance(const Node &node, const vec3 &point, const vec3 &N) const;
+
+    std::vector<Node> nodes;
+    std::vector<PointLight> lights;
+    int max_depth = 0;
+};
+
+// count источников, равномерно разбросанных в коробке [lo, hi] (Philox, сид фиксирован), со случайными
+// оттенками и силой; сумма сил — total
+std::vector<PointLight> scatter_lights(const int count, const vec3 &lo, const vec3 &hi, const float total);
+
+#endif // LIGHT_TREE_H
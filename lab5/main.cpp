@@ -1,14 +1,22 @@
-#include <tuple>
 #include <vector>
 #include <fstream>
 #include <algorithm>
 #include <cmath>
 #include <omp.h>
-#include <cstdlib> // Для std::rand()
+#include <cstdlib>
 #include <stdexcept>
 #include <iostream>
 #include <ctime> // Для работы с временем
 #include <sstream> // Для формирования имени файла
+#include <string>
+#include <random>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <sys/resource.h>
 
 
 #define STB_IMAGE_IMPLEMENTATION
@@ -16,35 +24,28 @@
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include <stb_image_write.h>
 
-struct vec3 {
-    float x=0, y=0, z=0;
-          float& operator[](const int i)       { return i==0 ? x : (1==i ? y : z); }
-    const float& operator[](const int i) const { return i==0 ? x : (1==i ? y : z); }
-    vec3  operator*(const float v) const { return {x*v, y*v, z*v};       }
-    float operator*(const vec3& v) const { return x*v.x + y*v.y + z*v.z; }
-    vec3  operator+(const vec3& v) const { return {x+v.x, y+v.y, z+v.z}; }
-    vec3  operator-(const vec3& v) const { return {x-v.x, y-v.y, z-v.z}; }
-    vec3  operator-()              const { return {-x, -y, -z};          }
-    float norm() const { return std::sqrt(x*x+y*y+z*z); }
-    vec3 normalized() const { return (*this)*(1.f/norm()); }
-};
-
-vec3 cross(const vec3 v1, const vec3 v2) {
-    return { v1.y*v2.z - v1.z*v2.y, v1.z*v2.x - v1.x*v2.z, v1.x*v2.y - v1.y*v2.x };
-}
+#include "geometry.h"
+#include "scene.h"
+#include "packet.h"
+#include "tiles.h"
+#include "rng.h"
+#include "sampler.h"
+#include "texture.h"
+#include "hdr_envmap.h"
+#include "image_cache.h"
+#include "image_output.h"
+#include "progressive.h"
+#include "tonemap.h"
+#include "denoise.h"
+#include "path_tracer.h"
+#include "photon_map.h"
+#include "irradiance_cache.h"
+#include "light_tree.h"
+#include "ray_tree.h"
 
-struct Material {
-    float refractive_index = 1;
-    float albedo[4] = {2,0,0,0};
-    vec3 diffuse_color = {0,0,0};
-    float specular_exponent = 0;
-};
-
-struct Sphere {
-    vec3 center;
-    float radius;
-    Material material;
-};
+#ifndef LAB5_ASSETS
+#define LAB5_ASSETS "assets" // CMake подставляет абсолютный путь к assets лабораторной
+#endif
 
 constexpr Material      ivory = {1.0, {0.9,  0.5, 0.1, 0.0}, {0.4, 0.4, 0.3},   50.};
 constexpr Material      glass = {1.5, {0.0,  0.9, 0.1, 0.8}, {0.6, 0.7, 0.8},  125.};
@@ -65,6 +66,12 @@ constexpr Sphere spheres[] = {
 
 };
 
+// Пол (шахматная структура) и вертикальная стена
+constexpr Plane planes[] = {
+    {1, -5.5, -30, -10, -10, 10, PlanePattern::texture, Material{}, 0, 4}, // y = -5.5, z в (-30, -10), x в (-10, 10); плитка 4x4
+    {0, -7.3,  -4,  10, -30, -10, PlanePattern::texture, Material{}, 1, 7}, // x = -7.3, y в (-4, 10), z в (-30, -10); кирпич 7x7
+};
+
 constexpr vec3 lights[] = {
     {-20, 20,  20},
     { 30, 50, -25},
@@ -83,49 +90,74 @@ vec3 refract(const vec3 &I, const vec3 &N, const float eta_t, const float eta_i=
     return k<0 ? vec3{1,0,0} : I*eta + N*(eta*cosi - std::sqrt(k)); // k<0 = total reflection, no ray to refract. I refract it anyways, this has no physical meaning
 }
 
-std::vector<vec3> envmap;
-int envmap_width, envmap_height;
+Texture envmap;        // исходная панорама RGBA8 с mip-уровнями; после загрузки нужна только для --bench-envmap
+CubeMap envmap_cube;   // та же панорама в шести гранях — по ней закрашиваются промахи
+float envmap_lod = 0;  // log2 следа пикселя камеры в текселях панорамы
+float cube_texel = 0;  // угловой размер текселя в центре грани, рад
+float pixel_angle = 0; // угловой размер пикселя камеры — начальный раствор конуса первичного луча
+
+HdrCubeMap hdr_envmap; // .hdr-окружение: тайлы на диске, в память попадают по первой выборке
 
-void load_envmap(const char *filename) {
-    int n = -1;
-    unsigned char *pixmap = stbi_load(filename, &envmap_width, &envmap_height, &n, 0);
-    if (!pixmap || n != 3) {
-        std::cerr << "Error: unable to load the environment map" << std::endl;
+// Тайловый файл лежит рядом с .hdr и помнит хэш содержимого исходника: конвертируется заново, если его нет,
+// он от другой версии или другого исходника или обрезан
+void load_hdr_envmap(const std::string &filename) {
+    const std::string tiled = filename + ".tiles";
+    uint64_t hash;
+    if (!hash_file(filename, hash)) {
+        std::cerr << "Error: unable to open the envmap " << filename << std::endl;
         std::exit(1);
     }
-    envmap = std::vector<vec3>(envmap_width * envmap_height);
-    for (int j = 0; j < envmap_height; j++) {
-        for (int i = 0; i < envmap_width; i++) {
-            int idx = (i + j * envmap_width) * 3;
-            envmap[i + (envmap_height - 1 - j) * envmap_width] = {
-                pixmap[idx] / 255.f,
-                pixmap[idx + 1] / 255.f,
-                pixmap[idx + 2] / 255.f
-            };
+    if (!open_hdr_envmap(tiled.c_str(), hash, hdr_envmap)) {
+        auto start = std::chrono::steady_clock::now();
+        if (!convert_hdr_envmap(filename.c_str(), tiled.c_str(), hash) || !open_hdr_envmap(tiled.c_str(), hash, hdr_envmap)) {
+            std::cerr << "Error: unable to convert the envmap " << filename << " to " << tiled << std::endl;
+            std::exit(1);
         }
+        std::cout << "Envmap: converted " << filename << " to tiles in "
+                  << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() << " ms" << std::endl;
     }
-    stbi_image_free(pixmap);
+    std::cout << "Envmap: HDR cubemap 6 x " << hdr_envmap.face_size() << "^2, " << hdr_envmap.levels.size() << " mip levels, "
+              << hdr_envmap.tile_count() << " tiles, " << hdr_envmap.file_bytes() / 1048576. << " MB mapped" << std::endl;
 }
 
-std::tuple<bool,float> ray_sphere_intersect(const vec3 &orig, const vec3 &dir, const Sphere &s) { // ret value is a pair [intersection found, distance]
-    vec3 L = s.center - orig;
-    float tca = L*dir;
-    float d2 = L*L - tca*tca;
-    if (d2 > s.radius*s.radius) return {false, 0};
-    float thc = std::sqrt(s.radius*s.radius - d2);
-    float t0 = tca-thc, t1 = tca+thc;
-    if (t0>.001) return {true, t0};  // offset the original point by .001 to avoid occlusion by the object itself
-    if (t1>.001) return {true, t1};
-    return {false, 0};
+void load_envmap(const std::string &filename) {
+    if (filename.size() > 4 && filename.compare(filename.size() - 4, 4, ".hdr") == 0) {
+        load_hdr_envmap(filename);
+        return;
+    }
+    // Панорама и её кубическая карта берутся из кэша, пока не изменится содержимое файла
+    auto start = std::chrono::steady_clock::now();
+    uint64_t hash;
+    CacheFile cache;
+    const bool hashed = hash_file(filename, hash);
+    const std::string cached = hashed ? cache_path(filename, "envmap", hash) : "";
+    if (hashed && open_cache(cached, hash, cache) && cache.images.size() == 7
+        && std::all_of(cache.images.begin(), cache.images.end(), texture_image)) {
+        envmap = make_texture(cache.images[0], Wrap::repeat, Wrap::clamp);
+        for (int face = 0; face < 6; face++) envmap_cube.faces[face] = make_texture(cache.images[face + 1], Wrap::clamp, Wrap::clamp);
+        std::cout << "Envmap: " << cached << " (cached)";
+    } else {
+        envmap = load_texture(filename.c_str(), Wrap::repeat, Wrap::clamp);
+        // Тексель в центре грани (2/size рад) равен текселю панорамы по горизонтали (2pi/width)
+        envmap_cube = make_cubemap(envmap, static_cast<int>(std::lround(envmap.width() / M_PI)));
+        std::vector<std::vector<uint32_t>> storage;
+        std::vector<CachedImage> images = {cached_image(envmap, storage)};
+        for (const Texture &face : envmap_cube.faces) images.push_back(cached_image(face, storage));
+        if (hashed && !write_cache(cached, hash, images)) std::cerr << "Error: unable to write the image cache " << cached << std::endl;
+        std::cout << "Envmap: " << filename << " (decoded)";
+    }
+    std::cout << " in " << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() << " ms" << std::endl;
+    std::cout << "Envmap: " << envmap.width() << "x" << envmap.height() << ", " << envmap.levels.size() << " mip levels, "
+              << envmap.bytes() / 1048576. << " MB (as vec3: " << envmap.width() * envmap.height() * sizeof(vec3) / 1048576.
+              << " MB); cubemap 6 x " << envmap_cube.face_size() << "^2, " << envmap_cube.bytes() / 1048576. << " MB" << std::endl;
 }
 
-std::tuple<bool,vec3,vec3,Material> scene_intersect(const vec3 &orig, const vec3 &dir) {
-    vec3 pt, N;
-    Material material;
+CompiledScene scene;
 
-    float nearest_dist = 1e10;
+void build_scene(const int extra_spheres, const std::string &assets) {
+    std::vector<Sphere> all_spheres(std::begin(spheres), std::end(spheres));
 
-    // Полукруг из сфер
+    // Полукруг из сфер: центры считаются один раз при сборке сцены
     constexpr int num_spheres = 4; // Количество сфер
     constexpr float circle_radius = 5.0f; // Радиус полукруга
     constexpr float sphere_radius = 2.f; // Размер сфер
@@ -134,143 +166,1361 @@ std::tuple<bool,vec3,vec3,Material> scene_intersect(const vec3 &orig, const vec3
     for (int i = 0; i < num_spheres; ++i) {
         float angle = M_PI * i / (num_spheres - 1); // Угол для каждой сферы
         vec3 sphere_center = {circle_radius * cos(angle), -3, -15 - circle_radius * sin(angle)};
-        Sphere temp_sphere = {sphere_center, sphere_radius, materials[i % 4]}; // Назначаем материал
+        all_spheres.push_back({sphere_center, sphere_radius, materials[i % 4]}); // Назначаем материал
+    }
+
+    // Мелкие случайные сферы для проверки масштабирования (--spheres N)
+    constexpr Material palette[] = {ivory, red_rubber, gold, silver, obsidian, bronze};
+    std::mt19937 gen(42);
+    std::uniform_real_distribution<float> ux(-9.5f, 9.5f), uy(-5.f, 8.f), uz(-29.5f, -10.5f);
+    for (int i = 0; i < extra_spheres; ++i)
+        all_spheres.push_back({{ux(gen), uy(gen), uz(gen)}, 0.05f, palette[i % 6]});
+
+    scene = compile_scene(all_spheres, {std::begin(planes), std::end(planes)}, {std::begin(lights), std::end(lights)});
+    scene.textures.push_back(load_texture_cached(assets + "/floor.jpg", Wrap::repeat, Wrap::repeat));
+    scene.textures.push_back(load_texture_cached(assets + "/wall.jpg", Wrap::repeat, Wrap::repeat));
+    std::cout << "Scene: " << scene.sphere_count() << " spheres, " << scene.plane_count() << " planes, "
+              << scene.light_count() << " lights, " << scene.materials.size() << " materials" << std::endl;
+    std::cout << "BVH: " << scene.bvh.nodes.size() << " nodes, depth " << scene.bvh.depth
+              << ", built in " << scene.bvh.build_ms << " ms; BVH" << SIMD_WIDTH << ": " << scene.wide_bvh.nodes.size()
+              << " nodes of " << sizeof(WideBVHNode) << " bytes" << std::endl;
+}
+
+// Прежняя выборка фона прямо из панорамы — только для сравнения в --bench-envmap
+vec3 background_equirect(const vec3 &dir) {
+    float u, v;
+    equirect_uv(dir, u, v);
+    return envmap.sample_trilinear(u, v, envmap_lod);
+}
+
+// spread — раствор конуса луча: после выпуклых зеркал он шире пикселя, и фон берётся с более грубого уровня
+vec3 background(const vec3 &dir, const float spread) {
+    // Используем окружение как фон
+    const float lod = std::log2(spread / cube_texel);
+    if (hdr_envmap.mapped()) return hdr_envmap.sample(dir, lod);
+    return envmap_cube.sample(dir, lod);
+}
+
+bool light_visible_scalar(const vec3 &point, const vec3 &light_dir, const float light_dist) {
+    return !scene_occluded(scene, point, light_dir, light_dist);
+}
+
+// Локальное освещение в точке попадания (без отражений и преломлений).
+// light_visible(i, light_dir, light_dist) решает, не закрыт ли источник i — скалярным лучом или по результату пакета.
+template <typename Visible>
+vec3 direct_light(const vec3 &dir, const Hit &hit, Visible &&light_visible) {
+    const vec3 &point = hit.point, &N = hit.N;
+    const Material &material = scene.materials[hit.material];
+    float diffuse_light_intensity = 0, specular_light_intensity = 0;
+    for (int i = 0; i < scene.light_count(); i++) {
+        vec3 to_light = scene.light(i) - point;
+        float light_dist = to_light.norm();
+        vec3 light_dir = to_light * (1.f / light_dist);
+        if (!light_visible(i, light_dir, light_dist)) continue;
+        diffuse_light_intensity  += std::max(0.f, light_dir * N);
+        specular_light_intensity += std::pow(std::max(0.f, -reflect(-light_dir, N) * dir), material.specular_exponent);
+    }
+    return hit.diffuse_color * diffuse_light_intensity * material.albedo[0] + 
+           vec3{1., 1., 1.} * specular_light_intensity * material.albedo[1];
+}
+
+constexpr int MAX_DEPTH = 4; // лучи глубже не трассируются, вместо них берётся фон
+
+// Счётчики вторичных лучей и сбора фотонов одного потока (выровнены, чтобы потоки не делили кэш-линию)
+struct alignas(64) RayStats {
+    long long traced = 0; // пересечены со сценой
+    long long pruned = 0; // не запущены: вес ровно ноль (albedo[2] или albedo[3] материала равен 0)
+    long long culled = 0; // отброшены русской рулеткой
+    long long gathers = 0; // оценки каустик по фотонной карте
+    double gather_ms = 0;
+    long long shadow = 0;       // теневые лучи (пакетные — по дорожкам)
+    long long cache_hits = 0;   // точки, где видимость взята из кэша освещённости
+    long long cache_misses = 0;
+    long long light_picks = 0;  // выборы из дерева источников (--lights)
+};
+std::vector<RayStats> ray_stats;
+float min_weight = 0.02f; // ниже этого веса луч проходит русскую рулетку
+
+// Настройки рендера из командной строки. Передаются параметром: бенчмарки рендерят со своими копиями
+struct RenderSettings {
+    SamplerType sampler = SamplerType::random; // числа для джиттера и рулетки
+    Integrator integrator = Integrator::whitted;
+    PathSettings path; // режим path: прямой свет, радиус источников
+};
+PhotonMap caustics; // пустая — каустик нет (--caustics)
+bool use_irradiance_cache = false;
+IrradianceCache irradiance_cache; // живёт между кадрами: источники и сцена не двигаются
+
+// Видимость первых 32 источников в точке из кэша освещённости (с учётом в статистике)
+bool cached_visibility(const Hit &hit, RayStats &stats, uint32_t &visible) {
+    if (!use_irradiance_cache) return false;
+    const bool found = irradiance_cache.lookup(hit.point, hit.N, visible);
+    (found ? stats.cache_hits : stats.cache_misses)++;
+    return found;
+}
+
+LightTree light_tree;  // множество источников со спадом (--lights); пустое — только lights[]
+int light_samples = 2; // выборов из дерева на точку; 0 — точная сумма по всем источникам
+constexpr float MANY_LIGHTS_POWER = 20; // суммарная сила --lights
+
+// Вклад множества источников (--lights) в точку: light_samples источников из дерева, по теневому лучу на каждый,
+// делённые на вероятность выбора. Модель освещения — как в direct_light, но со спадом и без света из-под горизонта
+vec3 many_light(const vec3 &dir, const Hit &hit, Sampler &rng, RayStats &stats) {
+    if (light_tree.empty()) return {0, 0, 0};
+    const Material &material = scene.materials[hit.material];
+    vec3 diffuse = {0, 0, 0}, specular = {0, 0, 0};
+    auto add = [&](const PointLight &light, const float weight) {
+        const vec3 to_light = light.position - hit.point;
+        const float dist2 = to_light * to_light, light_dist = std::sqrt(dist2);
+        const vec3 light_dir = to_light * (1.f / light_dist);
+        const float cos_theta = light_dir * hit.N;
+        if (cos_theta <= 0) return;
+        stats.shadow++;
+        if (!light_visible_scalar(hit.point, light_dir, light_dist)) return;
+        const vec3 irradiance = light.color * (weight / std::max(dist2, 1.f));
+        diffuse = diffuse + irradiance * cos_theta;
+        specular = specular + irradiance * std::pow(std::max(0.f, -reflect(-light_dir, hit.N) * dir), material.specular_exponent);
+    };
+    if (light_samples == 0) {
+        for (size_t i = 0; i < light_tree.size(); i++) add(light_tree.light(int(i)), 1);
+    } else {
+        for (int k = 0; k < light_samples; k++) {
+            float pmf;
+            const int i = light_tree.sample(hit.point, hit.N, rng.next_float(), pmf);
+            stats.light_picks++;
+            if (i < 0) continue; // спуск упёрся в узлы под горизонтом: вклад этой выборки ноль, остальные — свои
+            add(light_tree.light(i), 1.f / (pmf * light_samples));
+        }
+    }
+    const vec3 &kd = hit.diffuse_color;
+    return vec3{kd.x * diffuse.x, kd.y * diffuse.y, kd.z * diffuse.z} * material.albedo[0] + specular * material.albedo[1];
+}
+
+// Каустики в точке попадания: освещённость из фотонной карты на диффузный член материала
+vec3 caustic_light(const Hit &hit, RayStats &stats) {
+    const Material &material = scene.materials[hit.material];
+    if (caustics.empty() || material.albedo[0] <= 0) return {0, 0, 0};
+    auto start = std::chrono::steady_clock::now();
+    const vec3 irradiance = caustics.irradiance(hit.point, hit.N);
+    stats.gather_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    stats.gathers++;
+    const vec3 &kd = hit.diffuse_color;
+    return vec3{kd.x * irradiance.x, kd.y * irradiance.y, kd.z * irradiance.z} * material.albedo[0];
+}
+
+// Итеративный интегратор: вместо рекурсии cast_ray — явный стек лучей с весами.
+// Вклад луча в пиксель равен произведению albedo[2]/albedo[3] по пути, поэтому лучи с нулевым весом
+// не запускаются, а лёгкие (вес < min_weight) выживают с вероятностью weight/min_weight.
+// Обход в глубину с двумя потомками на попадание: в стеке не больше MAX_DEPTH + 2 лучей.
+//
+// Вместе с лучом несётся конус (ширина в начале и раствор) — упрощённые дифференциалы лучей:
+// по ширине конуса в точке попадания выбирается mip-уровень текстуры. Отражение от сферы радиуса r
+// расширяет раствор на 2 * ширина / r, плоскость и преломление его не меняют.
+// features — если задан, сюда пишутся признаки первичного попадания для денойзера
+template <typename Visible>
+vec3 trace_path(const vec3 &dir, const Hit &primary_hit, Visible &&primary_visible, Sampler &rng,
+                PixelFeatures *features = nullptr) {
+    struct RayTask { vec3 orig, dir; float weight; int depth; float width, spread; };
+    RayTask stack[MAX_DEPTH + 2];
+    int sp = 0;
+    RayStats &stats = ray_stats[omp_get_thread_num()];
+
+    auto push_secondary = [&](const vec3 &d, const Hit &hit, const float weight, const int depth, const float width, const float spread) {
+        const Material &material = scene.materials[hit.material];
+        const float curvature = hit.prim < scene.sphere_count() ? 1.f / scene.sphere_r[hit.prim] : 0.f;
+        const float w[2] = {weight * material.albedo[2], weight * material.albedo[3]};
+        for (int k = 0; k < 2; k++) {
+            float child = w[k];
+            if (child == 0) { stats.pruned++; continue; }
+            if (child < min_weight) {
+                if (rng.next_float() * min_weight >= child) { stats.culled++; continue; }
+                child = min_weight;
+            }
+            vec3 child_dir = k == 0 ? reflect(d, hit.N).normalized()
+                                    : refract(d, hit.N, material.refractive_index).normalized();
+            stack[sp++] = {hit.point, child_dir, child, depth + 1, width, k == 0 ? spread + 2 * width * curvature : spread};
+        }
+    };
+
+    Hit primary = primary_hit;
+    const float primary_width = pixel_angle * primary.dist; // камера — вершина конуса
+    shade_texture(scene, dir, primary_width, primary);
+    if (features) *features = {primary.N, primary.diffuse_color, primary.dist};
+    vec3 color = direct_light(dir, primary, primary_visible) + many_light(dir, primary, rng, stats) + caustic_light(primary, stats);
+    push_secondary(dir, primary, 1.f, 0, primary_width, pixel_angle);
+    while (sp) {
+        RayTask ray = stack[--sp];
+        Hit hit;
+        if (ray.depth > MAX_DEPTH || !scene_intersect(scene, ray.orig, ray.dir, hit)) {
+            color = color + background(ray.dir, ray.spread) * ray.weight;
+            continue;
+        }
+        stats.traced++;
+        const float width = ray.width + ray.spread * hit.dist;
+        shade_texture(scene, ray.dir, width, hit);
+        uint32_t visible;
+        const bool cached = cached_visibility(hit, stats, visible);
+        color = color + (direct_light(ray.dir, hit, [&](const int i, const vec3 &light_dir, const float light_dist) {
+            if (cached && i < 32) return bool(visible >> i & 1);
+            stats.shadow++;
+            return light_visible_scalar(hit.point, light_dir, light_dist);
+        }) + many_light(ray.dir, hit, rng, stats) + caustic_light(hit, stats)) * ray.weight;
+        push_secondary(ray.dir, hit, ray.weight, ray.depth, width, ray.spread);
+    }
+    return color;
+}
 
-        auto [intersection, d] = ray_sphere_intersect(orig, dir, temp_sphere);
-        if (!intersection || d > nearest_dist) continue;
+// Цвет одного луча камеры без пакетов
+vec3 cast_ray(const vec3 &orig, const vec3 &dir, Sampler &rng) {
+    Hit hit;
+    if (!scene_intersect(scene, orig, dir, hit)) return background(dir, pixel_angle);
+    return trace_path(dir, hit, [&](int, const vec3 &light_dir, const float light_dist) {
+        return light_visible_scalar(hit.point, light_dir, light_dist);
+    }, rng);
+}
 
-        nearest_dist = d;
-        pt = orig + dir * nearest_dist;
-        N = (pt - temp_sphere.center).normalized();
-        material = temp_sphere.material;
+// Дерево лучей пикселя для --relight: обход как в trace_path, но без русской рулетки, и отражение трассируется
+// даже при нулевом albedo[2] — зеркальность можно добавить любому материалу. Преломление — только у прозрачных
+void record_ray_tree(const vec3 &dir, RayTreeCache &cache) {
+    struct RayTask { vec3 orig, dir; int parent, branch, depth; float width, spread; };
+    RayTask stack[MAX_DEPTH + 2];
+    int sp = 0;
+    stack[sp++] = {{0, 0, 0}, dir, -1, 0, 0, 0.f, pixel_angle};
+    cache.begin_pixel();
+    float log_specular[256];
+    while (sp) {
+        const RayTask ray = stack[--sp];
+        RayTreeNode node = {};
+        node.parent = int16_t(ray.parent);
+        node.branch = uint8_t(ray.branch);
+        node.material = -1;
+        Hit hit;
+        if (ray.depth > MAX_DEPTH || !scene_intersect(scene, ray.orig, ray.dir, hit)) {
+            node.color = background(ray.dir, ray.spread);
+            cache.add_node(node, nullptr);
+            continue;
+        }
+        const float width = ray.width + ray.spread * hit.dist;
+        shade_texture(scene, ray.dir, width, hit);
+        node.material = int16_t(hit.material);
+        node.color = hit.diffuse_color;
+        node.own_color = hit.prim >= scene.sphere_count();
+        const int lights = std::min(scene.light_count(), 255);
+        for (int i = 0; i < lights; i++) {
+            const vec3 to_light = scene.light(i) - hit.point;
+            const float light_dist = to_light.norm();
+            const vec3 light_dir = to_light * (1.f / light_dist);
+            if (!light_visible_scalar(hit.point, light_dir, light_dist)) continue;
+            node.diffuse += std::max(0.f, light_dir * hit.N);
+            log_specular[node.lights++] = std::log(std::max(0.f, -reflect(-light_dir, hit.N) * ray.dir)); // log 0 = -inf
+        }
+        const int index = cache.add_node(node, log_specular);
+        const Material &material = scene.materials[hit.material];
+        const float curvature = hit.prim < scene.sphere_count() ? 1.f / scene.sphere_r[hit.prim] : 0.f;
+        stack[sp++] = {hit.point, reflect(ray.dir, hit.N).normalized(), index, 0, ray.depth + 1, width, ray.spread + 2 * width * curvature};
+        if (material.albedo[3] > 0)
+            stack[sp++] = {hit.point, refract(ray.dir, hit.N, material.refractive_index).normalized(), index, 1, ray.depth + 1, width, ray.spread};
     }
+}
+
+float camera_cos = 1, camera_sin = 0; // поворот камеры вокруг вертикали (панорама кадров --frames)
+
+// (du, dv) — точка внутри пикселя, по умолчанию центр
+vec3 camera_dir(const int i, const int j, const int width, const int height, const float fov,
+                const float du = 0.5f, const float dv = 0.5f) {
+    float dir_x =  (i + du) -  width / 2.;
+    float dir_y = -(j + dv) + height / 2.; // this flips the image at the same time
+    float dir_z = -height / (2. * tan(fov / 2.));
+    vec3 d = vec3{dir_x, dir_y, dir_z}.normalized();
+    return {camera_cos * d.x + camera_sin * d.z, d.y, camera_cos * d.z - camera_sin * d.x};
+}
+
+constexpr uint32_t JITTER_STREAM = 1; // поток Sampler для смещения сэмпла внутри пикселя
+constexpr uint32_t PATH_STREAM = 2;   // поток Sampler для отскоков path_trace (по 8 чисел на отскок)
 
-    // Пересечение с полом (шахматная структура)
-    if (std::abs(dir.y) > .001) { // avoid division by zero
-        float d = -(orig.y + 5.5) / dir.y; // the checkerboard plane has equation y = -4
-        vec3 p = orig + dir * d;
-        if (d > .001 && d < nearest_dist && std::abs(p.x) < 10 && p.z < -10 && p.z > -30) {
-            nearest_dist = d;
-            pt = p;
-            N = {0, 1, 0};
-            int cell_x = int(pt.x * 3) % 3;
-            int cell_y = int(pt.y * 3) % 3;
-            material.diffuse_color = (cell_x + cell_y) % 2 ? vec3{0.8, 0.7, 0.6} : vec3{0.2, 0.1, 0.1};
-        }   
+// Со случайным сэмплером sample 0 — центр пикселя (как без сэмплов), остальные смещены внутри пикселя;
+// у последовательностей Sobol/синего шума смещён каждый сэмпл. lanes — какие дорожки нужны
+RayPacket primary_packet(const RenderSettings &settings, const int x0, const int y0, const int width, const int height,
+                         const float fov, const int step = 1, const int sample = 0, const int lanes = (1 << SIMD_WIDTH) - 1) {
+    RayPacket packet;
+    for (int lane = 0; lane < SIMD_WIDTH; lane++) {
+        int i = lane_x(x0, lane, step), j = lane_y(y0, lane, step);
+        if (i >= width || j >= height || !(lanes >> lane & 1)) continue;
+        if (sample == 0 && settings.sampler == SamplerType::random) {
+            packet.set(lane, {0, 0, 0}, camera_dir(i, j, width, height, fov));
+            continue;
+        }
+        Sampler jitter(settings.sampler, i, j, width, sample, JITTER_STREAM);
+        const float du = jitter.next_float(), dv = jitter.next_float();
+        packet.set(lane, {0, 0, 0}, camera_dir(i, j, width, height, fov, du, dv));
     }
+    return packet;
+}
+
+// Теневые лучи к источнику light из всех точек попадания hit_mask одним пакетом; возвращает маску закрытых
+int shadow_packet(const int light, const Hit hits[SIMD_WIDTH], const int hit_mask) {
+    RayPacket packet;
+    alignas(32) float tmax[SIMD_WIDTH] = {};
+    for (int lane = 0; lane < SIMD_WIDTH; lane++) {
+        if (!(hit_mask >> lane & 1)) continue;
+        vec3 to_light = scene.light(light) - hits[lane].point;
+        tmax[lane] = to_light.norm();
+        packet.set(lane, hits[lane].point, to_light * (1.f / tmax[lane]));
+    }
+    return packet_occluded(scene, packet, tmax);
+}
+
+// Цвета пакета пикселей блока с левым верхним углом (x0, y0): первичные и первые теневые лучи идут пакетами,
+// вторичные — через trace_path. features — признаки пикселей для денойзера (если нужны)
+void trace_packet(const RenderSettings &settings, const RayPacket &packet, const int x0, const int y0, const int width,
+                  vec3 colors[SIMD_WIDTH], const int step = 1, const int sample = 0, PixelFeatures *features = nullptr) {
+    Hit hits[SIMD_WIDTH];
+    const int hit_mask = packet_intersect(scene, packet, hits);
 
-    // Пересечение с вертикальной стеной
-    if (std::abs(dir.x) > 0.001) { // avoid division by zero
-        float d = -(orig.x + 7.3) / dir.x; // the wall plane has equation x = -10
-        vec3 p = orig + dir * d;
-        if (d > 0.001 && d < nearest_dist && p.y < 10 && p.y > -4 && p.z < -10 && p.z > -30) {
-            nearest_dist = d;
-            pt = p;
-            N = {1, 0, 0};
-            material.diffuse_color = (int(pt.x * 2 + pt.z * 2 + std::rand() % 2) % 2) ? vec3{0.5, 0.5, 0.5} : vec3{0.2, 0.2, 0.2};
+    if (settings.integrator == Integrator::path) { // пакетом — только первичные лучи, дальше каждый путь свой
+        for (int lane = 0; lane < SIMD_WIDTH; lane++) {
+            if (!(packet.active >> lane & 1)) continue;
+            const vec3 dir = {packet.dx[lane], packet.dy[lane], packet.dz[lane]};
+            Sampler rng(settings.sampler, lane_x(x0, lane, step), lane_y(y0, lane, step), width, sample, PATH_STREAM);
+            colors[lane] = path_trace(scene, {0, 0, 0}, dir, hit_mask >> lane & 1 ? &hits[lane] : nullptr, rng, settings.path,
+                                      features ? &features[lane] : nullptr);
         }
+        return;
     }
 
-    // Пересечение с существующими сферами
-    for (const Sphere &s : spheres) {
-        auto [intersection, d] = ray_sphere_intersect(orig, dir, s);
-        if (!intersection || d > nearest_dist) continue;
-        nearest_dist = d;
-        pt = orig + dir * nearest_dist;
-        N = (pt - s.center).normalized();
-        material = s.material;
+    unsigned occluded[SIMD_WIDTH] = {}; // бит i — источник i закрыт (для первых 32 источников)
+    const int packed_lights = std::min(scene.light_count(), 32);
+    RayStats &stats = ray_stats[omp_get_thread_num()];
+    // Кэш освещённости спрашивается один раз на пакет: теневые пакеты экономятся, только если в кэше весь пакет
+    uint32_t visible;
+    if (use_irradiance_cache && hit_mask && irradiance_cache.lookup_packet(hits, hit_mask, visible)) {
+        for (int lane = 0; lane < SIMD_WIDTH; lane++) occluded[lane] = ~visible;
+        stats.cache_hits += __builtin_popcount(hit_mask);
+    } else {
+        for (int l = 0; l < packed_lights; l++) {
+            int mask = hit_mask ? shadow_packet(l, hits, hit_mask) : 0;
+            for (int lane = 0; lane < SIMD_WIDTH; lane++) occluded[lane] |= unsigned(mask >> lane & 1) << l;
+        }
+        stats.shadow += (long long)packed_lights * __builtin_popcount(hit_mask);
+        if (use_irradiance_cache) stats.cache_misses += __builtin_popcount(hit_mask);
     }
 
-    return {nearest_dist < 1000, pt, N, material};
+    for (int lane = 0; lane < SIMD_WIDTH; lane++) {
+        if (!(packet.active >> lane & 1)) continue;
+        vec3 dir = {packet.dx[lane], packet.dy[lane], packet.dz[lane]};
+        if (!(hit_mask >> lane & 1)) {
+            colors[lane] = background(dir, pixel_angle);
+            if (features) features[lane] = {-dir, colors[lane], MISS_DEPTH};
+            continue;
+        }
+        const Hit &hit = hits[lane];
+        Sampler rng(settings.sampler, lane_x(x0, lane, step), lane_y(y0, lane, step), width, sample);
+        colors[lane] = trace_path(dir, hit, [&](const int i, const vec3 &light_dir, const float light_dist) {
+            if (i < 32) return !(occluded[lane] >> i & 1);
+            stats.shadow++;
+            return light_visible_scalar(hit.point, light_dir, light_dist);
+        }, rng, features ? &features[lane] : nullptr);
+    }
 }
 
-vec3 cast_ray(const vec3 &orig, const vec3 &dir, const int depth=0) {
-    auto [hit, point, N, material] = scene_intersect(orig, dir);
-    if (depth > 4 || !hit) {
-        // Используем окружение как фон
-        float phi = std::atan2(dir.z, dir.x);
-        float theta = std::acos(dir.y);
-        int x = static_cast<int>((phi + M_PI) / (2 * M_PI) * envmap_width);
-        int y = static_cast<int>(theta / M_PI * envmap_height);
-        return envmap[x + y * envmap_width];
+inline float luminance(const vec3 &c) { return 0.2126f * c[0] + 0.7152f * c[1] + 0.0722f * c[2]; }
+inline float sqr(const float x) { return x * x; }
+
+// Линейные цвета пакета в RGB float-буфер, первая строка которого — строка кадра first_row
+void store_packet(const RayPacket &packet, const vec3 colors[SIMD_WIDTH], const int x0, const int y0, const int width,
+                  const int first_row, float *hdr) {
+    for (int lane = 0; lane < SIMD_WIDTH; lane++) {
+        if (!(packet.active >> lane & 1)) continue;
+        size_t pix = lane_x(x0, lane, 1) + size_t(lane_y(y0, lane, 1) - first_row) * width;
+        for (int c = 0; c < 3; c++) hdr[pix * 3 + c] = colors[lane][c];
     }
+}
 
-    vec3 reflect_dir = reflect(dir, N).normalized();
-    vec3 refract_dir = refract(dir, N, material.refractive_index).normalized();
-    vec3 reflect_color = cast_ray(point, reflect_dir, depth + 1);
-    vec3 refract_color = cast_ray(point, refract_dir, depth + 1);
+// Признаки пакета в буфер кадра (строки с first_row, как у store_packet)
+void store_features(const RayPacket &packet, const PixelFeatures features[SIMD_WIDTH], const int x0, const int y0,
+                    const int width, const int first_row, FeatureBuffer &buffer) {
+    for (int lane = 0; lane < SIMD_WIDTH; lane++) {
+        if (!(packet.active >> lane & 1)) continue;
+        buffer.set(lane_x(x0, lane, 1) + size_t(lane_y(y0, lane, 1) - first_row) * width, features[lane]);
+    }
+}
 
-    float diffuse_light_intensity = 0, specular_light_intensity = 0;
-    for (const vec3 &light : lights) {
-        vec3 light_dir = (light - point).normalized();
-        auto [hit, shadow_pt, trashnrm, trashmat] = scene_intersect(point, light_dir);
-        if (hit && (shadow_pt - point).norm() < (light - point).norm()) continue;
-        diffuse_light_intensity  += std::max(0.f, light_dir * N);
-        specular_light_intensity += std::pow(std::max(0.f, -reflect(-light_dir, N) * dir), material.specular_exponent);
+// Заполнение кэша освещённости перед кадром: волны по центрам пикселей с шагом 16 и 8 (волна с шагом 4 стоила
+// втрое дороже двух первых, а попаданий в кэш почти не прибавляла). Запись ставится, где годных записей
+// меньше двух, радиус — CACHE_RADIUS шагов волны в пикселях на расстоянии попадания. Записи волны
+// считаются параллельно и вставляются по порядку пикселей — кэш не зависит от числа потоков
+long long seed_shadow_rays = 0;
+double seed_ms = 0;
+void seed_irradiance_cache(const int width, const int height, const float fov) {
+    constexpr float CACHE_RADIUS = 1.5f;
+    auto start = std::chrono::steady_clock::now();
+    for (int step = 16; step >= 8; step /= 2) {
+        const int columns = (width + step - 1) / step, rows = (height + step - 1) / step;
+        std::vector<IrradianceRecord> wave(size_t(columns) * rows);
+        std::vector<char> made(wave.size(), 0);
+        long long shadow_rays = 0;
+#pragma omp parallel for schedule(dynamic, 1) reduction(+:shadow_rays)
+        for (int row = 0; row < rows; row++) {
+            for (int column = 0; column < columns; column++) {
+                Hit hit;
+                const vec3 dir = camera_dir(column * step, row * step, width, height, fov);
+                if (!scene_intersect(scene, {0, 0, 0}, dir, hit)) continue;
+                if (!irradiance_cache.uncovered(hit.point, hit.N)) continue;
+                const size_t k = size_t(row) * columns + column;
+                wave[k] = make_irradiance_record(scene, hit, CACHE_RADIUS * step * pixel_angle * hit.dist, shadow_rays);
+                made[k] = 1;
+            }
+        }
+        std::vector<IrradianceRecord> batch;
+        for (size_t k = 0; k < wave.size(); k++)
+            if (made[k]) batch.push_back(wave[k]);
+        irradiance_cache.insert(batch);
+        seed_shadow_rays += shadow_rays;
+    }
+    seed_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Сравнение скалярного и пакетного трассирования первичных и теневых лучей (без затенения и вторичных лучей)
+void bench_packets(const int width, const int height, const float fov) {
+    long long scalar_rays = 0, packet_rays = 0;
+    auto start = std::chrono::steady_clock::now();
+#pragma omp parallel for schedule(dynamic, 16) reduction(+:scalar_rays)
+    for (int j = 0; j < height; j++) {
+        for (int i = 0; i < width; i++) {
+            Hit hit;
+            scalar_rays++;
+            if (!scene_intersect(scene, {0, 0, 0}, camera_dir(i, j, width, height, fov), hit)) continue;
+            for (int l = 0; l < scene.light_count(); l++) {
+                vec3 to_light = scene.light(l) - hit.point;
+                float light_dist = to_light.norm();
+                light_visible_scalar(hit.point, to_light * (1.f / light_dist), light_dist);
+                scalar_rays++;
+            }
+        }
+    }
+    double scalar_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    start = std::chrono::steady_clock::now();
+#pragma omp parallel for schedule(dynamic, 4) reduction(+:packet_rays)
+    for (int y0 = 0; y0 < height; y0 += BLOCK_H) {
+        for (int x0 = 0; x0 < width; x0 += BLOCK_W) {
+            RayPacket packet = primary_packet(RenderSettings{}, x0, y0, width, height, fov); // центры пикселей
+            Hit hits[SIMD_WIDTH];
+            int hit_mask = packet_intersect(scene, packet, hits);
+            packet_rays += __builtin_popcount(packet.active);
+            if (!hit_mask) continue;
+            for (int l = 0; l < scene.light_count(); l++) {
+                shadow_packet(l, hits, hit_mask);
+                packet_rays += __builtin_popcount(hit_mask);
+            }
+        }
     }
-    return material.diffuse_color * diffuse_light_intensity * material.albedo[0] + 
-           vec3{1., 1., 1.} * specular_light_intensity * material.albedo[1] + 
-           reflect_color * material.albedo[2] + 
-           refract_color * material.albedo[3];
+    double packet_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << "Primary+shadow rays at " << width << "x" << height << ": " << scalar_rays << std::endl;
+    std::cout << "  scalar:     " << scalar_ms << " ms, " << scalar_rays / scalar_ms / 1e3 << " Mrays/s" << std::endl;
+    std::cout << "  packet x" << SIMD_WIDTH << ":  " << packet_ms << " ms, " << packet_rays / packet_ms / 1e3 << " Mrays/s"
+              << " (" << scalar_ms / packet_ms << "x)" << std::endl;
+}
+
+// Вторичные лучи (отражения и преломления глубины 1..4), которые породил бы cast_ray из пикселя
+void collect_secondary(const vec3 &orig, const vec3 &dir, const int depth, std::vector<vec3> &rays) {
+    Hit hit;
+    if (depth > MAX_DEPTH || !scene_intersect(scene, orig, dir, hit)) return;
+    if (depth > 0) { rays.push_back(orig); rays.push_back(dir); }
+    const Material &material = scene.materials[hit.material];
+    collect_secondary(hit.point, reflect(dir, hit.N).normalized(), depth + 1, rays);
+    collect_secondary(hit.point, refract(dir, hit.N, material.refractive_index).normalized(), depth + 1, rays);
 }
 
-int main() {
-    constexpr int   width  = 1024;
-    constexpr int   height = 768;
+// Сравнение бинарного и широкого BVH на некогерентных вторичных лучах
+void bench_wide(const int width, const int height, const float fov) {
+    std::vector<vec3> rays; // пары (начало, направление)
+    for (int j = 0; j < height; j += 4)
+        for (int i = 0; i < width; i += 4)
+            collect_secondary({0, 0, 0}, camera_dir(i, j, width, height, fov), 0, rays);
+    const int count = static_cast<int>(rays.size() / 2);
+
+    double ms[2];
+    for (int wide = 0; wide < 2; wide++) {
+        auto start = std::chrono::steady_clock::now();
+#pragma omp parallel for schedule(dynamic, 256)
+        for (int r = 0; r < count; r++) {
+            Hit hit;
+            if (wide) scene_intersect(scene, rays[2 * r], rays[2 * r + 1], hit);
+            else scene_intersect_binary(scene, rays[2 * r], rays[2 * r + 1], hit);
+        }
+        ms[wide] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+    std::cout << "Secondary rays (every 16th pixel): " << count << std::endl;
+    std::cout << "  binary BVH: " << ms[0] << " ms, " << count / ms[0] / 1e3 << " Mrays/s" << std::endl;
+    std::cout << "  BVH" << SIMD_WIDTH << ":       " << ms[1] << " ms, " << count / ms[1] / 1e3 << " Mrays/s"
+              << " (" << ms[0] / ms[1] << "x)" << std::endl;
+}
+
+// Теневые лучи из первичных попаданий: поиск ближайшего пересечения против scene_occluded
+void bench_shadows(const int width, const int height, const float fov) {
+    std::vector<vec3> rays; // тройки (начало, направление, {расстояние до источника, 0, 0})
+    for (int j = 0; j < height; j++) {
+        for (int i = 0; i < width; i++) {
+            Hit hit;
+            if (!scene_intersect(scene, {0, 0, 0}, camera_dir(i, j, width, height, fov), hit)) continue;
+            for (int l = 0; l < scene.light_count(); l++) {
+                vec3 to_light = scene.light(l) - hit.point;
+                float light_dist = to_light.norm();
+                rays.insert(rays.end(), {hit.point, to_light * (1.f / light_dist), {light_dist, 0, 0}});
+            }
+        }
+    }
+    const int count = static_cast<int>(rays.size() / 3);
+
+    double ms[2];
+    int blocked[2] = {0, 0};
+    for (int any_hit = 0; any_hit < 2; any_hit++) {
+        int n = 0;
+        auto start = std::chrono::steady_clock::now();
+#pragma omp parallel for schedule(dynamic, 256) reduction(+:n)
+        for (int r = 0; r < count; r++) {
+            const vec3 &orig = rays[3 * r], &dir = rays[3 * r + 1];
+            const float light_dist = rays[3 * r + 2].x;
+            Hit shadow;
+            n += any_hit ? scene_occluded(scene, orig, dir, light_dist)
+                         : scene_intersect(scene, orig, dir, shadow) && shadow.dist < light_dist;
+        }
+        ms[any_hit] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        blocked[any_hit] = n;
+    }
+    std::cout << "Shadow rays: " << count << ", occluded " << blocked[1] << (blocked[0] == blocked[1] ? "" : " (MISMATCH)") << std::endl;
+    std::cout << "  closest hit:  " << ms[0] << " ms" << std::endl;
+    std::cout << "  any hit:      " << ms[1] << " ms (" << ms[0] / ms[1] << "x)" << std::endl;
+}
+
+// Закраска промахов: панорама через atan2/acos против кубической карты на одних и тех же направлениях
+void bench_envmap() {
+    constexpr int count = 1 << 22;
+    std::vector<vec3> dirs(count);
+    for (int i = 0; i < count; i++) {
+        Rng rng(i, 0);
+        float z = 1 - 2 * rng.next_float(), phi = 2 * M_PI * rng.next_float(), r = std::sqrt(std::max(0.f, 1 - z * z));
+        dirs[i] = {r * std::cos(phi), r * std::sin(phi), z};
+    }
+
+    double ms[2];
+    vec3 sum[2];
+    for (int cube = 0; cube < 2; cube++) {
+        float sx = 0, sy = 0, sz = 0;
+        auto start = std::chrono::steady_clock::now();
+#pragma omp parallel for schedule(static) reduction(+:sx, sy, sz)
+        for (int i = 0; i < count; i++) {
+            vec3 c = cube ? background(dirs[i], pixel_angle) : background_equirect(dirs[i]);
+            sx += c.x; sy += c.y; sz += c.z;
+        }
+        ms[cube] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        sum[cube] = vec3{sx, sy, sz} * (1.f / count);
+    }
+    std::cout << "Envmap lookups: " << count << ", mean color equirect (" << sum[0].x << ", " << sum[0].y << ", " << sum[0].z
+              << "), cubemap (" << sum[1].x << ", " << sum[1].y << ", " << sum[1].z << ")" << std::endl;
+    std::cout << "  equirect: " << ms[0] << " ms, " << ms[0] * 1e6 / count << " ns/lookup" << std::endl;
+    std::cout << "  cubemap:  " << ms[1] << " ms, " << ms[1] * 1e6 / count << " ns/lookup (" << ms[0] / ms[1] << "x)" << std::endl;
+}
+
+// Сходимость сэмплеров: RMSE оценки интеграла по пикселю против числа сэмплов на 4096 «пикселях».
+// Ступенька (край силуэта под случайным углом) и гауссиана считаются по двум измерениям джиттера,
+// кроп сцены 64x64 с силуэтами сфер — полным путём (джиттер и рулетка) против 1024 случайных сэмплов
+void bench_sampling(const RenderSettings &settings, const int width, const int height, const float fov) {
+    constexpr int SIDE = 64, PIXELS = SIDE * SIDE, MAX_N = 64, GRID = 128;
+    const SamplerType types[] = {SamplerType::random, SamplerType::sobol, SamplerType::bluenoise};
+    const char *names[] = {"random", "sobol", "bluenoise"};
+
+    struct Edge { float nx, ny, c; };
+    std::vector<Edge> edges(PIXELS);
+    std::vector<float> edge_ref(PIXELS), gauss_ref(PIXELS);
+    std::vector<vec3> centers(PIXELS);
+    for (int p = 0; p < PIXELS; p++) {
+        Rng rng(p, 0, 0xbe);
+        const float a = 2 * M_PI * rng.next_float();
+        edges[p] = {std::cos(a), std::sin(a), 0.f};
+        edges[p].c = 0.5f * (edges[p].nx + edges[p].ny) + (rng.next_float() - 0.5f) * 0.8f; // прямая пересекает пиксель
+        centers[p] = {rng.next_float(), rng.next_float(), 0};
+        int inside = 0;
+        for (int gy = 0; gy < GRID; gy++)
+            for (int gx = 0; gx < GRID; gx++)
+                inside += (gx + .5f) / GRID * edges[p].nx + (gy + .5f) / GRID * edges[p].ny < edges[p].c;
+        edge_ref[p] = float(inside) / (GRID * GRID);
+        auto axis = [](const float m) { return std::sqrt(M_PI) / 4 * (std::erf(2 * (1 - m)) + std::erf(2 * m)); };
+        gauss_ref[p] = axis(centers[p].x) * axis(centers[p].y);
+    }
+
+    // Кроп сцены вокруг стеклянной сферы и её соседей
+    const int x0 = width / 2 - SIDE / 2, y0 = height * 58 / 100 - SIDE / 2;
+    auto render_crop = [&](const SamplerType type, const int first, const int count, std::vector<vec3> &sum) {
+        RenderSettings crop_settings = settings;
+        crop_settings.sampler = type;
+#pragma omp parallel for schedule(dynamic, 1)
+        for (int b = 0; b < PIXELS / SIMD_WIDTH; b++) {
+            const int bx = x0 + b % (SIDE / BLOCK_W) * BLOCK_W, by = y0 + b / (SIDE / BLOCK_W) * BLOCK_H;
+            for (int k = first; k < first + count; k++) {
+                RayPacket packet = primary_packet(crop_settings, bx, by, width, height, fov, 1, k);
+                vec3 colors[SIMD_WIDTH];
+                trace_packet(crop_settings, packet, bx, by, width, colors, 1, k);
+                for (int lane = 0; lane < SIMD_WIDTH; lane++) {
+                    vec3 &pixel = sum[(lane_y(by, lane, 1) - y0) * SIDE + lane_x(bx, lane, 1) - x0];
+                    pixel = pixel + colors[lane];
+                }
+            }
+        }
+    };
+    std::vector<vec3> scene_ref(PIXELS, vec3{0, 0, 0});
+    auto ref_start = std::chrono::steady_clock::now();
+    render_crop(SamplerType::random, 1000, 1024, scene_ref); // сэмплы, которых нет в самих оценках
+    for (vec3 &c : scene_ref) c = c * (1.f / 1024);
+    std::cout << "Sampling convergence, RMSE over " << PIXELS << " pixels (scene reference: 1024 spp in "
+              << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - ref_start).count() << " ms)" << std::endl;
+
+    // rmse[тип][интеграл][log2 N]
+    double rmse[3][3][7] = {};
+    for (int t = 0; t < 3; t++) {
+        for (int li = 0, n = 1; n <= MAX_N; li++, n *= 2) {
+            double err[2] = {};
+#pragma omp parallel for schedule(static) reduction(+:err[:2])
+            for (int p = 0; p < PIXELS; p++) {
+                float edge = 0, gauss = 0;
+                for (int k = 0; k < n; k++) {
+                    Sampler sampler(types[t], p % SIDE, p / SIDE, SIDE, k, JITTER_STREAM);
+                    const float u = sampler.next_float(), v = sampler.next_float();
+                    edge += u * edges[p].nx + v * edges[p].ny < edges[p].c;
+                    gauss += std::exp(-4 * (sqr(u - centers[p].x) + sqr(v - centers[p].y)));
+                }
+                err[0] += sqr(edge / n - edge_ref[p]);
+                err[1] += sqr(gauss / n - gauss_ref[p]);
+            }
+            std::vector<vec3> sum(PIXELS, vec3{0, 0, 0});
+            render_crop(types[t], 0, n, sum);
+            double scene_err = 0;
+            for (int p = 0; p < PIXELS; p++) scene_err += sqr(luminance(sum[p] * (1.f / n)) - luminance(scene_ref[p]));
+            rmse[t][0][li] = std::sqrt(err[0] / PIXELS);
+            rmse[t][1][li] = std::sqrt(err[1] / PIXELS);
+            rmse[t][2][li] = std::sqrt(scene_err / PIXELS);
+        }
+    }
+
+    const char *integrals[] = {"edge", "gaussian", "scene crop"};
+    for (int f = 0; f < 3; f++) {
+        std::cout << "  " << integrals[f] << ":" << std::endl << "    spp";
+        for (const char *name : names) std::cout << "\t" << name;
+        std::cout << std::endl;
+        for (int li = 0, n = 1; n <= MAX_N; li++, n *= 2) {
+            std::cout << "    " << n;
+            for (int t = 0; t < 3; t++) std::cout << "\t" << rmse[t][f][li];
+            std::cout << std::endl;
+        }
+        // Во сколько раз меньше сэмплов нужно для ошибки random при 64 spp (интерполяция в логарифмах)
+        const double target = rmse[0][f][6];
+        std::cout << "    spp for random's error at " << MAX_N << ":";
+        for (int t = 1; t < 3; t++) {
+            double needed = MAX_N;
+            for (int li = 0; li < 6; li++) {
+                if (rmse[t][f][li + 1] > target) continue;
+                const double k = std::log(rmse[t][f][li] / target) / std::log(rmse[t][f][li] / rmse[t][f][li + 1]);
+                needed = std::min(std::exp2(li + std::max(0.0, k)), double(MAX_N));
+                break;
+            }
+            std::cout << " " << names[t] << " " << needed << " (" << MAX_N / needed << "x fewer)";
+        }
+        std::cout << std::endl;
+    }
+}
+
+// PSNR двух RGB8-кадров, дБ
+double psnr(const std::vector<unsigned char> &a, const std::vector<unsigned char> &b) {
+    double err = 0;
+    for (size_t i = 0; i < a.size(); i++) err += sqr(float(a[i]) - float(b[i]));
+    return err ? 10 * std::log10(255. * 255. * a.size() / err) : INFINITY;
+}
+
+// Денойзер на кропе сцены 256x160 в центре кадра: PSNR после тональной компрессии (как в PNG) до и после
+// фильтра против 1024 сэмплов и время фильтра на мегапиксель
+void bench_denoise(const RenderSettings &settings, const int width, const int height, const float fov) {
+    const int W = std::min(width, 256) / BLOCK_W * BLOCK_W, H = std::min(height, 160) / BLOCK_H * BLOCK_H;
+    const int x0 = (width - W) / 2, y0 = (height - H) / 2;
+    const size_t pixels = size_t(W) * H;
+    // variance — дисперсия средней яркости пикселя по его сэмплам (если сэмплов больше одного)
+    auto render_crop = [&](const RenderSettings &crop_settings, const int first, const int count, std::vector<float> &hdr,
+                           FeatureBuffer *features, std::vector<float> *variance = nullptr) {
+        hdr.assign(pixels * 3, 0.f);
+        std::vector<float> sum_sq(pixels);
+        if (features) *features = FeatureBuffer(pixels);
+#pragma omp parallel for schedule(dynamic, 1)
+        for (int b = 0; b < int(pixels / SIMD_WIDTH); b++) {
+            const int bx = x0 + b % (W / BLOCK_W) * BLOCK_W, by = y0 + b / (W / BLOCK_W) * BLOCK_H;
+            for (int k = first; k < first + count; k++) {
+                RayPacket packet = primary_packet(crop_settings, bx, by, width, height, fov, 1, k);
+                vec3 colors[SIMD_WIDTH];
+                PixelFeatures lane_features[SIMD_WIDTH];
+                trace_packet(crop_settings, packet, bx, by, width, colors, 1, k, features ? lane_features : nullptr);
+                for (int lane = 0; lane < SIMD_WIDTH; lane++) {
+                    const size_t p = size_t(lane_y(by, lane, 1) - y0) * W + lane_x(bx, lane, 1) - x0;
+                    for (int c = 0; c < 3; c++) hdr[p * 3 + c] += colors[lane][c] / count;
+                    sum_sq[p] += sqr(luminance(colors[lane]));
+                    if (features) features->add(p, lane_features[lane]);
+                }
+            }
+        }
+        if (variance && count > 1) {
+            variance->resize(pixels);
+            for (size_t p = 0; p < pixels; p++) {
+                const float mean = luminance(vec3{hdr[p * 3], hdr[p * 3 + 1], hdr[p * 3 + 2]});
+                (*variance)[p] = std::max(0.f, sum_sq[p] / count - mean * mean) / (count - 1);
+            }
+        }
+        if (!features) return;
+        for (float &v : features->normal) v /= count;
+        for (float &v : features->albedo) v /= count;
+        for (float &v : features->depth) v /= count;
+    };
+    auto to_rgb8 = [&](const std::vector<float> &hdr) {
+        std::vector<unsigned char> rgb(hdr.size());
+        tone_map(hdr.data(), pixels, ToneMap::max, 1, rgb.data());
+        return rgb;
+    };
+
+    std::vector<float> reference;
+    auto ref_start = std::chrono::steady_clock::now();
+    RenderSettings reference_settings = settings;
+    reference_settings.sampler = SamplerType::random;
+    render_crop(reference_settings, 1000, 1024, reference, nullptr); // сэмплы, которых нет в самих оценках
+    const std::vector<unsigned char> reference_rgb = to_rgb8(reference);
+    std::cout << "Denoising, " << W << "x" << H << " crop (reference: 1024 spp in "
+              << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - ref_start).count() << " ms)" << std::endl
+              << "    spp\tnoisy PSNR\tdenoised PSNR" << std::endl;
+    double best_ms = 1e30;
+    for (const int n : {1, 2, 4, 16, 64}) {
+        std::vector<float> hdr, filtered(pixels * 3), variance;
+        FeatureBuffer features;
+        render_crop(settings, 0, n, hdr, &features, &variance);
+        for (int run = 0; run < 3; run++) {
+            auto start = std::chrono::steady_clock::now();
+            denoise(hdr.data(), features, variance.empty() ? nullptr : variance.data(), W, H, filtered.data());
+            best_ms = std::min(best_ms, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+        }
+        std::cout << "    " << n << "\t" << psnr(to_rgb8(hdr), reference_rgb) << " dB\t" << psnr(to_rgb8(filtered), reference_rgb)
+                  << " dB" << std::endl;
+    }
+    std::cout << "    denoise: " << best_ms << " ms, " << best_ms / (pixels / 1e6) << " ms per megapixel" << std::endl;
+}
+
+// Трассировка путей на кропе 128x80 в центре кадра: RMSE против времени для трёх способов найти прямой свет
+// (только BRDF, только источники, MIS) против 1024 сэмплов MIS. Сэмплы копятся, время — накопленное
+void bench_path(const RenderSettings &settings, const int width, const int height, const float fov) {
+    const int W = std::min(width, 128) / BLOCK_W * BLOCK_W, H = std::min(height, 80) / BLOCK_H * BLOCK_H;
+    const int x0 = (width - W) / 2, y0 = (height - H) / 2;
+    const size_t pixels = size_t(W) * H;
+    constexpr int MAX_N = 256;
+    RenderSettings crop_settings = settings;
+    crop_settings.integrator = Integrator::path;
+    auto render_crop = [&](const int first, const int count, std::vector<vec3> &sum) {
+#pragma omp parallel for schedule(dynamic, 1)
+        for (int b = 0; b < int(pixels / SIMD_WIDTH); b++) {
+            const int bx = x0 + b % (W / BLOCK_W) * BLOCK_W, by = y0 + b / (W / BLOCK_W) * BLOCK_H;
+            for (int k = first; k < first + count; k++) {
+                RayPacket packet = primary_packet(crop_settings, bx, by, width, height, fov, 1, k);
+                vec3 colors[SIMD_WIDTH];
+                trace_packet(crop_settings, packet, bx, by, width, colors, 1, k);
+                for (int lane = 0; lane < SIMD_WIDTH; lane++) {
+                    vec3 &pixel = sum[size_t(lane_y(by, lane, 1) - y0) * W + lane_x(bx, lane, 1) - x0];
+                    pixel = pixel + colors[lane];
+                }
+            }
+        }
+    };
+
+    crop_settings.sampler = SamplerType::random;
+    crop_settings.path.lights = LightSampling::mis;
+    std::vector<vec3> reference(pixels, vec3{0, 0, 0});
+    auto ref_start = std::chrono::steady_clock::now();
+    render_crop(100000, 1024, reference); // сэмплы, которых нет в самих оценках
+    for (vec3 &c : reference) c = c * (1.f / 1024);
+    crop_settings.sampler = settings.sampler;
+    std::cout << "Path tracing, " << W << "x" << H << " crop, RMSE of luminance against time (reference: 1024 spp MIS in "
+              << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - ref_start).count() << " ms)" << std::endl
+              << "    spp\tbsdf ms\tbsdf\tnee ms\tnee\tmis ms\tmis" << std::endl;
+
+    const LightSampling modes[] = {LightSampling::bsdf, LightSampling::nee, LightSampling::mis};
+    std::vector<double> ms[3], rmse[3];
+    for (int m = 0; m < 3; m++) {
+        crop_settings.path.lights = modes[m];
+        std::vector<vec3> sum(pixels, vec3{0, 0, 0});
+        double elapsed = 0;
+        for (int done = 0, n = 1; n <= MAX_N; done = n, n *= 2) {
+            auto start = std::chrono::steady_clock::now();
+            render_crop(done, n - done, sum);
+            elapsed += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            double err = 0;
+            for (size_t p = 0; p < pixels; p++) err += sqr(luminance(sum[p] * (1.f / n)) - luminance(reference[p]));
+            ms[m].push_back(elapsed);
+            rmse[m].push_back(std::sqrt(err / pixels));
+        }
+    }
+    for (size_t li = 0, n = 1; li < ms[0].size(); li++, n *= 2) {
+        std::cout << "    " << n;
+        for (int m = 0; m < 3; m++) std::cout << "\t" << ms[m][li] << "\t" << rmse[m][li];
+        std::cout << std::endl;
+    }
+    // Время до ошибки bsdf при MAX_N сэмплах (интерполяция в логарифмах)
+    const double target = rmse[0].back();
+    std::cout << "    time to bsdf's error at " << MAX_N << " spp (" << ms[0].back() << " ms):";
+    for (int m = 1; m < 3; m++) {
+        double needed = ms[m].back();
+        for (size_t li = 0; li + 1 < ms[m].size(); li++) {
+            if (rmse[m][li] <= target) { needed = ms[m][li]; break; }
+            if (rmse[m][li + 1] > target) continue;
+            const double k = std::log(rmse[m][li] / target) / std::log(rmse[m][li] / rmse[m][li + 1]);
+            needed = std::exp(std::log(ms[m][li]) + k * std::log(ms[m][li + 1] / ms[m][li]));
+            break;
+        }
+        std::cout << " " << (m == 1 ? "nee " : "mis ") << needed << " ms (" << ms[0].back() / needed << "x faster)";
+    }
+    std::cout << std::endl;
+}
+
+// --relight: деревья лучей всех пикселей (по центрам, без джиттера), кадр по ним в name, затем правки материалов
+// со стандартного ввода, по строке на правку:
+//   albedo M a0 a1 a2 a3 | diffuse M r g b | exponent M e | quit
+// После каждой перекрашиваются пиксели, где встречается материал M, и кадр переписывается
+void relight_session(const int width, const int height, const float fov, const std::string &name, const ImageFormat format,
+                     const ToneMap tone, const float exposure) {
+    auto start = std::chrono::steady_clock::now();
+    std::vector<RayTreeCache> rows(height);
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int j = 0; j < height; j++)
+        for (int i = 0; i < width; i++) record_ray_tree(camera_dir(i, j, width, height, fov), rows[j]);
+    RayTreeCache cache;
+    for (RayTreeCache &row : rows) {
+        cache.append(row);
+        row = RayTreeCache{};
+    }
+    std::cout << "Relight: ray trees of " << cache.pixel_count() << " pixels recorded in "
+              << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() << " ms, "
+              << cache.node_count() << " nodes, " << cache.bytes() / 1048576. << " MB" << std::endl;
+    for (size_t m = 0; m < scene.materials.size(); m++) {
+        const Material &material = scene.materials[m];
+        std::cout << "Material " << m << ": albedo " << material.albedo[0] << " " << material.albedo[1] << " " << material.albedo[2]
+                  << " " << material.albedo[3] << ", diffuse " << material.diffuse_color.x << " " << material.diffuse_color.y << " "
+                  << material.diffuse_color.z << ", exponent " << material.specular_exponent << ", " << cache.pixels_with(int(m))
+                  << " pixels" << std::endl;
+    }
+
+    std::vector<float> hdr(size_t(width) * height * 3);
+    std::vector<unsigned char> rgb(format == ImageFormat::exr ? 0 : hdr.size());
+    auto write = [&] {
+        auto write_start = std::chrono::steady_clock::now();
+        if (!rgb.empty()) tone_map(hdr.data(), hdr.size() / 3, tone, exposure, rgb.data());
+        if (!write_image(name, format, width, height, rgb.data(), hdr.data()))
+            std::cerr << "Error: unable to write the image " << name << std::endl;
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - write_start).count();
+    };
+    start = std::chrono::steady_clock::now();
+    cache.shade(scene.materials, hdr.data());
+    const double shade_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Relight: full frame shaded in " << shade_ms << " ms, written in " << write() << " ms to " << name << std::endl;
+
+    std::string line;
+    while (std::getline(std::cin, line)) {
+        std::istringstream in(line);
+        std::string command;
+        int m = -1;
+        if (!(in >> command)) continue;
+        if (command == "quit") break;
+        if (!(in >> m) || m < 0 || m >= int(scene.materials.size())) {
+            std::cerr << "Error: expected a material index 0.." << scene.materials.size() - 1 << " in '" << line << "'" << std::endl;
+            continue;
+        }
+        Material edited = scene.materials[m];
+        bool parsed;
+        if (command == "albedo") parsed = bool(in >> edited.albedo[0] >> edited.albedo[1] >> edited.albedo[2] >> edited.albedo[3]);
+        else if (command == "diffuse") parsed = bool(in >> edited.diffuse_color.x >> edited.diffuse_color.y >> edited.diffuse_color.z);
+        else if (command == "exponent") parsed = bool(in >> edited.specular_exponent);
+        else {
+            std::cerr << "Error: unknown command " << command << " (albedo, diffuse, exponent or quit)" << std::endl;
+            continue;
+        }
+        if (!parsed) {
+            std::cerr << "Error: not enough values in '" << line << "'" << std::endl;
+            continue;
+        }
+        scene.materials[m] = edited;
+        start = std::chrono::steady_clock::now();
+        cache.shade(scene.materials, hdr.data(), m);
+        const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "Relight: material " << m << ", " << cache.pixels_with(m) << " pixels re-shaded in " << ms
+                  << " ms, written in " << write() << " ms" << std::endl;
+    }
+}
+
+// Пиковый объём резидентной памяти процесса, МБ
+double peak_rss_mb() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss / 1024.;
+}
+
+int main(int argc, char** argv) {
+    auto startup = std::chrono::steady_clock::now();
+    int width  = 1024;
+    int height = 768;
     constexpr float fov    = 1.05; // 60 degrees field of view in radians
-    load_envmap("/home/snowwy/Desktop/MAI/computer_graphics/comp_graphics/lab5/assets/envmap.jpg"); // Загрузите вашу текстуру окружения
-    unsigned char* pixel_data = new unsigned char[width * height * 3];
-    
-    int n = -1;
-    unsigned char *pixmap = stbi_load("/home/snowwy/Desktop/MAI/computer_graphics/comp_graphics/lab5/assets/envmap.jpg", &envmap_width, &envmap_height, &n, 0);
-    if (!pixmap || 3!=n) {
-        std::cerr << "Error: can not load the environment map" << std::endl;
+    int extra_spheres = 0;
+    bool bench = false, bench_secondary = false, bench_occlusion = false, bench_background = false, bench_samplers = false;
+    RenderSettings settings;
+    bool bench_denoiser = false, bench_paths = false;
+    int tile_size = 32;
+    TileOrder tile_order = TileOrder::hilbert;
+    std::string tile_log;
+    int frames = 1;
+    constexpr float frame_pan = 0.3f; // рад
+    ImageFormat output_format = ImageFormat::png;
+    bool stream = false;
+    bool progressive = false;
+    double time_budget_ms = 0;      // 0 — без ограничения
+    double preview_interval_ms = 500;
+    int max_samples = 0;            // 0 — по умолчанию: 16, с --time-budget — пока не кончится время
+    bool adaptive = false;
+    float noise_target = 0.01f;     // допустимая стандартная ошибка среднего яркости пикселя (адаптивный режим)
+    size_t memory_mb = 256; // бюджет буферов полос в потоковом режиме
+    ToneMap tone = ToneMap::max;
+    float exposure = 1;
+    bool denoise_frame = false, write_features = false;
+    int caustic_photons = 0, caustic_k = 50;
+    int many_lights = 0;
+    bool relight = false;
+    float caustic_radius = 0.5f;
+    std::string assets = LAB5_ASSETS; // текстуры пола, стены и окружения
+    std::string envmap_file;          // пусто — envmap.jpg из assets
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--spheres" && i + 1 < argc) extra_spheres = std::atoi(argv[++i]);
+        else if (arg == "--bench-packets") bench = true;
+        else if (arg == "--bench-wide") bench_secondary = true;
+        else if (arg == "--bench-shadows") bench_occlusion = true;
+        else if (arg == "--bench-envmap") bench_background = true;
+        else if (arg == "--bench-sampling") bench_samplers = true;
+        else if (arg == "--bench-denoise") bench_denoiser = true;
+        else if (arg == "--bench-path") bench_paths = true;
+        else if (arg == "--integrator" && i + 1 < argc) {
+            if (!parse_integrator(argv[++i], settings.integrator)) {
+                std::cerr << "Error: unknown integrator " << argv[i] << std::endl;
+                return -1;
+            }
+        }
+        else if (arg == "--light-sampling" && i + 1 < argc) {
+            if (!parse_light_sampling(argv[++i], settings.path.lights)) {
+                std::cerr << "Error: unknown light sampling " << argv[i] << std::endl;
+                return -1;
+            }
+        }
+        else if (arg == "--light-radius" && i + 1 < argc) settings.path.light_radius = std::max(0.01, std::atof(argv[++i]));
+        else if (arg == "--caustics" && i + 1 < argc) caustic_photons = std::max(0, std::atoi(argv[++i]));
+        else if (arg == "--caustic-k" && i + 1 < argc) caustic_k = std::clamp(std::atoi(argv[++i]), 1, 256);
+        else if (arg == "--caustic-radius" && i + 1 < argc) caustic_radius = std::max(1e-3, std::atof(argv[++i]));
+        else if (arg == "--irradiance-cache") use_irradiance_cache = true;
+        else if (arg == "--relight") relight = true;
+        else if (arg == "--lights" && i + 1 < argc) many_lights = std::max(0, std::atoi(argv[++i]));
+        else if (arg == "--light-samples" && i + 1 < argc) light_samples = std::max(0, std::atoi(argv[++i]));
+        else if (arg == "--denoise") denoise_frame = true;
+        else if (arg == "--aovs") write_features = true;
+        else if (arg == "--sampler" && i + 1 < argc) {
+            if (!parse_sampler(argv[++i], settings.sampler)) {
+                std::cerr << "Error: unknown sampler " << argv[i] << std::endl;
+                return -1;
+            }
+        }
+        else if (arg == "--min-weight" && i + 1 < argc) min_weight = std::atof(argv[++i]);
+        else if (arg == "--tile" && i + 1 < argc) tile_size = std::atoi(argv[++i]);
+        else if (arg == "--tile-order" && i + 1 < argc) {
+            if (!parse_tile_order(argv[++i], tile_order)) {
+                std::cerr << "Error: unknown tile order " << argv[i] << std::endl;
+                return -1;
+            }
+        }
+        else if (arg == "--tile-log" && i + 1 < argc) tile_log = argv[++i];
+        else if (arg == "--envmap" && i + 1 < argc) envmap_file = argv[++i];
+        else if (arg == "--assets" && i + 1 < argc) assets = argv[++i];
+        else if (arg == "--frames" && i + 1 < argc) frames = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "--format" && i + 1 < argc) {
+            if (!parse_image_format(argv[++i], output_format)) {
+                std::cerr << "Error: unknown image format " << argv[i] << std::endl;
+                return -1;
+            }
+        }
+        else if (arg == "--size" && i + 1 < argc) {
+            if (std::sscanf(argv[++i], "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0) {
+                std::cerr << "Error: expected --size WIDTHxHEIGHT, got " << argv[i] << std::endl;
+                return -1;
+            }
+        }
+        else if (arg == "--stream") stream = true;
+        else if (arg == "--memory-mb" && i + 1 < argc) memory_mb = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "--progressive") progressive = true;
+        else if (arg == "--time-budget" && i + 1 < argc) { time_budget_ms = std::atof(argv[++i]); progressive = true; }
+        else if (arg == "--preview-interval" && i + 1 < argc) preview_interval_ms = std::atof(argv[++i]);
+        else if (arg == "--spp" && i + 1 < argc) { max_samples = std::max(1, std::atoi(argv[++i])); progressive = true; }
+        else if (arg == "--adaptive") adaptive = progressive = true;
+        else if (arg == "--noise" && i + 1 < argc) { noise_target = std::atof(argv[++i]); adaptive = progressive = true; }
+        else if (arg == "--tonemap" && i + 1 < argc) {
+            if (!parse_tone_map(argv[++i], tone)) {
+                std::cerr << "Error: unknown tone mapping " << argv[i] << std::endl;
+                return -1;
+            }
+        }
+        else if (arg == "--exposure" && i + 1 < argc) exposure = std::exp2(std::atof(argv[++i]));
+    }
+    if (use_irradiance_cache && settings.integrator == Integrator::path) {
+        std::cerr << "Error: --irradiance-cache needs --integrator whitted (path tracing samples area lights)" << std::endl;
         return -1;
     }
-    envmap = std::vector<vec3>(envmap_width * envmap_height);
-        for (int j = 0; j < envmap_height; j++) {
-        for (int i = 0; i < envmap_width; i++) {
-            int idx = (i + (envmap_height -1 - j) * envmap_width) * 3;
-            envmap[i + (envmap_height - 1 - j) * envmap_width] = {
-                pixmap[idx] / 255.f,
-                pixmap[idx + 1] / 255.f,
-                pixmap[idx + 2] / 255.f
-            };
-        }
+    if (relight && (settings.integrator == Integrator::path || many_lights || caustic_photons)) {
+        std::cerr << "Error: --relight needs --integrator whitted without --lights and --caustics" << std::endl;
+        return -1;
+    }
+    if (many_lights && settings.integrator == Integrator::path) {
+        std::cerr << "Error: --lights needs --integrator whitted (path tracing has its own area lights)" << std::endl;
+        return -1;
     }
-    stbi_image_free(pixmap);
-    
-#pragma omp parallel for
-    for (int pix = 0; pix < width * height; pix++) { // actual rendering loop
-        float dir_x =  (pix % width + 0.5) -  width / 2.;
-        float dir_y = -(pix / width + 0.5) + height / 2.; // this flips the image at the same time
-        float dir_z = -height / (2. * tan(fov / 2.));
-        const vec3 &color = cast_ray(vec3{0, 0, 0}, vec3{dir_x, dir_y, dir_z}.normalized());
-        float max = std::max(1.f, std::max(color[0], std::max(color[1], color[2])));
-        pixel_data[pix * 3]     = static_cast<unsigned char>(255 * color[0] / max);
-        pixel_data[pix * 3 + 1] = static_cast<unsigned char>(255 * color[1] / max);
-        pixel_data[pix * 3 + 2] = static_cast<unsigned char>(255 * color[2] / max);
+    if (caustic_photons && settings.integrator == Integrator::path) {
+        std::cerr << "Error: --caustics needs --integrator whitted (path tracing already carries caustics)" << std::endl;
+        return -1;
+    }
+    tile_size = std::max(BLOCK_W, tile_size / BLOCK_W * BLOCK_W); // тайл целиком состоит из пакетов
+    build_scene(extra_spheres, assets);
+    load_envmap(envmap_file.empty() ? assets + "/envmap.jpg" : envmap_file);
+    // Угловой размер пикселя против углового размера текселя по горизонтали панорамы
+    envmap_lod = std::log2((fov / height) / (2 * M_PI / envmap.width()));
+    cube_texel = 2.f / (hdr_envmap.mapped() ? hdr_envmap.face_size() : envmap_cube.face_size());
+    pixel_angle = fov / height;
+    settings.path.pixel_angle = pixel_angle;
+    settings.path.background = background;
+    if (use_irradiance_cache) {
+        vec3 lo, hi;
+        scene_bounds(scene, lo, hi);
+        irradiance_cache = IrradianceCache(lo, hi);
     }
 
+    if (many_lights) {
+        // Россыпь над полом между стенами; суммарная сила подобрана под яркость трёх основных источников
+        light_tree = LightTree(scatter_lights(many_lights, {-7, -5, -30}, {10, 10, -8}, MANY_LIGHTS_POWER));
+        std::cout << "Lights: " << light_tree.size() << " point lights, tree of " << light_tree.node_count()
+                  << " nodes, depth " << light_tree.depth() << ", built in " << light_tree.build_ms << " ms; "
+                  << (light_samples ? std::to_string(light_samples) + " samples per hit" : std::string("all lights per hit"))
+                  << std::endl;
+    }
+    if (caustic_photons) {
+        caustics = build_caustic_map(scene, caustic_photons, caustic_k, caustic_radius);
+        std::cout << "Caustics: " << caustics.size() << " photons stored of " << caustics.emitted << " emitted in "
+                  << caustics.emit_ms << " ms, kd-tree built in " << caustics.build_ms << " ms, "
+                  << caustics.bytes() / 1048576. << " MB; gather " << caustic_k << " nearest within " << caustic_radius << std::endl;
+    }
+
+    if (bench) bench_packets(width, height, fov);
+    if (bench_secondary) bench_wide(width, height, fov);
+    if (bench_occlusion) bench_shadows(width, height, fov);
+    if (bench_background) {
+        if (envmap.levels.empty()) std::cerr << "Error: --bench-envmap needs an LDR envmap" << std::endl;
+        else bench_envmap();
+    }
+    if (bench_samplers) {
+        ray_stats.assign(omp_get_max_threads(), RayStats{});
+        bench_sampling(settings, width, height, fov);
+    }
+    if (bench_denoiser) {
+        ray_stats.assign(omp_get_max_threads(), RayStats{});
+        bench_denoise(settings, width, height, fov);
+    }
+    if (bench_paths) bench_path(settings, width, height, fov);
+    ray_stats.assign(omp_get_max_threads(), RayStats{}); // статистика только рендера
+    envmap = Texture{}; // дальше фон берётся только из кубической карты
+    std::cout << "Startup: " << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startup).count()
+              << " ms, peak RSS " << peak_rss_mb() << " MB" << std::endl;
 
     // Получение текущего времени
     std::time_t t = std::time(nullptr);
     std::tm* now = std::localtime(&t);
 
     // Формирование имени файла
-    std::ostringstream filename;
-    filename << "render_" 
+    std::ostringstream basename;
+    basename << "render_" 
              << (now->tm_year + 1900) << "-"
              << (now->tm_mon + 1) << "-"
              << now->tm_mday << "_"
              << now->tm_hour << "-"
              << now->tm_min << "-"
-             << now->tm_sec << ".png";
+             << now->tm_sec;
+    if (relight) {
+        relight_session(width, height, fov, basename.str() + image_extension(output_format), output_format, tone, exposure);
+        return 0;
+    }
+
+    // Кадр сохраняется в фоне, пока рендерится следующий
+    ImageWriter writer;
+    auto batch_start = std::chrono::steady_clock::now();
+    std::atomic<bool> first_pixel{false};
+    double first_pixel_ms = 0; // от запуска программы до первого готового пакета пикселей
+    auto note_first_pixel = [&] {
+        if (!first_pixel.load(std::memory_order_relaxed) && !first_pixel.exchange(true))
+            first_pixel_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startup).count();
+    };
+    // Тайлы пакетами BLOCK_W x BLOCK_H в буфер строк, начинающийся со строки кадра first_row;
+    // features — признаки для денойзера и --aovs (только в буфер целого кадра)
+    auto render_tile = [&](const Tile &tile, float *hdr, const int first_row, FeatureBuffer *features = nullptr) {
+        for (int y0 = tile.y0; y0 < tile.y1; y0 += BLOCK_H) {
+            for (int x0 = tile.x0; x0 < tile.x1; x0 += BLOCK_W) {
+                RayPacket packet = primary_packet(settings, x0, y0, width, height, fov);
+                vec3 colors[SIMD_WIDTH];
+                PixelFeatures lane_features[SIMD_WIDTH];
+                trace_packet(settings, packet, x0, y0, width, colors, 1, 0, features ? lane_features : nullptr);
+                note_first_pixel();
+                store_packet(packet, colors, x0, y0, width, first_row, hdr);
+                if (features) store_features(packet, lane_features, x0, y0, width, first_row, *features);
+            }
+        }
+    };
+    // Статистика тайлов последнего кадра; журнал по тайлам — только с --tile-log
+    size_t tile_count = 0, stolen = 0;
+    double slowest = 0;
+    std::vector<Tile> logged_tiles;
+    std::vector<TileTiming> logged_timings;
+    auto account = [&](const std::vector<Tile> &tiles, const std::vector<TileTiming> &timings) {
+        tile_count += tiles.size();
+        for (const TileTiming &t : timings) { stolen += t.stolen; slowest = std::max(slowest, t.ms); }
+        if (tile_log.empty()) return;
+        logged_tiles.insert(logged_tiles.end(), tiles.begin(), tiles.end());
+        logged_timings.insert(logged_timings.end(), timings.begin(), timings.end());
+    };
+    if (stream && progressive) {
+        std::cerr << "Error: --progressive keeps the whole frame in memory and cannot be combined with --stream" << std::endl;
+        return -1;
+    }
+    if (stream && (denoise_frame || write_features)) {
+        std::cerr << "Error: --denoise and --aovs need the whole frame and cannot be combined with --stream" << std::endl;
+        return -1;
+    }
+    const bool need_features = denoise_frame || write_features;
+    std::vector<Tile> tiles = stream ? std::vector<Tile>{} : make_tiles(width, height, tile_size, tile_order);
+    double stream_encode_ms = 0;
+    size_t stream_bytes = 0, stream_queued = 0;
+    // Линейный кадр (или полоса) -> RGB8 для выбранного формата; EXR пишется без тональной компрессии
+    std::mutex tone_lock;
+    double tone_ms = 0;
+    size_t tone_pixels = 0;
+    auto to_rgb8 = [&](const std::vector<float> &hdr) {
+        if (output_format == ImageFormat::exr) return std::vector<unsigned char>{};
+        std::vector<unsigned char> rgb(hdr.size());
+        auto start = std::chrono::steady_clock::now();
+        tone_map(hdr.data(), hdr.size() / 3, tone, exposure, rgb.data());
+        const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::lock_guard<std::mutex> guard(tone_lock);
+        tone_ms += ms;
+        tone_pixels += hdr.size() / 3;
+        return rgb;
+    };
+    auto keep_hdr = [&](std::vector<float> &hdr) { // EXR забирает сам float-буфер
+        return output_format == ImageFormat::exr ? std::move(hdr) : std::vector<float>{};
+    };
+    // Готовый кадр: денойзер (если включён), признаки в отдельные файлы (--aovs), тональная компрессия и запись
+    double denoise_ms = 0;
+    size_t denoised_pixels = 0;
+    auto finish_frame = [&](const std::string &name, const std::string &stem, std::vector<float> &hdr, const FeatureBuffer &features,
+                            const std::vector<float> &variance) {
+        if (denoise_frame) {
+            auto start = std::chrono::steady_clock::now();
+            denoise(hdr.data(), features, variance.empty() ? nullptr : variance.data(), width, height, hdr.data());
+            denoise_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            denoised_pixels += size_t(width) * height;
+        }
+        if (write_features) {
+            // В EXR — сырые значения; в 8 бит нормаль сдвигается в 0..1, глубина — 1 вблизи и 0 на промахах
+            float far = 0;
+            for (const float d : features.depth) if (d < MISS_DEPTH) far = std::max(far, d);
+            const char *suffixes[] = {"_normal", "_albedo", "_depth"};
+            for (int k = 0; k < 3; k++) {
+                std::vector<float> aov(features.depth.size() * 3);
+                for (size_t i = 0; i < aov.size(); i++)
+                    aov[i] = k == 0 ? features.normal[i] : k == 1 ? features.albedo[i] : features.depth[i / 3];
+                std::vector<unsigned char> rgb;
+                if (output_format != ImageFormat::exr) {
+                    rgb.resize(aov.size());
+                    for (size_t i = 0; i < aov.size(); i++) {
+                        const float v = k == 0 ? aov[i] * .5f + .5f : k == 1 ? aov[i] : 1 - aov[i] / far;
+                        rgb[i] = static_cast<unsigned char>(std::clamp(v, 0.f, 1.f) * 255 + .5f);
+                    }
+                }
+                writer.submit(stem + suffixes[k] + image_extension(output_format), output_format, width, height,
+                              std::move(rgb), keep_hdr(aov));
+            }
+        }
+        std::vector<unsigned char> pixel_data = to_rgb8(hdr);
+        writer.submit(name, output_format, width, height, std::move(pixel_data), keep_hdr(hdr));
+    };
+    // Пакет прогрессивного рендера: дорожки вне кадра не трассируются
+    const PacketTracer trace = [&](const int x0, const int y0, const int step, const int sample, const int lanes,
+                                   vec3 colors[SIMD_WIDTH], PixelFeatures *features) {
+        RayPacket packet = primary_packet(settings, x0, y0, width, height, fov, step, sample, lanes);
+        trace_packet(settings, packet, x0, y0, width, colors, step, sample, features);
+        note_first_pixel();
+        return packet.active;
+    };
+    ProgressiveSettings progressive_settings;
+    progressive_settings.width = width;
+    progressive_settings.height = height;
+    progressive_settings.passes = max_samples ? max_samples : time_budget_ms > 0 ? 65535 : adaptive ? 64 : 16;
+    progressive_settings.time_budget_ms = time_budget_ms;
+    progressive_settings.preview_interval_ms = preview_interval_ms;
+    progressive_settings.adaptive = adaptive;
+    progressive_settings.noise_target = noise_target;
+    progressive_settings.features = need_features;
+    progressive_settings.variance = denoise_frame;
+    int stream_images = 0;
+    for (int frame = 0; frame < frames; frame++) {
+        // Кадры пакета — поворот камеры от -frame_pan/2 до +frame_pan/2
+        const float yaw = frames > 1 ? frame_pan * (float(frame) / (frames - 1) - .5f) : 0.f;
+        camera_cos = std::cos(yaw);
+        camera_sin = std::sin(yaw);
+        if (use_irradiance_cache) seed_irradiance_cache(width, height, fov);
+        std::ostringstream stem;
+        stem << basename.str();
+        if (frames > 1) stem << "_" << frame;
+        std::ostringstream filename;
+        filename << stem.str() << image_extension(output_format);
+        tile_count = stolen = 0;
+        slowest = 0;
+        logged_tiles.clear();
+        logged_timings.clear();
 
-    // Сохранение файла
-    stbi_write_png(filename.str().c_str(), width, height, 3, pixel_data, width * 3);
+        auto render_start = std::chrono::steady_clock::now();
+        if (progressive) {
+            ProgressiveFrame result = render_progressive(progressive_settings, tiles, trace, {
+                account,
+                [&] { return writer.idle(); },
+                [&](std::vector<float> &hdr) {
+                    std::vector<unsigned char> rgb = to_rgb8(hdr);
+                    writer.submit(stem.str() + "_preview" + image_extension(output_format), output_format, width, height,
+                                  std::move(rgb), keep_hdr(hdr));
+                }});
+            finish_frame(filename.str(), stem.str(), result.hdr, result.features, result.variance);
+            std::cout << "Progressive: preview pass (1/" << PREVIEW_STEP * PREVIEW_STEP << " of the pixels) in " << result.coarse_ms
+                      << " ms, " << (result.partial ? result.passes - 1 : result.passes) << (adaptive ? " passes" : " full samples per pixel");
+            if (result.partial) std::cout << " + 1 more on " << result.partial << " pixels";
+            std::cout << ", " << result.previews << " previews (first at " << result.first_preview_ms << " ms)";
+            if (time_budget_ms > 0) std::cout << ", budget " << time_budget_ms << " ms";
+            std::cout << std::endl;
+            if (adaptive) {
+                const size_t pixels = size_t(width) * height;
+                std::cout << "Adaptive: " << double(result.samples_traced) / pixels << " samples per pixel on average (max "
+                          << result.max_samples << ") for noise " << noise_target << ", " << result.live_pixels << " pixels ("
+                          << 100. * result.live_pixels / pixels << "%) still above it" << std::endl;
+            }
+        } else if (stream) {
+            // Полоса — ряд тайлов. Окно из нескольких полос рендерится одним вызовом render_tiles (тайлы соседних
+            // полос воруются как обычно), полоса уходит на запись, как только готов её последний тайл.
+            // Половина бюджета — окно, половина — очередь записи
+            const int band_rows = tile_size;
+            const int bands = (height + band_rows - 1) / band_rows;
+            const size_t band_bytes = size_t(width) * band_rows * 3 * (sizeof(float) + 1); // float-буфер и RGB8
+            const int window = static_cast<int>(std::clamp<size_t>(memory_mb * 1048576 / (2 * band_bytes), 1, bands));
+            BandWriter band_writer(filename.str(), output_format, width, height, band_rows);
+            if (!band_writer.ok()) return -1;
+            for (int b0 = 0; b0 < bands; b0 += window) {
+                const int b1 = std::min(bands, b0 + window);
+                const int row0 = b0 * band_rows;
+                std::vector<Tile> window_tiles = make_tiles(width, std::min(height, b1 * band_rows) - row0, tile_size, tile_order);
+                std::vector<std::vector<float>> band_hdr(b1 - b0);
+                std::unique_ptr<std::atomic<int>[]> left(new std::atomic<int>[b1 - b0]);
+                for (int b = b0; b < b1; b++) {
+                    band_hdr[b - b0].resize(size_t(width) * (std::min(height, (b + 1) * band_rows) - b * band_rows) * 3);
+                    left[b - b0] = 0;
+                }
+                for (Tile &t : window_tiles) {
+                    t.y0 += row0;
+                    t.y1 += row0;
+                    left[t.y0 / band_rows - b0]++;
+                }
+                account(window_tiles, render_tiles(window_tiles, [&](const Tile &tile) {
+                    const int band = tile.y0 / band_rows;
+                    std::vector<float> &hdr = band_hdr[band - b0];
+                    render_tile(tile, hdr.data(), band * band_rows);
+                    if (left[band - b0].fetch_sub(1) == 1) {
+                        std::vector<unsigned char> rgb = to_rgb8(hdr);
+                        band_writer.submit(band, std::move(rgb), keep_hdr(hdr));
+                        hdr = std::vector<float>{};
+                    }
+                }));
+                band_writer.wait_queued(size_t(window) * band_bytes);
+            }
+            if (!band_writer.finish()) std::cerr << "Error: unable to write the image " << filename.str() << std::endl;
+            else stream_images++;
+            stream_encode_ms += band_writer.encode_ms();
+            stream_bytes += band_writer.bytes();
+            stream_queued = std::max(stream_queued, band_writer.peak_queued());
+        } else {
+            std::vector<float> frame_hdr(size_t(width) * height * 3);
+            FeatureBuffer features(need_features ? size_t(width) * height : 0);
+            account(tiles, render_tiles(tiles, [&](const Tile &tile) {
+                render_tile(tile, frame_hdr.data(), 0, need_features ? &features : nullptr);
+            }));
+            finish_frame(filename.str(), stem.str(), frame_hdr, features, {});
+        }
+        std::cout << "Render: " << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - render_start).count()
+                  << " ms";
+        if (frame == 0) std::cout << ", first pixel " << first_pixel_ms << " ms after launch";
+        std::cout << std::endl;
+    }
+    auto render_end = std::chrono::steady_clock::now();
+    writer.wait();
+    auto batch_end = std::chrono::steady_clock::now();
 
-    delete[] pixel_data;
+    std::cout << "Tiles: " << tile_count << " of " << tile_size << "x" << tile_size << ", " << stolen
+              << " stolen, slowest " << slowest << " ms" << std::endl;
+    if (!tile_log.empty()) write_tile_log(tile_log, logged_tiles, logged_timings);
+    RayStats total;
+    for (const RayStats &st : ray_stats) {
+        total.traced += st.traced; total.pruned += st.pruned; total.culled += st.culled;
+        total.gathers += st.gathers; total.gather_ms += st.gather_ms;
+        total.shadow += st.shadow; total.light_picks += st.light_picks; total.cache_hits += st.cache_hits; total.cache_misses += st.cache_misses;
+    }
+    std::cout << "Secondary rays: " << total.traced << " traced, " << total.pruned << " skipped (zero weight), "
+              << total.culled << " culled by roulette (min weight " << min_weight << ")" << std::endl;
+    if (settings.integrator == Integrator::whitted) {
+        const long long shadow = total.shadow + seed_shadow_rays;
+        std::cout << "Shadow rays: " << shadow << ", " << shadow / (double(width) * height * frames) << " per pixel" << std::endl;
+    }
+    if (total.light_picks)
+        std::cout << "Lights: " << total.light_picks << " tree samples, " << total.light_picks / (double(width) * height * frames)
+                  << " per pixel" << std::endl;
+    if (use_irradiance_cache)
+        std::cout << "Irradiance cache: " << irradiance_cache.size() << " records, " << irradiance_cache.node_count()
+                  << " octree nodes, " << irradiance_cache.bytes() / 1048576. << " MB, seeded in " << seed_ms << " ms with "
+                  << seed_shadow_rays << " shadow rays; lookups " << total.cache_hits << " hit, " << total.cache_misses
+                  << " miss" << std::endl;
+    if (total.gathers)
+        std::cout << "Caustics: " << total.gathers << " gathers, " << total.gather_ms * 1e3 / total.gathers << " us each, "
+                  << total.gather_ms * 1e3 / (double(width) * height * frames) << " us per pixel (summed over threads)" << std::endl;
+    if (hdr_envmap.mapped())
+        std::cout << "Envmap tiles paged in: " << hdr_envmap.touched_tiles() << " of " << hdr_envmap.tile_count() << std::endl;
+    if (denoised_pixels)
+        std::cout << "Denoise: " << denoise_ms << " ms, " << denoise_ms / (denoised_pixels / 1e6) << " ms per megapixel" << std::endl;
+    if (tone_pixels)
+        std::cout << "Tone mapping: " << tone_ms << " ms, " << tone_ms / (tone_pixels / 1e6) << " ms per megapixel" << std::endl;
+    if (stream && !progressive) {
+        std::cout << "Output: " << stream_images << " " << image_extension(output_format) + 1 << " images streamed in bands, "
+                  << stream_bytes / 1048576. << " MB, encoding " << stream_encode_ms << " ms, at most "
+                  << stream_queued / 1048576. << " MB of bands waiting to be written" << std::endl;
+    } else {
+        std::cout << "Output: " << writer.written() << " " << image_extension(output_format) + 1 << " images, "
+                  << writer.bytes() / 1048576. << " MB, encoding " << writer.encode_ms() << " ms in the background, "
+                  << "queue full for " << writer.stall_ms() << " ms; waited "
+                  << std::chrono::duration<double, std::milli>(batch_end - render_end).count() << " ms after the last frame, "
+                  << "batch " << std::chrono::duration<double, std::milli>(batch_end - batch_start).count() << " ms" << std::endl;
+    }
+    std::cout << "Peak RSS: " << peak_rss_mb() << " MB" << std::endl;
     return 0;
 }
 
@@ -0,0 +1,122 @@
+#include "packet.h"
+
+namespace {
+
+struct PacketRays {
+    vfloat o[3], d[3], inv[3];
+    vfloat active;
+
+    explicit PacketRays(const RayPacket &p) {
+        o[0] = vfloat::load(p.ox); o[1] = vfloat::load(p.oy); o[2] = vfloat::load(p.oz);
+        d[0] = vfloat::load(p.dx); d[1] = vfloat::load(p.dy); d[2] = vfloat::load(p.dz);
+        for (int k = 0; k < 3; k++) inv[k] = vfloat(1.f) / d[k];
+        active = lane_mask(p.active);
+    }
+};
+
+// Маска лучей, входящих в box ближе tmax
+inline vfloat packet_box(const AABB &b, const PacketRays &r, const vfloat &tmax) {
+    vfloat t1 = (vfloat(b.lo.x) - r.o[0]) * r.inv[0], t2 = (vfloat(b.hi.x) - r.o[0]) * r.inv[0];
+    vfloat tmin = vmin(t1, t2), tfar = vmax(t1, t2);
+    t1 = (vfloat(b.lo.y) - r.o[1]) * r.inv[1]; t2 = (vfloat(b.hi.y) - r.o[1]) * r.inv[1];
+    tmin = vmax(tmin, vmin(t1, t2)); tfar = vmin(tfar, vmax(t1, t2));
+    t1 = (vfloat(b.lo.z) - r.o[2]) * r.inv[2]; t2 = (vfloat(b.hi.z) - r.o[2]) * r.inv[2];
+    tmin = vmax(tmin, vmin(t1, t2)); tfar = vmin(tfar, vmax(t1, t2));
+    return (tmin <= tfar) & (tfar > vfloat(0.f)) & (tmin < tmax);
+}
+
+// Общий обход для ближайшего пересечения и для теней.
+// any_hit: вместо поиска ближайшего копим маску перекрытых лучей и выходим, когда перекрыты все.
+template <bool any_hit>
+vfloat traverse_packet(const CompiledScene &scene, const PacketRays &r, vfloat &tmax, vfloat &prim) {
+    const float *sx = scene.sphere_x.data(), *sy = scene.sphere_y.data();
+    const float *sz = scene.sphere_z.data(), *sr = scene.sphere_r.data();
+    const int all = movemask(r.active);
+    vfloat occluded = vfloat(0.f) < vfloat(0.f);
+
+    const std::vector<BVHNode> &nodes = scene.bvh.nodes;
+    int stack[64];
+    int sp = 0;
+    if (!nodes.empty()) stack[sp++] = 0;
+    while (sp) {
+        const BVHNode &n = nodes[stack[--sp]];
+        vfloat live = any_hit ? andnot(occluded, r.active) : r.active;
+        if (!movemask(packet_box(n.box, r, tmax) & live)) continue;
+        if (!n.count) {
+            // Ближний потомок — по знаку направления первого активного луча вдоль оси, где центры потомков разнесены сильнее
+            const vec3 ca = nodes[n.first].box.center(), cb = nodes[n.first + 1].box.center();
+            vec3 sep = cb - ca;
+            int axis = std::abs(sep.x) > std::abs(sep.y) ? 0 : 1;
+            if (std::abs(sep.z) > std::abs(sep[axis])) axis = 2;
+            alignas(32) float dir[SIMD_WIDTH];
+            r.d[axis].store(dir);
+            int lane = __builtin_ctz(all);
+            bool a_first = (dir[lane] > 0) == (sep[axis] > 0);
+            stack[sp++] = a_first ? n.first + 1 : n.first;
+            stack[sp++] = a_first ? n.first : n.first + 1;
+            continue;
+        }
+        for (int i = n.first; i < n.first + n.count; i++) {
+            vfloat lx = vfloat(sx[i]) - r.o[0], ly = vfloat(sy[i]) - r.o[1], lz = vfloat(sz[i]) - r.o[2];
+            vfloat tca = lx*r.d[0] + ly*r.d[1] + lz*r.d[2];
+            vfloat d2 = lx*lx + ly*ly + lz*lz - tca*tca;
+            vfloat r2 = vfloat(sr[i] * sr[i]);
+            vfloat thc = vsqrt(vmax(r2 - d2, vfloat(0.f)));
+            vfloat t0 = tca - thc;
+            vfloat t = select(t0 > vfloat(.001f), t0, tca + thc);
+            vfloat m = (d2 <= r2) & (t > vfloat(.001f)) & (t < tmax) & live;
+            if (any_hit) {
+                occluded = occluded | m;
+                if (movemask(occluded) == all) return occluded;
+            } else {
+                tmax = select(m, t, tmax);
+                prim = select(m, vfloat(float(i)), prim);
+            }
+        }
+    }
+
+    // Плоскости
+    for (int i = 0; i < scene.plane_count(); i++) {
+        const int a = scene.plane_axis[i], u = (a + 1) % 3, v = (a + 2) % 3;
+        vfloat d = (vfloat(scene.plane_offset[i]) - r.o[a]) / r.d[a];
+        vfloat pu = r.o[u] + r.d[u] * d, pv = r.o[v] + r.d[v] * d;
+        vfloat m = (vabs(r.d[a]) > vfloat(.001f)) & (d > vfloat(.001f)) & (d < tmax) &
+                   (pu > vfloat(scene.plane_u0[i])) & (pu < vfloat(scene.plane_u1[i])) &
+                   (pv > vfloat(scene.plane_v0[i])) & (pv < vfloat(scene.plane_v1[i])) & r.active;
+        if (any_hit) {
+            occluded = occluded | m;
+        } else {
+            tmax = select(m, d, tmax);
+            prim = select(m, vfloat(float(scene.sphere_count() + i)), prim);
+        }
+    }
+    return occluded;
+}
+
+} // namespace
+
+int packet_intersect(const CompiledScene &scene, const RayPacket &packet, Hit hits[SIMD_WIDTH]) {
+    PacketRays r(packet);
+    vfloat tmax(1e10f), prim(-1.f);
+    traverse_packet<false>(scene, r, tmax, prim);
+
+    alignas(32) float t[SIMD_WIDTH], id[SIMD_WIDTH];
+    tmax.store(t);
+    prim.store(id);
+    int mask = 0;
+    for (int lane = 0; lane < SIMD_WIDTH; lane++) {
+        if (!(packet.active >> lane & 1) || id[lane] < 0 || t[lane] >= 1000) continue;
+        finish_hit(scene, static_cast<int>(id[lane]),
+                   {packet.ox[lane], packet.oy[lane], packet.oz[lane]},
+                   {packet.dx[lane], packet.dy[lane], packet.dz[lane]}, t[lane], hits[lane]);
+        mask |= 1 << lane;
+    }
+    return mask;
+}
+
+int packet_occluded(const CompiledScene &scene, const RayPacket &packet, const float tmax[SIMD_WIDTH]) {
+    if (!packet.active) return 0;
+    PacketRays r(packet);
+    vfloat t = vfloat::load(tmax), prim(-1.f);
+    return movemask(traverse_packet<true>(scene, r, t, prim));
+}
@@ -0,0 +1,35 @@
+#ifndef PACKET_H
+#define PACKET_H
+
+#include "simd.h"
+#include "scene.h"
+
+// Пакет из SIMD_WIDTH когерентных лучей (соседние пиксели или теневые лучи соседних точек)
+struct RayPacket {
+    alignas(32) float ox[SIMD_WIDTH], oy[SIMD_WIDTH], oz[SIMD_WIDTH];
+    alignas(32) float dx[SIMD_WIDTH], dy[SIMD_WIDTH], dz[SIMD_WIDTH];
+    int active = 0; // битовая маска занятых дорожек
+
+    void set(const int lane, const vec3 &orig, const vec3 &dir) {
+        ox[lane] = orig.x; oy[lane] = orig.y; oz[lane] = orig.z;
+        dx[lane] = dir.x;  dy[lane] = dir.y;  dz[lane] = dir.z;
+        active |= 1 << lane;
+    }
+};
+
+// Пакет первичных лучей — прямоугольник BLOCK_W x BLOCK_H соседних пикселей
+constexpr int BLOCK_W = SIMD_WIDTH == 8 ? 4 : 2;
+constexpr int BLOCK_H = SIMD_WIDTH / BLOCK_W;
+
+// Пиксель дорожки lane в блоке с углом (x0, y0) и шагом step между соседними дорожками
+inline int lane_x(const int x0, const int lane, const int step) { return x0 + lane % BLOCK_W * step; }
+inline int lane_y(const int y0, const int lane, const int step) { return y0 + lane / BLOCK_W * step; }
+
+// Ближайшие пересечения всех лучей пакета; hits[lane] заполняется как в scene_intersect.
+// Возвращает маску дорожек с попаданием.
+int packet_intersect(const CompiledScene &scene, const RayPacket &packet, Hit hits[SIMD_WIDTH]);
+
+// Маска дорожек, у которых между началом луча и tmax[lane] есть препятствие
+int packet_occluded(const CompiledScene &scene, const RayPacket &packet, const float tmax[SIMD_WIDTH]);
+
+#endif // PACKET_H
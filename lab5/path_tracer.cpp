@@ -0,0 +1,201 @@
+#include "path_tracer.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+constexpr int ROULETTE_DEPTH = 3; // с этого отскока путь обрывается рулеткой
+constexpr int MAX_BOUNCES = 64;   // страховка от бесконечных путей внутри стекла; до неё рулетка почти не доживает
+constexpr float INV_PI = float(1 / M_PI);
+
+inline vec3 mul(const vec3 &a, const vec3 &b) { return {a.x * b.x, a.y * b.y, a.z * b.z}; }
+inline float max3(const vec3 &v) { return std::max(v.x, std::max(v.y, v.z)); }
+inline float luminance(const vec3 &c) { return 0.2126f * c[0] + 0.7152f * c[1] + 0.0722f * c[2]; }
+
+struct Bsdf {
+    vec3 kd;                  // ламбертово отражение
+    float ks = 0, exponent = 1; // блик Фонга
+    float kr = 0, kt = 0;     // зеркало и преломление
+    float eta = 1;
+    float pd = 0, ps = 0, pr = 0, pt = 0; // вероятности выбора лепестков
+    vec3 N, R;                // нормаль навстречу лучу и зеркальное направление
+
+    Bsdf(const Material &m, const Hit &hit, const vec3 &dir) : eta(m.refractive_index) {
+        kd = hit.diffuse_color * m.albedo[0];
+        for (int c = 0; c < 3; c++) kd[c] = std::clamp(kd[c], 0.f, 1.f);
+        exponent = m.specular_exponent;
+        ks = std::min(1.f, 2 * m.albedo[1] / (exponent + 2));
+        kr = m.albedo[2];
+        kt = m.albedo[3];
+        N = dir * hit.N < 0 ? hit.N : -hit.N;
+        R = (dir - N * (2 * (dir * N))).normalized();
+        const float wd = luminance(kd), total = wd + ks + kr + kt;
+        if (total <= 0) return;
+        pd = wd / total;
+        ps = ks / total;
+        pr = kr / total;
+        pt = kt / total;
+    }
+
+    bool smooth() const { return pd + ps > 0; } // есть неидеальные лепестки: освещение источников считается
+
+    // BRDF неидеальных лепестков и её плотность при выборе лепестка по весам (одна pow на обе)
+    vec3 eval(const vec3 &wi, float &pdf) const {
+        const float cos_n = wi * N;
+        pdf = 0;
+        if (cos_n <= 0) return {0, 0, 0};
+        const float cos_r = std::clamp(wi * R, 0.f, 1.f); // при степени ~1000 и 1 + 1e-3 уже много
+        const float lobe = 0.5f * INV_PI * std::pow(cos_r, exponent);
+        const float glossy = ks * (exponent + 2) * lobe;
+        pdf = pd * cos_n * INV_PI + ps * (exponent + 1) * lobe;
+        return kd * INV_PI + vec3{glossy, glossy, glossy};
+    }
+};
+
+// Ближайший источник-сфера на луче ближе tmax
+bool intersect_light(const CompiledScene &scene, const float radius, const vec3 &orig, const vec3 &dir, const float tmax,
+                     int &light, float &dist) {
+    dist = tmax;
+    light = -1;
+    for (int i = 0; i < scene.light_count(); i++) {
+        const vec3 L = scene.light(i) - orig;
+        const float tca = L * dir, d2 = L * L - tca * tca;
+        if (d2 > radius * radius) continue;
+        const float thc = std::sqrt(radius * radius - d2);
+        const float t = tca - thc > .001f ? tca - thc : tca + thc;
+        if (t <= .001f || t >= dist) continue;
+        dist = t;
+        light = i;
+    }
+    return light >= 0;
+}
+
+// Плотность равномерного выбора направления в конусе, под которым из point видна сфера источника
+float cone_pdf(const CompiledScene &scene, const float radius, const int light, const vec3 &point) {
+    const float d2 = (scene.light(light) - point) * (scene.light(light) - point);
+    const float sin2 = std::min(1.f, radius * radius / d2);
+    const float one_minus_cos = sin2 / (1 + std::sqrt(1 - sin2)); // 1 - cos без потери точности у малых углов
+    return 1 / (2 * float(M_PI) * one_minus_cos);
+}
+
+inline float power_heuristic(const float a, const float b) { return a * a / (a * a + b * b); }
+
+} // namespace
+
+bool parse_integrator(const std::string &name, Integrator &integrator) {
+    if (name == "whitted") integrator = Integrator::whitted;
+    else if (name == "path") integrator = Integrator::path;
+    else return false;
+    return true;
+}
+
+bool parse_light_sampling(const std::string &name, LightSampling &mode) {
+    if (name == "bsdf") mode = LightSampling::bsdf;
+    else if (name == "nee") mode = LightSampling::nee;
+    else if (name == "mis") mode = LightSampling::mis;
+    else return false;
+    return true;
+}
+
+vec3 path_trace(const CompiledScene &scene, const vec3 &orig, const vec3 &dir, const Hit *primary, Sampler &sampler,
+                const PathSettings &settings, PixelFeatures *features) {
+    const int lights = scene.light_count();
+    const LightSampling mode = settings.lights;
+    const float radius = settings.light_radius, pixel_angle = settings.pixel_angle;
+    const float radiance = settings.light_radiance();
+    const vec3 emitted = {radiance, radiance, radiance};
+    vec3 color = {0, 0, 0}, weight = {1, 1, 1};
+    vec3 o = orig, d = dir;
+    bool delta = true;     // прошлый отскок идеальный (или это луч камеры): источник на луче берётся целиком
+    float bsdf_pdf = 0;    // плотность, с которой выбрано направление d
+    float cone_width = 0;  // ширина конуса луча в его начале
+    for (int bounce = 0; bounce < MAX_BOUNCES; bounce++) {
+        // Числа отскока в постоянном порядке, чтобы измерения Sobol совпадали у всех путей: пары (2, 3) и (4, 5) —
+        // двумерные выборки направления по BSDF и точки на источнике
+        float u[8];
+        for (float &x : u) x = sampler.next_float();
+
+        Hit hit;
+        const bool found = bounce == 0 && primary ? (hit = *primary, true) : scene_intersect(scene, o, d, hit);
+        int light;
+        float light_dist;
+        if (lights && intersect_light(scene, radius, o, d, found ? hit.dist : 1e10f, light, light_dist)) {
+            if (delta || mode == LightSampling::bsdf) color = color + mul(weight, emitted);
+            else if (mode == LightSampling::mis)
+                color = color + mul(weight, emitted) * power_heuristic(bsdf_pdf, cone_pdf(scene, radius, light, o) / lights);
+            if (bounce == 0 && features) *features = {-d, emitted, light_dist};
+            break;
+        }
+        if (!found) {
+            color = color + mul(weight, settings.background(d, pixel_angle));
+            if (bounce == 0 && features) *features = {-d, color, MISS_DEPTH};
+            break;
+        }
+        const float width = cone_width + pixel_angle * hit.dist;
+        shade_texture(scene, d, width, hit);
+        if (bounce == 0 && features) *features = {hit.N, hit.diffuse_color, hit.dist};
+        const Bsdf bsdf(scene.materials[hit.material], hit, d);
+        if (bsdf.pd + bsdf.ps + bsdf.pr + bsdf.pt <= 0) break;
+
+        // Следующее событие: точка на случайном источнике и теневой луч к ней
+        if (lights && mode != LightSampling::bsdf && bsdf.smooth()) {
+            const int l = std::min(int(u[6] * lights), lights - 1);
+            const vec3 to_center = scene.light(l) - hit.point;
+            const float center_dist = to_center.norm();
+            if (center_dist > radius) {
+                const float light_pdf = cone_pdf(scene, radius, l, hit.point) / lights;
+                const float sin2 = radius * radius / (center_dist * center_dist);
+                const float cos_max = std::sqrt(1 - sin2);
+                const vec3 wi = around(to_center * (1 / center_dist), 1 - u[4] * (1 - cos_max), 2 * float(M_PI) * u[5]);
+                const float cos_n = wi * bsdf.N;
+                if (cos_n > 0) {
+                    // Расстояние до поверхности сферы источника по wi
+                    const float tca = to_center * wi;
+                    const float dist = tca - std::sqrt(std::max(0.f, radius * radius - (center_dist * center_dist - tca * tca)));
+                    if (!scene_occluded(scene, hit.point, wi, dist)) {
+                        float pdf;
+                        const vec3 f = bsdf.eval(wi, pdf);
+                        const float mis = mode == LightSampling::mis ? power_heuristic(light_pdf, pdf) : 1.f;
+                        color = color + mul(weight, mul(f, emitted)) * (cos_n * mis / light_pdf);
+                    }
+                }
+            }
+        }
+
+        // Следующее направление по BSDF
+        vec3 wi;
+        const float lobe = u[0];
+        if (lobe < bsdf.pd + bsdf.ps) {
+            wi = lobe < bsdf.pd ? around(bsdf.N, std::sqrt(1 - u[2]), 2 * float(M_PI) * u[3])
+                                : around(bsdf.R, std::pow(1 - u[2], 1 / (bsdf.exponent + 1)), 2 * float(M_PI) * u[3]);
+            const vec3 f = bsdf.eval(wi, bsdf_pdf);
+            if (bsdf_pdf <= 0) break; // лепесток Фонга ушёл под поверхность
+            weight = mul(weight, f) * ((wi * bsdf.N) / bsdf_pdf);
+            delta = false;
+        } else if (lobe < bsdf.pd + bsdf.ps + bsdf.pr) {
+            wi = bsdf.R;
+            weight = weight * (bsdf.kr / bsdf.pr);
+            delta = true;
+        } else {
+            // Преломление по закону Снелла; при полном внутреннем отражении — отражение
+            const bool entering = d * hit.N < 0;
+            const float eta = entering ? 1 / bsdf.eta : bsdf.eta;
+            const float cos_i = -(d * bsdf.N);
+            const float k = 1 - eta * eta * (1 - cos_i * cos_i);
+            wi = k < 0 ? bsdf.R : (d * eta + bsdf.N * (eta * cos_i - std::sqrt(k))).normalized();
+            weight = weight * (bsdf.kt / bsdf.pt);
+            delta = true;
+        }
+
+        if (bounce + 1 >= ROULETTE_DEPTH) {
+            const float survive = std::min(0.95f, max3(weight));
+            if (u[1] >= survive) break;
+            weight = weight * (1 / survive);
+        }
+        cone_width = width;
+        o = hit.point;
+        d = wi.normalized(); // ошибка длины копится за десятки отражений внутри стекла
+    }
+    return color;
+}
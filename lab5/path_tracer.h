@@ -0,0 +1,46 @@
+#ifndef PATH_TRACER_H
+#define PATH_TRACER_H
+
+#include <string>
+#include "geometry.h"
+#include "scene.h"
+#include "sampler.h"
+#include "denoise.h"
+
+// Интегратор кадра: whitted — прежний трассировщик (точечные источники, жёсткие тени, зеркало и преломление
+// без шума); path — несмещённая трассировка путей Монте-Карло
+enum class Integrator { whitted, path };
+
+// Как в path находится прямой свет источников:
+// bsdf — только случайным попаданием луча по BRDF в источник (наивный вариант);
+// nee — выбором точки на источнике и теневым лучом на каждом отскоке (next-event estimation);
+// mis — оба способа, веса по эвристике степени (Veach): каждый силён там, где другой шумит
+enum class LightSampling { bsdf, nee, mis };
+
+bool parse_integrator(const std::string &name, Integrator &integrator);
+bool parse_light_sampling(const std::string &name, LightSampling &mode);
+
+// Фон по направлению и раствору конуса луча (как background в main.cpp)
+using BackgroundFn = vec3 (*)(const vec3 &dir, const float spread);
+
+struct PathSettings {
+    LightSampling lights = LightSampling::mis;
+    // Источники сцены — светящиеся сферы этого радиуса. Мощность от радиуса не зависит: на расстоянии ~55
+    // (середина сцены) освещённость как у точечного источника whitted
+    float light_radius = 3;
+    float pixel_angle = 0; // раствор конуса первичного луча (mip-уровни текстур и фона)
+    BackgroundFn background = nullptr;
+
+    float light_radiance() const { return 330.f * 9.f / (light_radius * light_radius); }
+};
+
+// Материалы whitted в терминах BSDF: ламбертово отражение diffuse_color * albedo[0] (не больше 1),
+// нормированный блик Фонга с весом 2 * albedo[1] / (n + 2) (той же яркости, что блик whitted),
+// идеальное зеркало albedo[2] и преломление albedo[3]. Лепесток на отскоке выбирается по весам.
+//
+// Цвет пути из камеры: primary — уже найденное первичное попадание (пакетом) или nullptr.
+// features — признаки первичного попадания для денойзера. Русская рулетка с третьего отскока, по весу пути.
+vec3 path_trace(const CompiledScene &scene, const vec3 &orig, const vec3 &dir, const Hit *primary, Sampler &sampler,
+                const PathSettings &settings, PixelFeatures *features = nullptr);
+
+#endif // PATH_TRACER_H
@@ -0,0 +1,304 @@
+#include "photon_map.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include "rng.h"
+#include "simd.h"
+
+namespace {
+
+constexpr float LIGHT_INTENSITY = 55.f * 55.f; // освещённость I cos / d^2 на расстоянии 55 — cos, как у источника whitted
+constexpr float MIN_SPECULAR = 0.5f;   // сферы с albedo[2] + albedo[3] не меньше — цели выпуска
+constexpr int MAX_BOUNCES = 16;
+constexpr uint32_t PHOTON_STREAM = 3;  // поток Rng фотонов (у пикселей потоки 0..2)
+constexpr int TASK_PHOTONS = 16384;    // поддеревья меньше строятся в той же задаче
+constexpr int LEAF_PHOTONS = 4 * SIMD_WIDTH; // поддеревья не больше — листья, их фотоны проверяются векторами
+constexpr int MAX_K = 256;
+constexpr float CONE_FILTER = 1.1f;    // фильтр-конус Jensen: вес 1 - d / (CONE_FILTER * r)
+
+// RGBE (Ward): три мантиссы и общий порядок
+void encode_rgbe(const vec3 &c, uint8_t out[4]) {
+    const float m = std::max(c.x, std::max(c.y, c.z));
+    if (m < 1e-32f) {
+        out[0] = out[1] = out[2] = out[3] = 0;
+        return;
+    }
+    int e;
+    const float scale = std::frexp(m, &e) * 256 / m;
+    for (int i = 0; i < 3; i++) out[i] = uint8_t(std::min(255.f, c[i] * scale));
+    out[3] = uint8_t(e + 128);
+}
+
+vec3 decode_rgbe(const uint8_t in[4]) {
+    if (in[3] <= 9) return {0, 0, 0}; // меньше 2^-136 и 0
+    const float f = float_from_bits(uint32_t(in[3] - (128 + 8) + 127) << 23); // 2^(e - 136) без ldexp
+    return {(in[0] + .5f) * f, (in[1] + .5f) * f, (in[2] + .5f) * f};
+}
+
+// Направление по байтам theta и phi — через таблицы синусов и косинусов
+struct DirectionTables {
+    float cos_theta[256], sin_theta[256], cos_phi[256], sin_phi[256];
+    DirectionTables() {
+        for (int i = 0; i < 256; i++) {
+            const float theta = (i + .5f) * float(M_PI) / 256, phi = (i + .5f) * 2 * float(M_PI) / 256 - float(M_PI);
+            cos_theta[i] = std::cos(theta);
+            sin_theta[i] = std::sin(theta);
+            cos_phi[i] = std::cos(phi);
+            sin_phi[i] = std::sin(phi);
+        }
+    }
+    vec3 decode(const PhotonRecord &p) const {
+        return {sin_theta[p.theta] * cos_phi[p.phi], sin_theta[p.theta] * sin_phi[p.phi], cos_theta[p.theta]};
+    }
+};
+
+const DirectionTables &direction_tables() {
+    static const DirectionTables tables;
+    return tables;
+}
+
+// Фотон на время построения: позиция рядом с остальным, чтобы nth_element переставлял их вместе
+struct Photon {
+    float pos[3];
+    PhotonRecord record;
+};
+
+Photon make_photon(const vec3 &pos, const vec3 &dir, const vec3 &power) {
+    Photon p;
+    for (int i = 0; i < 3; i++) p.pos[i] = pos[i];
+    encode_rgbe(power, p.record.power);
+    const int theta = int(std::acos(std::clamp(dir.z, -1.f, 1.f)) * (256 / float(M_PI)));
+    const int phi = int((std::atan2(dir.y, dir.x) + float(M_PI)) * (256 / (2 * float(M_PI))));
+    p.record.theta = uint8_t(std::clamp(theta, 0, 255));
+    p.record.phi = uint8_t(std::clamp(phi, 0, 255));
+    p.record.axis = 0;
+    return p;
+}
+
+// Конус от источника light на сферу-цель и его доля фотонов [first, first + count)
+struct Cone {
+    vec3 origin, axis;
+    float cos_max, solid_angle;
+    long long first, count;
+};
+
+// Путь фотона с номером photon из конуса: true и результат в out, если он дошёл до диффузной поверхности
+bool trace_photon(const CompiledScene &scene, const Cone &cone, const long long photon, Photon &out) {
+    Rng rng(uint32_t(photon), uint32_t(photon >> 32), PHOTON_STREAM);
+    const float u = rng.next_float(), v = rng.next_float();
+    vec3 o = cone.origin, d = around(cone.axis, 1 - u * (1 - cone.cos_max), 2 * float(M_PI) * v);
+    const float flux = LIGHT_INTENSITY * cone.solid_angle / cone.count;
+    vec3 power = {flux, flux, flux};
+    for (int bounce = 0; bounce < MAX_BOUNCES; bounce++) {
+        Hit hit;
+        if (!scene_intersect(scene, o, d, hit)) return false;
+        const Material &m = scene.materials[hit.material];
+        if (bounce > 0 && m.albedo[0] > 0) {
+            out = make_photon(hit.point, d, power);
+            return true;
+        }
+        // Зеркальное отражение или преломление с вероятностью их весов, иначе фотон поглощён
+        const float kr = m.albedo[2], kt = m.albedo[3], total = kr + kt;
+        const float survive = std::min(1.f, total), choice = rng.next_float();
+        if (choice >= survive) return false;
+        power = power * (total / survive);
+        const vec3 N = d * hit.N < 0 ? hit.N : -hit.N;
+        const vec3 R = d - N * (2 * (d * N));
+        if (choice < survive * kr / total) d = R;
+        else {
+            const float eta = d * hit.N < 0 ? 1 / m.refractive_index : m.refractive_index;
+            const float cos_i = -(d * N), k = 1 - eta * eta * (1 - cos_i * cos_i);
+            d = k < 0 ? R : d * eta + N * (eta * cos_i - std::sqrt(k));
+        }
+        o = hit.point;
+        d = d.normalized();
+    }
+    return false;
+}
+
+// Поддерево [lo, hi) внутри коробки [box_lo, box_hi]: корень — медиана по самой длинной стороне коробки
+void build_tree(Photon *photons, const int lo, const int hi, const vec3 box_lo, const vec3 box_hi) {
+    if (hi - lo <= LEAF_PHOTONS) return;
+    const vec3 extent = box_hi - box_lo;
+    const int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : extent.y >= extent.z ? 1 : 2;
+    const int mid = (lo + hi) / 2;
+    std::nth_element(photons + lo, photons + mid, photons + hi,
+                     [axis](const Photon &a, const Photon &b) { return a.pos[axis] < b.pos[axis]; });
+    photons[mid].record.axis = uint16_t(axis);
+    vec3 left_hi = box_hi, right_lo = box_lo;
+    left_hi[axis] = right_lo[axis] = photons[mid].pos[axis];
+#pragma omp task if (hi - lo > TASK_PHOTONS)
+    build_tree(photons, lo, mid, box_lo, left_hi);
+    build_tree(photons, mid + 1, hi, right_lo, box_hi);
+}
+
+// Найденный фотон: квадрат расстояния и индекс
+struct Found {
+    float d2;
+    int index;
+    bool operator<(const Found &o) const { return d2 < o.d2; }
+};
+
+// k ближайших к q фотонов ближе sqrt(r2) — в out, возвращает, сколько нашлось (не больше k).
+// out — ограниченная max-куча: когда набралось k, новый фотон вытесняет самый дальний, а радиус поиска
+// сжимается до расстояния самого дальнего — дальше обход отсекает поддеревья уже по нему
+int collect(const PhotonMap &map, const float q[3], float r2, Found *out, const int k) {
+    struct Range { int lo, hi; float d2; }; // поддерево и квадрат расстояния до его полупространства
+    Range stack[64];
+    const float *pos[3] = {map.x.data(), map.y.data(), map.z.data()};
+    const vfloat qx(q[0]), qy(q[1]), qz(q[2]);
+    vfloat radius2(r2);
+    int count = 0, sp = 0;
+    auto add = [&](const int i, const float d2) {
+        if (d2 >= r2) return; // радиус сжался после проверки вектора листа
+        if (count < k) {
+            out[count++] = {d2, i};
+            if (count < k) return;
+            std::make_heap(out, out + k);
+        } else {
+            std::pop_heap(out, out + k);
+            out[k - 1] = {d2, i};
+            std::push_heap(out, out + k);
+        }
+        r2 = out[0].d2;
+        radius2 = vfloat(r2);
+    };
+    stack[sp++] = {0, int(map.size()), 0.f};
+    while (sp) {
+        Range range = stack[--sp];
+        if (range.d2 >= r2) continue;
+        // Спуск к листу по ближней стороне, дальние стороны — в стек
+        while (range.hi - range.lo > LEAF_PHOTONS) {
+            const int mid = (range.lo + range.hi) / 2;
+            const float dx = q[0] - pos[0][mid], dy = q[1] - pos[1][mid], dz = q[2] - pos[2][mid];
+            const float d2 = dx * dx + dy * dy + dz * dz;
+            if (d2 < r2) add(mid, d2);
+            const int axis = map.records[mid].axis;
+            const float delta = q[axis] - pos[axis][mid];
+            const Range left = {range.lo, mid, delta * delta}, right = {mid + 1, range.hi, delta * delta};
+            const Range &far = delta < 0 ? right : left;
+            if (far.d2 < r2) stack[sp++] = far;
+            range = delta < 0 ? left : right;
+        }
+        // Лист: расстояния до SIMD_WIDTH фотонов сразу
+        for (int i = range.lo; i < range.hi; i += SIMD_WIDTH) {
+            const vfloat dx = qx - vfloat::load(pos[0] + i), dy = qy - vfloat::load(pos[1] + i), dz = qz - vfloat::load(pos[2] + i);
+            const vfloat d2 = dx * dx + dy * dy + dz * dz;
+            int mask = movemask(d2 < radius2);
+            if (range.hi - i < SIMD_WIDTH) mask &= (1 << (range.hi - i)) - 1;
+            if (!mask) continue;
+            alignas(32) float lanes[SIMD_WIDTH];
+            d2.store(lanes);
+            for (; mask; mask &= mask - 1) add(i + __builtin_ctz(mask), lanes[__builtin_ctz(mask)]);
+        }
+    }
+    return count;
+}
+
+} // namespace
+
+// k ближайших — кучей в радиусе-догадке. Догадка — радиус прошлого сбора этим потоком (у соседних пикселей
+// похожая плотность фотонов): меньше k фотонов — радиус растёт до max_radius. Слишком большая догадка
+// только удлиняет обход до заполнения кучи, поэтому цикл конечен, а результат от догадки не зависит
+vec3 PhotonMap::irradiance(const vec3 &point, const vec3 &N) const {
+    static thread_local float last_radius = 0;
+    Found near[MAX_K];
+    const float q[3] = {point.x, point.y, point.z};
+    const int want = std::clamp(k, 1, MAX_K);
+    float r = last_radius > 0 ? std::min(max_radius, last_radius * 1.25f) : max_radius;
+    int found;
+    for (;;) {
+        found = collect(*this, q, r * r, near, want);
+        if (found < want && r < max_radius) r = std::min(max_radius, r * 2);
+        else break;
+    }
+    // Радиус оценки — до k-го фотона (вершина кучи); если столько не нашлось, весь радиус поиска
+    const float radius2 = found == want ? near[0].d2 : max_radius * max_radius;
+    const float radius = std::sqrt(radius2);
+    last_radius = radius;
+    if (!found) return {0, 0, 0};
+
+    const DirectionTables &tables = direction_tables();
+    vec3 sum = {0, 0, 0};
+    for (int i = 0; i < found; i++) {
+        const PhotonRecord &p = records[near[i].index];
+        if (tables.decode(p) * N >= 0) continue; // фотон пришёл с другой стороны поверхности
+        sum = sum + decode_rgbe(p.power) * (1 - std::sqrt(near[i].d2) / (CONE_FILTER * radius));
+    }
+    return sum * (1 / ((1 - 2 / (3 * CONE_FILTER)) * float(M_PI) * radius2));
+}
+
+PhotonMap build_caustic_map(const CompiledScene &scene, const int count, const int k, const float max_radius) {
+    PhotonMap map;
+    map.k = k;
+    map.max_radius = max_radius;
+    auto start = std::chrono::steady_clock::now();
+
+    // Конусы от каждого источника на каждую зеркальную или стеклянную сферу; фотоны — пропорционально телесным углам
+    std::vector<Cone> cones;
+    double total_angle = 0;
+    for (int l = 0; l < scene.light_count(); l++) {
+        for (int s = 0; s < scene.sphere_count(); s++) {
+            const Material &m = scene.materials[scene.sphere_material[s]];
+            if (m.albedo[2] + m.albedo[3] < MIN_SPECULAR) continue;
+            const vec3 to_center = vec3{scene.sphere_x[s], scene.sphere_y[s], scene.sphere_z[s]} - scene.light(l);
+            const float dist = to_center.norm(), r = scene.sphere_r[s];
+            if (dist <= r) continue;
+            const float sin2 = r * r / (dist * dist);
+            const float one_minus_cos = sin2 / (1 + std::sqrt(1 - sin2));
+            cones.push_back({scene.light(l), to_center * (1 / dist), 1 - one_minus_cos, 2 * float(M_PI) * one_minus_cos, 0, 0});
+            total_angle += cones.back().solid_angle;
+        }
+    }
+    long long emitted = 0;
+    for (Cone &cone : cones) {
+        cone.first = emitted;
+        cone.count = std::max(1LL, std::llround(count * cone.solid_angle / total_angle));
+        emitted += cone.count;
+    }
+    map.emitted = cones.empty() ? 0 : emitted;
+
+    // Фотон i пишется в ячейку i, затем ячейки сжимаются по порядку: карта не зависит от числа потоков
+    std::vector<Photon> slots(map.emitted);
+    std::vector<char> stored(map.emitted, 0);
+#pragma omp parallel for schedule(dynamic, 1024)
+    for (long long i = 0; i < map.emitted; i++) {
+        const auto cone = std::upper_bound(cones.begin(), cones.end(), i,
+                                           [](const long long x, const Cone &c) { return x < c.first; }) - 1;
+        stored[i] = trace_photon(scene, *cone, i, slots[i]);
+    }
+    std::vector<Photon> photons;
+    for (long long i = 0; i < map.emitted; i++)
+        if (stored[i]) photons.push_back(slots[i]);
+    auto emitted_at = std::chrono::steady_clock::now();
+    map.emit_ms = std::chrono::duration<double, std::milli>(emitted_at - start).count();
+    if (photons.empty()) return map;
+
+    vec3 box_lo = {1e30f, 1e30f, 1e30f}, box_hi = {-1e30f, -1e30f, -1e30f};
+    for (const Photon &p : photons) {
+        for (int a = 0; a < 3; a++) {
+            box_lo[a] = std::min(box_lo[a], p.pos[a]);
+            box_hi[a] = std::max(box_hi[a], p.pos[a]);
+        }
+    }
+#pragma omp parallel
+#pragma omp single
+    build_tree(photons.data(), 0, int(photons.size()), box_lo, box_hi);
+
+    // Позиции — в отдельные массивы; хвост далёкими фотонами, чтобы последний лист читался целым вектором
+    const size_t n = photons.size();
+    map.x.assign(n + SIMD_WIDTH, 1e30f);
+    map.y.assign(n + SIMD_WIDTH, 1e30f);
+    map.z.assign(n + SIMD_WIDTH, 1e30f);
+    map.records.resize(n);
+#pragma omp parallel for schedule(static)
+    for (long long i = 0; i < (long long)n; i++) {
+        map.x[i] = photons[i].pos[0];
+        map.y[i] = photons[i].pos[1];
+        map.z[i] = photons[i].pos[2];
+        map.records[i] = photons[i].record;
+    }
+    map.build_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - emitted_at).count();
+    return map;
+}
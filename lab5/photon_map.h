@@ -0,0 +1,45 @@
+#ifndef PHOTON_MAP_H
+#define PHOTON_MAP_H
+
+#include <cstdint>
+#include <vector>
+#include "geometry.h"
+#include "scene.h"
+
+// Фотон без позиции: мощность в RGBE, направление полёта в двух байтах и ось разбиения узла kd-дерева.
+// С позицией — 20 байт, как у Jensen
+struct PhotonRecord {
+    uint8_t power[4];    // RGB с общим порядком
+    uint8_t theta, phi;  // направление полёта в сферических координатах
+    uint16_t axis;
+};
+static_assert(sizeof(PhotonRecord) == 8, "photon must stay compact");
+
+// Каустическая карта: фотоны от источников, прошедшие только зеркальные отражения и преломления
+// и остановленные первой диффузной поверхностью (пути L S+ D).
+// Дерево без указателей: отрезок [lo, hi) — поддерево, его корень — середина, левая и правая половины —
+// поддеревья по оси корня; короткие отрезки — листья. Узлов, кроме самих фотонов, нет.
+// Позиции лежат отдельными массивами: лист проверяется SIMD_WIDTH фотонов за раз
+struct PhotonMap {
+    std::vector<float> x, y, z;         // с запасом SIMD_WIDTH в конце под чтение последнего листа
+    std::vector<PhotonRecord> records;
+    long long emitted = 0;  // выпущено фотонов (сохранилась часть)
+    int k = 50;             // сколько ближайших фотонов собирает оценка
+    float max_radius = 0.5f; // дальше фотоны не ищутся
+    double emit_ms = 0, build_ms = 0;
+
+    size_t size() const { return records.size(); }
+    bool empty() const { return records.empty(); }
+    size_t bytes() const { return size() * (3 * sizeof(float) + sizeof(PhotonRecord)); }
+
+    // Освещённость от каустик в точке с нормалью N по k ближайшим фотонам с фильтром-конусом.
+    // Единицы — как у источников whitted: открытый источник на расстоянии ~55 даёт cos угла падения
+    vec3 irradiance(const vec3 &point, const vec3 &N) const;
+};
+
+// count фотонов от источников сцены в конусы на зеркальные и стеклянные сферы (albedo[2] + albedo[3] не меньше 0.5),
+// поровну на единицу телесного угла. Выпуск — параллельно по фотонам (Philox, результат не зависит от числа потоков),
+// дерево строится параллельно по поддеревьям
+PhotonMap build_caustic_map(const CompiledScene &scene, const int count, const int k, const float max_radius);
+
+#endif // PHOTON_MAP_H
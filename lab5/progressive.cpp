@@ -0,0 +1,174 @@
+#include "progressive.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <omp.h>
+#include "packet.h"
+
+namespace {
+
+inline float luminance(const vec3 &c) { return 0.2126f * c[0] + 0.7152f * c[1] + 0.0722f * c[2]; }
+inline float sqr(const float x) { return x * x; }
+
+// Сэмплов у пикселя, прежде чем адаптивный режим может его выключить
+constexpr int MIN_SAMPLES = 4;
+
+} // namespace
+
+ProgressiveFrame render_progressive(const ProgressiveSettings &settings, const std::vector<Tile> &tiles,
+                                    const PacketTracer &trace, const ProgressiveHooks &hooks) {
+    // Первый проход — каждый PREVIEW_STEP-й пиксель по обеим осям, цвет размножается на блок; дальше
+    // полные проходы по сэмплу на пиксель копятся в sum. По дедлайну недоделанный проход бросается
+    // по тайлам: у пикселей разное число сэмплов, у ещё не тронутых остаётся цвет первого прохода
+    const int width = settings.width, height = settings.height;
+    const size_t pixels = size_t(width) * height;
+    std::vector<float> sum(pixels * 3);
+    std::vector<uint32_t> count(pixels); // --spp не ограничен сверху
+    // Адаптивный режим: выключенные дорожки снимаются с пакета, пакет без живых дорожек не трассируется.
+    // Маска расширяется на соседей: соседи «шумного» пикселя (край силуэта, преломления, шахматки)
+    // тоже продолжают набирать сэмплы
+    // Сумма квадратов яркости сэмплов: для адаптивного режима и дисперсии пикселей для денойзера
+    std::vector<float> sum_sq(settings.adaptive || settings.variance ? pixels : 0);
+    FeatureBuffer feature_sum(settings.features ? pixels : 0); // признаки копятся так же, как цвет
+    std::vector<uint8_t> live(pixels, 1);
+    ProgressiveFrame frame;
+    frame.live_pixels = pixels;
+
+    const auto start = std::chrono::steady_clock::now();
+    auto elapsed_ms = [&] {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    };
+    auto expired = [&] { return settings.time_budget_ms > 0 && elapsed_ms() >= settings.time_budget_ms; };
+    auto resolve = [&] {
+        std::vector<float> hdr(pixels * 3);
+#pragma omp parallel for schedule(static)
+        for (size_t p = 0; p < pixels; p++) {
+            const float inv = count[p] > 1 ? 1.f / count[p] : 1.f;
+            for (int c = 0; c < 3; c++) hdr[p * 3 + c] = sum[p * 3 + c] * inv;
+        }
+        return hdr;
+    };
+    double last_preview = -1e9;
+    auto preview = [&] { // промежуточный кадр, если подошёл интервал и прошлый уже записан
+        const double now = elapsed_ms();
+        if (now - last_preview < settings.preview_interval_ms || !hooks.ready()) return;
+        std::vector<float> hdr = resolve();
+        hooks.preview(hdr);
+        if (!frame.previews++) frame.first_preview_ms = now;
+        last_preview = now;
+    };
+
+    constexpr int COARSE_W = BLOCK_W * PREVIEW_STEP, COARSE_H = BLOCK_H * PREVIEW_STEP;
+    const int coarse_x = (width + COARSE_W - 1) / COARSE_W, coarse_y = (height + COARSE_H - 1) / COARSE_H;
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int b = 0; b < coarse_x * coarse_y; b++) {
+        const int x0 = b % coarse_x * COARSE_W, y0 = b / coarse_x * COARSE_H;
+        vec3 colors[SIMD_WIDTH];
+        PixelFeatures lane_features[SIMD_WIDTH];
+        const int active = trace(x0, y0, PREVIEW_STEP, 0, (1 << SIMD_WIDTH) - 1, colors,
+                                 settings.features ? lane_features : nullptr);
+        for (int lane = 0; lane < SIMD_WIDTH; lane++) {
+            if (!(active >> lane & 1)) continue;
+            const int i = lane_x(x0, lane, PREVIEW_STEP), j = lane_y(y0, lane, PREVIEW_STEP);
+            for (int y = j; y < std::min(height, j + PREVIEW_STEP); y++) {
+                for (int x = i; x < std::min(width, i + PREVIEW_STEP); x++) {
+                    for (int c = 0; c < 3; c++) sum[(size_t(y) * width + x) * 3 + c] = colors[lane][c];
+                    if (settings.features) feature_sum.set(size_t(y) * width + x, lane_features[lane]);
+                }
+            }
+        }
+    }
+    frame.coarse_ms = elapsed_ms();
+    preview();
+
+    int pass = 0;
+    for (; pass < settings.passes && !expired(); pass++) {
+        std::atomic<size_t> skipped{0}, traced{0};
+        hooks.account(tiles, render_tiles(tiles, [&](const Tile &tile) {
+            if (expired()) { skipped += size_t(tile.x1 - tile.x0) * (tile.y1 - tile.y0); return; }
+            size_t tile_samples = 0;
+            for (int y0 = tile.y0; y0 < tile.y1; y0 += BLOCK_H) {
+                for (int x0 = tile.x0; x0 < tile.x1; x0 += BLOCK_W) {
+                    int lanes = 0;
+                    for (int lane = 0; lane < SIMD_WIDTH; lane++) {
+                        const int x = lane_x(x0, lane, 1), y = lane_y(y0, lane, 1);
+                        if (x < width && y < height && live[x + size_t(y) * width]) lanes |= 1 << lane;
+                    }
+                    if (!lanes) continue;
+                    vec3 colors[SIMD_WIDTH];
+                    PixelFeatures lane_features[SIMD_WIDTH];
+                    const int active = trace(x0, y0, 1, pass, lanes, colors, settings.features ? lane_features : nullptr);
+                    for (int lane = 0; lane < SIMD_WIDTH; lane++) {
+                        if (!(active >> lane & 1)) continue;
+                        const size_t p = lane_x(x0, lane, 1) + size_t(lane_y(y0, lane, 1)) * width;
+                        for (int c = 0; c < 3; c++) sum[p * 3 + c] = count[p] ? sum[p * 3 + c] + colors[lane][c] : colors[lane][c];
+                        if (settings.features) {
+                            if (count[p]) feature_sum.add(p, lane_features[lane]);
+                            else feature_sum.set(p, lane_features[lane]);
+                        }
+                        if (!sum_sq.empty()) {
+                            const float l = luminance(colors[lane]);
+                            sum_sq[p] = count[p] ? sum_sq[p] + l * l : l * l;
+                        }
+                        count[p]++;
+                        tile_samples++;
+                    }
+                }
+            }
+            traced += tile_samples;
+        }));
+        frame.samples_traced += traced;
+        if (skipped) { frame.partial = pixels - skipped; pass++; break; }
+        if (settings.adaptive && pass + 1 >= MIN_SAMPLES) {
+            std::vector<uint8_t> noisy(pixels);
+#pragma omp parallel for schedule(static)
+            for (size_t p = 0; p < pixels; p++) {
+                if (!live[p]) continue;
+                const float n = count[p];
+                const float mean = luminance(vec3{sum[p * 3], sum[p * 3 + 1], sum[p * 3 + 2]}) / n;
+                const float variance = std::max(0.f, (sum_sq[p] - n * mean * mean) / (n - 1));
+                noisy[p] = variance / n > sqr(settings.noise_target * (mean + 0.05f));
+            }
+            size_t live_pixels = 0;
+#pragma omp parallel for schedule(static) reduction(+:live_pixels)
+            for (int y = 0; y < height; y++) {
+                for (int x = 0; x < width; x++) {
+                    const size_t p = size_t(y) * width + x;
+                    live[p] = noisy[p] || (x > 0 && noisy[p - 1]) || (x + 1 < width && noisy[p + 1])
+                           || (y > 0 && noisy[p - width]) || (y + 1 < height && noisy[p + width]);
+                    live_pixels += live[p];
+                }
+            }
+            frame.live_pixels = live_pixels;
+            if (!live_pixels) { pass++; break; }
+        }
+        preview();
+    }
+    frame.passes = pass;
+    frame.max_samples = *std::max_element(count.begin(), count.end());
+    frame.hdr = resolve();
+    if (settings.variance && *std::min_element(count.begin(), count.end()) > 1) {
+        frame.variance.resize(pixels);
+#pragma omp parallel for schedule(static)
+        for (size_t p = 0; p < pixels; p++) {
+            const float n = count[p];
+            const float mean = luminance(vec3{frame.hdr[p * 3], frame.hdr[p * 3 + 1], frame.hdr[p * 3 + 2]});
+            frame.variance[p] = std::max(0.f, sum_sq[p] / n - mean * mean) / (n - 1);
+        }
+    }
+    if (settings.features) {
+        frame.features = FeatureBuffer(pixels);
+#pragma omp parallel for schedule(static)
+        for (size_t p = 0; p < pixels; p++) {
+            const float inv = count[p] > 1 ? 1.f / count[p] : 1.f;
+            for (int c = 0; c < 3; c++) {
+                frame.features.normal[p * 3 + c] = feature_sum.normal[p * 3 + c] * inv;
+                frame.features.albedo[p * 3 + c] = feature_sum.albedo[p * 3 + c] * inv;
+            }
+            frame.features.depth[p] = feature_sum.depth[p] * inv;
+        }
+    }
+    return frame;
+}
@@ -0,0 +1,63 @@
+#ifndef PROGRESSIVE_H
+#define PROGRESSIVE_H
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "denoise.h"
+#include "geometry.h"
+#include "simd.h"
+#include "tiles.h"
+
+// Первый проход трассирует каждый PREVIEW_STEP-й пиксель по обеим осям
+constexpr int PREVIEW_STEP = 4;
+
+struct ProgressiveSettings {
+    int width = 0, height = 0;
+    int passes = 16;                  // полных проходов по сэмплу на пиксель
+    double time_budget_ms = 0;        // 0 — без ограничения
+    double preview_interval_ms = 500;
+    // Адаптивный режим: после MIN_SAMPLES сэмплов пиксель выключается, когда стандартная ошибка среднего
+    // его яркости меньше noise_target * (яркость + 0.05)
+    bool adaptive = false;
+    float noise_target = 0.01f;
+    bool features = false;            // копить признаки первичных попаданий (денойзер, --aovs)
+    bool variance = false;            // дисперсия средней яркости пикселя для денойзера
+};
+
+// Пакет BLOCK_W x BLOCK_H пикселей с углом (x0, y0) и шагом step между дорожками, сэмпл sample, только
+// дорожки lanes: линейные цвета дорожек в colors, признаки в features (если не nullptr).
+// Возвращает маску оттрассированных дорожек
+using PacketTracer = std::function<int(const int x0, const int y0, const int step, const int sample, const int lanes,
+                                       vec3 colors[SIMD_WIDTH], PixelFeatures *features)>;
+
+struct ProgressiveHooks {
+    // Тайлы полного прохода и их время
+    std::function<void(const std::vector<Tile> &, const std::vector<TileTiming> &)> account;
+    // Промежуточный линейный кадр; ready() — можно ли его отдать (прошлый уже записан)
+    std::function<bool()> ready;
+    std::function<void(std::vector<float> &)> preview;
+};
+
+struct ProgressiveFrame {
+    std::vector<float> hdr;       // среднее сэмплов пикселя, RGB float
+    FeatureBuffer features;       // средние признаки пикселя (settings.features)
+    std::vector<float> variance;  // только если у каждого пикселя хотя бы два сэмпла (settings.variance)
+    double coarse_ms = 0;         // первый проход
+    int passes = 0;               // начатые полные проходы
+    size_t partial = 0;           // пиксели последнего прохода, брошенного по дедлайну
+    int previews = 0;
+    double first_preview_ms = 0;
+    size_t samples_traced = 0;    // сэмплов полных проходов
+    size_t live_pixels = 0;       // пиксели, ещё не сошедшиеся к noise_target (адаптивный режим)
+    uint32_t max_samples = 0;     // наибольшее число сэмплов пикселя
+};
+
+// Прогрессивный рендер кадра: грубый проход, затем полные проходы по тайлам, пока не наберётся
+// settings.passes сэмплов, не выйдет time_budget_ms или (адаптивно) не сойдутся все пиксели.
+// Промежуточные кадры — не чаще preview_interval_ms
+ProgressiveFrame render_progressive(const ProgressiveSettings &settings, const std::vector<Tile> &tiles,
+                                    const PacketTracer &trace, const ProgressiveHooks &hooks);
+
+#endif // PROGRESSIVE_H
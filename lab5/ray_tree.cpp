@@ -0,0 +1,71 @@
+#include "ray_tree.h"
+
+#include <algorithm>
+#include <cmath>
+
+void RayTreeCache::begin_pixel() {
+    first.push_back(uint32_t(nodes.size()));
+    masks.push_back(0);
+}
+
+int RayTreeCache::add_node(const RayTreeNode &node, const float *log_specular) {
+    RayTreeNode stored = node;
+    stored.specular = uint32_t(specular.size());
+    specular.insert(specular.end(), log_specular, log_specular + node.lights);
+    if (node.material >= 0) masks.back() |= 1ull << std::min<int>(node.material, 63);
+    nodes.push_back(stored);
+    return int(nodes.size() - first.back()) - 1;
+}
+
+void RayTreeCache::append(const RayTreeCache &other) {
+    const uint32_t node_offset = uint32_t(nodes.size()), specular_offset = uint32_t(specular.size());
+    for (const uint32_t f : other.first) first.push_back(f + node_offset);
+    masks.insert(masks.end(), other.masks.begin(), other.masks.end());
+    for (RayTreeNode node : other.nodes) {
+        node.specular += specular_offset;
+        nodes.push_back(node);
+    }
+    specular.insert(specular.end(), other.specular.begin(), other.specular.end());
+}
+
+void RayTreeCache::shade(const std::vector<Material> &materials, float *hdr, const int only_material) const {
+    const uint64_t bit = only_material < 0 ? ~0ull : 1ull << std::min(only_material, 63);
+    const long long pixels = (long long)masks.size();
+#pragma omp parallel for schedule(dynamic, 1024)
+    for (long long p = 0; p < pixels; p++) {
+        if (only_material >= 0 && !(masks[p] & bit)) continue;
+        const uint32_t begin = first[p], end = p + 1 < pixels ? first[p + 1] : uint32_t(nodes.size());
+        float weights[64]; // веса узлов; в глубоких деревьях (больше 64 узлов) — отдельный буфер
+        std::vector<float> deep(end - begin > 64 ? end - begin : 0);
+        float *weight = deep.empty() ? weights : deep.data();
+        vec3 color = {0, 0, 0};
+        for (uint32_t n = 0; n < end - begin; n++) {
+            const RayTreeNode &node = nodes[begin + n];
+            float w = 1;
+            if (node.parent >= 0) w = weight[node.parent] * materials[nodes[begin + node.parent].material].albedo[2 + node.branch];
+            weight[n] = w;
+            if (w == 0) continue;
+            if (node.material < 0) {
+                color = color + node.color * w;
+                continue;
+            }
+            const Material &material = materials[node.material];
+            float specular_light_intensity = 0;
+            for (int l = 0; l < node.lights; l++) // pow(cos, e) через сохранённый логарифм; pow(0, 0) = 1, как в direct_light
+                specular_light_intensity += material.specular_exponent > 0 ? std::exp(material.specular_exponent * specular[node.specular + l]) : 1.f;
+            const vec3 &kd = node.own_color ? node.color : material.diffuse_color;
+            color = color + (kd * (node.diffuse * material.albedo[0]) + vec3{1, 1, 1} * (specular_light_intensity * material.albedo[1])) * w;
+        }
+        for (int c = 0; c < 3; c++) hdr[p * 3 + c] = color[c];
+    }
+}
+
+size_t RayTreeCache::pixels_with(const int material) const {
+    const uint64_t bit = 1ull << std::min(material, 63);
+    return size_t(std::count_if(masks.begin(), masks.end(), [bit](const uint64_t m) { return (m & bit) != 0; }));
+}
+
+size_t RayTreeCache::bytes() const {
+    return first.size() * sizeof(uint32_t) + masks.size() * sizeof(uint64_t) + nodes.size() * sizeof(RayTreeNode)
+         + specular.size() * sizeof(float);
+}
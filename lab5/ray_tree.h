@@ -0,0 +1,46 @@
+#ifndef RAY_TREE_H
+#define RAY_TREE_H
+
+#include <cstdint>
+#include <vector>
+#include "geometry.h"
+
+// Узел дерева лучей пикселя: попадание или промах. Всё, что зависит только от геометрии, посчитано при записи,
+// а от материала — нет: вес узла, цвет и блик досчитываются при перекраске
+struct RayTreeNode {
+    vec3 color;        // у промаха — фон, у плоскости — цвет узора или текстуры
+    float diffuse;     // сумма косинусов по открытым источникам
+    uint32_t specular; // начало логарифмов косинусов блика открытых источников в RayTreeCache::specular
+    uint8_t lights;    // сколько их
+    uint8_t branch;    // 0 — отражение от родителя, 1 — преломление
+    int16_t parent;    // номер родителя внутри пикселя, -1 — первичный луч
+    int16_t material;  // -1 — промах
+    bool own_color;    // цвет из color, а не из материала (плоскости)
+};
+
+// Деревья лучей всех пикселей кадра подряд (узлы пикселя — в порядке обхода, родитель раньше потомков)
+// и перекраска по ним: вклад узла в пиксель — произведение albedo[2]/albedo[3] по пути на его прямой свет.
+// Пиксель помнит маску материалов своего дерева: после правки материала перекрашиваются только его пиксели
+class RayTreeCache {
+public:
+    // Запись: пиксели по порядку, узлы каждого — после begin_pixel
+    void begin_pixel();
+    int add_node(const RayTreeNode &node, const float *log_specular);
+    void append(const RayTreeCache &other); // строки, записанные параллельно, склеиваются по порядку
+
+    // Цвета пикселей в RGB float-буфер; only_material >= 0 — только пиксели, где он встречается
+    void shade(const std::vector<Material> &materials, float *hdr, const int only_material = -1) const;
+    size_t pixels_with(const int material) const;
+
+    size_t pixel_count() const { return masks.size(); }
+    size_t node_count() const { return nodes.size(); }
+    size_t bytes() const;
+
+private:
+    std::vector<uint32_t> first; // начало узлов пикселя; всего pixel_count() + 1
+    std::vector<uint64_t> masks; // бит m — материал m (бит 63 — все с номерами от 63)
+    std::vector<RayTreeNode> nodes;
+    std::vector<float> specular;
+};
+
+#endif // RAY_TREE_H
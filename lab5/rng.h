@@ -0,0 +1,71 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <cstdint>
+#include <cstring>
+
+// Счётчиковый генератор Philox4x32-10 (Salmon et al., «Parallel random numbers: as easy as 1, 2, 3»).
+// Результат — чистая функция ключа и 128-битного счётчика: общего состояния и блокировок нет,
+// а одинаковый счётчик даёт одинаковые числа при любом числе потоков.
+struct Philox {
+    static constexpr uint32_t KEY0 = 0xA511E9B3u, KEY1 = 0x63D83595u;
+
+    static void generate(const uint32_t counter[4], uint32_t out[4], uint32_t key0 = KEY0, uint32_t key1 = KEY1) {
+        uint32_t c0 = counter[0], c1 = counter[1], c2 = counter[2], c3 = counter[3];
+        for (int round = 0; round < 10; round++) {
+            uint64_t p0 = uint64_t(0xD2511F53u) * c0, p1 = uint64_t(0xCD9E8D57u) * c2;
+            uint32_t n0 = uint32_t(p1 >> 32) ^ c1 ^ key0, n2 = uint32_t(p0 >> 32) ^ c3 ^ key1;
+            c1 = uint32_t(p1); c3 = uint32_t(p0);
+            c0 = n0; c2 = n2;
+            key0 += 0x9E3779B9u; key1 += 0xBB67AE85u;
+        }
+        out[0] = c0; out[1] = c1; out[2] = c2; out[3] = c3;
+    }
+
+    // Одно 32-битное число по четырём словам счётчика — для детерминированного «шума»
+    static uint32_t hash(uint32_t a, uint32_t b, uint32_t c, uint32_t d) {
+        const uint32_t counter[4] = {a, b, c, d};
+        uint32_t out[4];
+        generate(counter, out);
+        return out[0];
+    }
+};
+
+inline uint32_t float_bits(const float f) {
+    uint32_t u;
+    std::memcpy(&u, &f, sizeof u);
+    return u;
+}
+
+inline float float_from_bits(const uint32_t u) {
+    float f;
+    std::memcpy(&f, &u, sizeof f);
+    return f;
+}
+
+// Поток случайных чисел одного сэмпла пикселя. stream разделяет независимые потребители
+// (русская рулетка, джиттер, выбор источника...), чтобы они не делили последовательность.
+class Rng {
+public:
+    Rng(const uint32_t pixel, const uint32_t sample, const uint32_t stream = 0)
+        : counter{0, stream, sample, pixel} {}
+
+    uint32_t next_u32() {
+        if (used == 4) {
+            Philox::generate(counter, block);
+            counter[0]++;
+            used = 0;
+        }
+        return block[used++];
+    }
+
+    // Равномерно в [0, 1)
+    float next_float() { return (next_u32() >> 8) * (1.f / 16777216.f); }
+
+private:
+    uint32_t counter[4];
+    uint32_t block[4] = {};
+    int used = 4;
+};
+
+#endif // RNG_H
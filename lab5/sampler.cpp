@@ -0,0 +1,181 @@
+#include "sampler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace {
+
+constexpr int NOISE_SIZE = 64;
+
+uint32_t reverse_bits(uint32_t x) {
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+    x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+    x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+    x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+    return x;
+}
+
+// Скремблирование Оуэна хэшем Лайне–Карраса: бит зависит только от старших битов, поэтому
+// стратификация последовательности сохраняется
+uint32_t owen_scramble(uint32_t x, const uint32_t seed) {
+    x = reverse_bits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverse_bits(x);
+}
+
+uint32_t hash_combine(const uint32_t seed, const uint32_t v) {
+    return seed ^ (v + 0x9e3779b9u + (seed << 6) + (seed >> 2));
+}
+
+uint32_t mix(uint32_t x) { // хэш 32 -> 32 (lowbias32)
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+// Второе измерение Sobol (многочлен x + 1): матрица — треугольник Паскаля по модулю 2. Столбцы матрицы
+// сложены в таблицы по байтам номера, чтобы не ходить циклом по 32 битам с непредсказуемым ветвлением.
+struct SobolTables {
+    uint32_t bytes[4][256];
+    SobolTables() {
+        uint32_t column[32];
+        uint32_t v = 1u << 31;
+        for (int bit = 0; bit < 32; bit++, v ^= v >> 1) column[bit] = v;
+        for (int b = 0; b < 4; b++) {
+            for (int value = 0; value < 256; value++) {
+                uint32_t s = 0;
+                for (int bit = 0; bit < 8; bit++)
+                    if (value >> bit & 1) s ^= column[b * 8 + bit];
+                bytes[b][value] = s;
+            }
+        }
+    }
+};
+
+const SobolTables sobol_tables;
+
+// Первые два измерения Sobol: ван дер Корпут и многочлен x + 1
+void sobol_2d(const uint32_t index, uint32_t &s0, uint32_t &s1) {
+    s0 = reverse_bits(index);
+    s1 = sobol_tables.bytes[0][index & 0xff] ^ sobol_tables.bytes[1][index >> 8 & 0xff] ^
+         sobol_tables.bytes[2][index >> 16 & 0xff] ^ sobol_tables.bytes[3][index >> 24];
+}
+
+float to_unit(const uint32_t bits) { return (bits >> 8) * (1.f / 16777216.f); }
+
+// Void-and-cluster (Ulichney): точки по очереди ставятся в самую большую «дыру» и снимаются из самого
+// плотного скопления; порядок постановки — ранг, он и есть значение шума. Энергия — гауссиана
+// на торе, обновляется инкрементально таблицей ядра.
+std::vector<float> make_blue_noise() {
+    constexpr int N = NOISE_SIZE, COUNT = N * N;
+    constexpr float SIGMA = 1.9f;
+    std::vector<float> kernel(COUNT);
+    for (int dy = 0; dy < N; dy++) {
+        for (int dx = 0; dx < N; dx++) {
+            const int wx = std::min(dx, N - dx), wy = std::min(dy, N - dy);
+            kernel[dy * N + dx] = std::exp(-(wx * wx + wy * wy) / (2 * SIGMA * SIGMA));
+        }
+    }
+    std::vector<uint8_t> on(COUNT, 0);
+    std::vector<float> energy(COUNT, 0);
+    auto splat = [&](const int p, const float sign) {
+        const int px = p % N, py = p / N;
+        for (int y = 0; y < N; y++)
+            for (int x = 0; x < N; x++)
+                energy[y * N + x] += sign * kernel[((y - py + N) % N) * N + (x - px + N) % N];
+    };
+    // Самая плотная точка (state = 1) или самая большая дыра (state = 0)
+    auto extreme = [&](const uint8_t state) {
+        int best = -1;
+        for (int p = 0; p < COUNT; p++) {
+            if (on[p] != state) continue;
+            if (best < 0 || (state ? energy[p] > energy[best] : energy[p] < energy[best])) best = p;
+        }
+        return best;
+    };
+
+    // Начальный узор: 10% случайных точек, затем перестановки, пока самая плотная точка не окажется самой большой дырой
+    Rng rng(0, 0, 0xb1);
+    const int initial = COUNT / 10;
+    for (int placed = 0; placed < initial;) {
+        const int p = static_cast<int>(rng.next_u32() % COUNT);
+        if (on[p]) continue;
+        on[p] = 1;
+        splat(p, 1);
+        placed++;
+    }
+    for (int iteration = 0; iteration < COUNT; iteration++) {
+        const int cluster = extreme(1);
+        on[cluster] = 0;
+        splat(cluster, -1);
+        const int void_ = extreme(0);
+        on[void_] = 1;
+        splat(void_, 1);
+        if (void_ == cluster) break;
+    }
+
+    std::vector<int> rank(COUNT, -1);
+    // Фаза 1: ранги начальных точек — снимаем скопления
+    {
+        std::vector<uint8_t> saved = on;
+        std::vector<float> saved_energy = energy;
+        for (int r = initial - 1; r >= 0; r--) {
+            const int cluster = extreme(1);
+            on[cluster] = 0;
+            splat(cluster, -1);
+            rank[cluster] = r;
+        }
+        on = saved;
+        energy = saved_energy;
+    }
+    // Фаза 2 и 3: заполняем дыры до конца (после половины «дыры» и «скопления» симметричны, та же энергия работает)
+    for (int r = initial; r < COUNT; r++) {
+        const int void_ = extreme(0);
+        on[void_] = 1;
+        splat(void_, 1);
+        rank[void_] = r;
+    }
+    std::vector<float> noise(COUNT);
+    for (int p = 0; p < COUNT; p++) noise[p] = (rank[p] + 0.5f) / COUNT;
+    return noise;
+}
+
+} // namespace
+
+bool parse_sampler(const std::string &name, SamplerType &type) {
+    if (name == "random") type = SamplerType::random;
+    else if (name == "sobol") type = SamplerType::sobol;
+    else if (name == "bluenoise") type = SamplerType::bluenoise;
+    else return false;
+    return true;
+}
+
+float blue_noise(const uint32_t x, const uint32_t y) {
+    static const std::vector<float> noise = make_blue_noise();
+    return noise[(y % NOISE_SIZE) * NOISE_SIZE + x % NOISE_SIZE];
+}
+
+float Sampler::next_sequence() {
+    // Пара измерений = одна 2D-последовательность Sobol со своим перемешиванием номера и своим скремблированием
+    const uint32_t d = dimension++, pair = d / 2;
+    const uint32_t pair_seed = mix(hash_combine(type == SamplerType::sobol ? seed : 0x0b1eu, pair));
+    if (pair != cached_pair) { // второе измерение пары берёт точку, посчитанную для первого
+        sobol_2d(owen_scramble(sample, pair_seed), cached[0], cached[1]);
+        cached_pair = pair;
+    }
+    const float u = to_unit(owen_scramble(cached[d & 1], mix(hash_combine(pair_seed, d & 1))));
+    if (type == SamplerType::sobol) return u;
+    // Свой сдвиг синего шума на каждое измерение: тайл сдвигается на тор, чтобы измерения не коррелировали
+    const float shift = blue_noise(x + 37 * d, y + 19 * d + (d >> 1) * 11);
+    const float v = u + shift;
+    return v >= 1.f ? v - 1.f : v;
+}
@@ -0,0 +1,46 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <cstdint>
+#include <string>
+#include "rng.h"
+
+// Источник чисел сэмпла пикселя:
+// random — Philox (Rng), как раньше;
+// sobol — 2D Sobol с хэш-скремблированием Оуэна (Burley, «Practical Hash-based Owen Scrambling»): пары
+//   измерений берутся из одной 2D-последовательности с перемешанным номером, у каждого пикселя свой сид;
+// bluenoise — та же последовательность с общим для кадра сидом, сдвинутая на значение тайла синего шума
+//   64x64 (сдвиг Крэнли–Паттерсона): ошибка соседних пикселей при малом числе сэмплов становится
+//   высокочастотной и почти не видна глазу.
+enum class SamplerType { random, sobol, bluenoise };
+
+bool parse_sampler(const std::string &name, SamplerType &type);
+
+class Sampler {
+public:
+    // stream разделяет потребителей (джиттер, русская рулетка, ...) так же, как у Rng:
+    // в random это поток Philox, в sobol/bluenoise — свой диапазон измерений
+    Sampler(const SamplerType type, const uint32_t x, const uint32_t y, const uint32_t width, const uint32_t sample,
+            const uint32_t stream = 0)
+        : type(type), x(x), y(y), sample(sample), dimension(stream * STREAM_DIMENSIONS),
+          seed(Philox::hash(x + y * width, stream, 0x5eed, 0)), rng(x + y * width, sample, stream) {}
+
+    // Равномерно в [0, 1): каждое следующее число — следующее измерение сэмпла
+    float next_float() { return type == SamplerType::random ? rng.next_float() : next_sequence(); }
+
+    static constexpr uint32_t STREAM_DIMENSIONS = 64;
+
+private:
+    float next_sequence();
+
+    SamplerType type;
+    uint32_t x, y, sample, dimension;
+    uint32_t seed;
+    uint32_t cached_pair = ~0u, cached[2] = {};
+    Rng rng;
+};
+
+// Значение тайла синего шума 64x64 в [0, 1) (void-and-cluster, строится при первом вызове)
+float blue_noise(const uint32_t x, const uint32_t y);
+
+#endif // SAMPLER_H
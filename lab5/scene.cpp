@@ -0,0 +1,196 @@
+#include "scene.h"
+
+#include "rng.h"
+
+namespace {
+
+bool same_material(const Material &a, const Material &b) {
+    return a.refractive_index == b.refractive_index &&
+           a.albedo[0] == b.albedo[0] && a.albedo[1] == b.albedo[1] &&
+           a.albedo[2] == b.albedo[2] && a.albedo[3] == b.albedo[3] &&
+           a.diffuse_color.x == b.diffuse_color.x && a.diffuse_color.y == b.diffuse_color.y &&
+           a.diffuse_color.z == b.diffuse_color.z && a.specular_exponent == b.specular_exponent;
+}
+
+int material_index(std::vector<Material> &materials, const Material &m) {
+    for (size_t i = 0; i < materials.size(); i++)
+        if (same_material(materials[i], m)) return static_cast<int>(i);
+    materials.push_back(m);
+    return static_cast<int>(materials.size()) - 1;
+}
+
+vec3 pattern_color(const PlanePattern pattern, const vec3 &pt) {
+    if (pattern == PlanePattern::checker) {
+        int cell_x = int(pt.x * 3) % 3;
+        int cell_y = int(pt.y * 3) % 3;
+        return (cell_x + cell_y) % 2 ? vec3{0.8, 0.7, 0.6} : vec3{0.2, 0.1, 0.1};
+    }
+    // Шум — хэш координат точки: не зависит от потока и порядка лучей, в отражениях стена выглядит так же
+    int noise = Philox::hash(float_bits(pt.x), float_bits(pt.y), float_bits(pt.z), 0) & 1;
+    return (int(pt.x * 2 + pt.z * 2 + noise) % 2) ? vec3{0.5, 0.5, 0.5} : vec3{0.2, 0.2, 0.2};
+}
+
+// Расстояние до сферы i или 0, если луч её не задевает
+inline float sphere_distance(const CompiledScene &scene, const int i, const vec3 &orig, const vec3 &dir) {
+    float lx = scene.sphere_x[i] - orig.x, ly = scene.sphere_y[i] - orig.y, lz = scene.sphere_z[i] - orig.z;
+    float tca = lx*dir.x + ly*dir.y + lz*dir.z;
+    float d2 = lx*lx + ly*ly + lz*lz - tca*tca;
+    float r2 = scene.sphere_r[i] * scene.sphere_r[i];
+    if (d2 > r2) return 0;
+    float thc = std::sqrt(r2 - d2);
+    float t0 = tca - thc, t1 = tca + thc;
+    if (t0 > .001f) return t0; // offset the original point by .001 to avoid occlusion by the object itself
+    if (t1 > .001f) return t1;
+    return 0;
+}
+
+// Расстояние до прямоугольника плоскости i или 0
+inline float plane_distance(const CompiledScene &scene, const int i, const vec3 &orig, const vec3 &dir) {
+    const int a = scene.plane_axis[i], u = (a + 1) % 3, v = (a + 2) % 3;
+    if (std::abs(dir[a]) <= .001f) return 0; // avoid division by zero
+    float d = (scene.plane_offset[i] - orig[a]) / dir[a];
+    if (d <= .001f) return 0;
+    vec3 p = orig + dir * d;
+    if (p[u] <= scene.plane_u0[i] || p[u] >= scene.plane_u1[i] ||
+        p[v] <= scene.plane_v0[i] || p[v] >= scene.plane_v1[i]) return 0;
+    return d;
+}
+
+template <typename Tree>
+bool intersect(const CompiledScene &scene, const Tree &tree, const vec3 &orig, const vec3 &dir, Hit &hit) {
+    // Сферы: лист BVH — непрерывный отрезок массивов
+    int nearest = -1;
+    float nearest_dist = 1e10;
+    tree.traverse(orig, dir, nearest_dist, [&](const int first, const int count, float &tmax) {
+        for (int i = first; i < first + count; i++) {
+            float t = sphere_distance(scene, i, orig, dir);
+            if (t <= 0 || t > tmax) continue;
+            tmax = t;
+            nearest = i;
+        }
+    });
+
+    // Плоскости
+    for (int i = 0; i < scene.plane_count(); i++) {
+        float d = plane_distance(scene, i, orig, dir);
+        if (d <= 0 || d >= nearest_dist) continue;
+        nearest_dist = d;
+        nearest = scene.sphere_count() + i;
+    }
+
+    if (nearest < 0 || nearest_dist >= 1000) return false;
+    finish_hit(scene, nearest, orig, dir, nearest_dist, hit);
+    return true;
+}
+
+} // namespace
+
+CompiledScene compile_scene(const std::vector<Sphere> &spheres, const std::vector<Plane> &planes,
+                            const std::vector<vec3> &lights) {
+    CompiledScene scene;
+
+    std::vector<AABB> boxes(spheres.size());
+    for (size_t i = 0; i < spheres.size(); i++) {
+        const Sphere &s = spheres[i];
+        boxes[i].grow(s.center - vec3{s.radius, s.radius, s.radius});
+        boxes[i].grow(s.center + vec3{s.radius, s.radius, s.radius});
+    }
+    scene.bvh = build_bvh(boxes);
+
+    // Раскладываем сферы в порядке листьев, после этого indices — тождественная перестановка
+    const size_t n = spheres.size();
+    scene.sphere_x.resize(n); scene.sphere_y.resize(n); scene.sphere_z.resize(n); scene.sphere_r.resize(n);
+    scene.sphere_material.resize(n);
+    for (size_t i = 0; i < n; i++) {
+        const Sphere &s = spheres[scene.bvh.indices[i]];
+        scene.sphere_x[i] = s.center.x;
+        scene.sphere_y[i] = s.center.y;
+        scene.sphere_z[i] = s.center.z;
+        scene.sphere_r[i] = s.radius;
+        scene.sphere_material[i] = material_index(scene.materials, s.material);
+        scene.bvh.indices[i] = static_cast<int>(i);
+    }
+    scene.wide_bvh = build_wide_bvh(scene.bvh);
+
+    for (const Plane &p : planes) {
+        scene.plane_axis.push_back(p.axis);
+        scene.plane_offset.push_back(p.offset);
+        scene.plane_u0.push_back(p.u0);
+        scene.plane_u1.push_back(p.u1);
+        scene.plane_v0.push_back(p.v0);
+        scene.plane_v1.push_back(p.v1);
+        scene.plane_pattern.push_back(p.pattern);
+        scene.plane_material.push_back(material_index(scene.materials, p.material));
+        scene.plane_texture.push_back(p.texture);
+        scene.plane_texture_size.push_back(p.texture_size);
+    }
+
+    for (const vec3 &l : lights) {
+        scene.light_x.push_back(l.x);
+        scene.light_y.push_back(l.y);
+        scene.light_z.push_back(l.z);
+    }
+    return scene;
+}
+
+bool scene_intersect(const CompiledScene &scene, const vec3 &orig, const vec3 &dir, Hit &hit) {
+    return intersect(scene, scene.wide_bvh, orig, dir, hit);
+}
+
+bool scene_occluded(const CompiledScene &scene, const vec3 &orig, const vec3 &dir, const float tmax) {
+    // Плоскостей мало, а закрывают они часто — проверяем их первыми
+    for (int i = 0; i < scene.plane_count(); i++) {
+        float d = plane_distance(scene, i, orig, dir);
+        if (d > 0 && d < tmax) return true;
+    }
+
+    float limit = tmax;
+    scene.wide_bvh.traverse(orig, dir, limit, [&](const int first, const int count, float &t_limit) {
+        for (int i = first; i < first + count; i++) {
+            float t = sphere_distance(scene, i, orig, dir);
+            if (t <= 0 || t >= t_limit) continue;
+            t_limit = -1; // первого препятствия достаточно
+            return;
+        }
+    });
+    return limit < 0;
+}
+
+bool scene_intersect_binary(const CompiledScene &scene, const vec3 &orig, const vec3 &dir, Hit &hit) {
+    return intersect(scene, scene.bvh, orig, dir, hit);
+}
+
+void finish_hit(const CompiledScene &scene, const int prim, const vec3 &orig, const vec3 &dir, const float dist, Hit &hit) {
+    hit.dist = dist;
+    hit.prim = prim;
+    hit.point = orig + dir * dist;
+    if (prim < scene.sphere_count()) {
+        hit.N = (hit.point - vec3{scene.sphere_x[prim], scene.sphere_y[prim], scene.sphere_z[prim]}) * (1.f / scene.sphere_r[prim]);
+        hit.material = scene.sphere_material[prim];
+        hit.diffuse_color = scene.materials[hit.material].diffuse_color;
+        hit.texture = -1;
+        return;
+    }
+    const int i = prim - scene.sphere_count();
+    hit.N = {};
+    hit.N[scene.plane_axis[i]] = 1;
+    hit.material = scene.plane_material[i];
+    if (scene.plane_pattern[i] == PlanePattern::texture) {
+        const int a = scene.plane_axis[i];
+        hit.texture = scene.plane_texture[i];
+        hit.s =  hit.point[(a + 2) % 3] / scene.plane_texture_size[i];
+        hit.t = -hit.point[(a + 1) % 3] / scene.plane_texture_size[i];
+        hit.diffuse_color = scene.materials[hit.material].diffuse_color;
+        return;
+    }
+    hit.texture = -1;
+    hit.diffuse_color = pattern_color(scene.plane_pattern[i], hit.point);
+}
+
+void shade_texture(const CompiledScene &scene, const vec3 &dir, const float cone_width, Hit &hit) {
+    if (hit.texture < 0) return;
+    const Texture &tex = scene.textures[hit.texture];
+    const float size = scene.plane_texture_size[hit.prim - scene.sphere_count()];
+    const float footprint = cone_width / std::max(std::abs(dir * hit.N), 1e-3f); // в мировых единицах
+    hit.diffuse_color = tex.sample_trilinear(hit.s, hit.t, std::log2(footprint * tex.width() / size + 1e-20f));
+}
@@ -0,0 +1,80 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <vector>
+#include "geometry.h"
+#include "bvh.h"
+#include "texture.h"
+
+// Узор плоскости: процедурный или текстура из CompiledScene::textures
+enum class PlanePattern { checker, noise, texture };
+
+// Прямоугольник в плоскости coord[axis] = offset, нормаль смотрит вдоль оси axis.
+// u/v — координаты по осям (axis+1)%3 и (axis+2)%3, границы строгие.
+// Текстура кладётся повторами со стороной texture_size: по горизонтали изображения — ось v, вниз — против оси u.
+struct Plane {
+    int axis;
+    float offset;
+    float u0, u1, v0, v1;
+    PlanePattern pattern;
+    Material material;
+    int texture = -1;
+    float texture_size = 1;
+};
+
+// Сцена, один раз скомпилированная перед рендером в плоские массивы (structure of arrays).
+// Сферы лежат в порядке листьев BVH, так что лист — непрерывный отрезок массивов.
+struct CompiledScene {
+    std::vector<float> sphere_x, sphere_y, sphere_z, sphere_r;
+    std::vector<int>   sphere_material;
+
+    std::vector<int>   plane_axis;
+    std::vector<float> plane_offset, plane_u0, plane_u1, plane_v0, plane_v1;
+    std::vector<PlanePattern> plane_pattern;
+    std::vector<int>   plane_material;
+    std::vector<int>   plane_texture;
+    std::vector<float> plane_texture_size;
+
+    std::vector<float> light_x, light_y, light_z;
+
+    std::vector<Material> materials; // без повторов, примитивы ссылаются на них по индексу
+    std::vector<Texture> textures;    // заполняются после compile_scene, плоскости ссылаются по индексу
+    BVH bvh;                          // по сферам; им пользуются пакеты
+    WideBVH wide_bvh;                 // то же дерево в ширину SIMD_WIDTH — для одиночных лучей
+
+    int sphere_count() const { return static_cast<int>(sphere_x.size()); }
+    int plane_count()  const { return static_cast<int>(plane_axis.size()); }
+    int light_count()  const { return static_cast<int>(light_x.size()); }
+    vec3 light(const int i) const { return {light_x[i], light_y[i], light_z[i]}; }
+};
+
+// Результат scene_intersect
+struct Hit {
+    float dist = 1e10;
+    vec3 point, N;
+    int prim = -1;      // сферы 0..sphere_count()-1, затем плоскости
+    int material = -1;  // индекс в CompiledScene::materials
+    vec3 diffuse_color; // цвет материала или узора плоскости в точке попадания
+    int texture = -1;   // текстурированная плоскость: цвет досчитывает shade_texture
+    float s = 0, t = 0; // координаты в текстуре, 1 — один повтор
+};
+
+CompiledScene compile_scene(const std::vector<Sphere> &spheres, const std::vector<Plane> &planes,
+                            const std::vector<vec3> &lights);
+
+bool scene_intersect(const CompiledScene &scene, const vec3 &orig, const vec3 &dir, Hit &hit);
+
+// Есть ли препятствие на луче ближе tmax. Останавливается на первом найденном, нормали и материалы не считает.
+bool scene_occluded(const CompiledScene &scene, const vec3 &orig, const vec3 &dir, const float tmax);
+
+// То же, что scene_intersect, по бинарному BVH — для сравнения в --bench-wide
+bool scene_intersect_binary(const CompiledScene &scene, const vec3 &orig, const vec3 &dir, Hit &hit);
+
+// Заполняет точку, нормаль и материал по найденному ближайшему примитиву prim на расстоянии dist
+void finish_hit(const CompiledScene &scene, const int prim, const vec3 &orig, const vec3 &dir, const float dist, Hit &hit);
+
+// Цвет текстурированной плоскости с mip-уровнем по конусу луча (упрощённые дифференциалы лучей):
+// cone_width — ширина конуса в точке попадания. След на плоскости длиннее в 1/|cos| раз.
+void shade_texture(const CompiledScene &scene, const vec3 &dir, const float cone_width, Hit &hit);
+
+#endif // SCENE_H
@@ -0,0 +1,100 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+// Тонкая обёртка над SSE/AVX: vfloat — SIMD_WIDTH чисел float, маски хранятся в том же регистре.
+// Ширина выбирается при компиляции: AVX (в Release собирается с -march=native) — 8, иначе SSE — 4.
+
+#include <cstdint>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+constexpr int SIMD_WIDTH = 8;
+
+struct vfloat {
+    __m256 v;
+    vfloat() = default;
+    vfloat(__m256 x) : v(x) {}
+    vfloat(float x) : v(_mm256_set1_ps(x)) {}
+    static vfloat load(const float *p) { return _mm256_loadu_ps(p); }
+    void store(float *p) const { _mm256_storeu_ps(p, v); }
+};
+
+inline vfloat operator+(vfloat a, vfloat b) { return _mm256_add_ps(a.v, b.v); }
+inline vfloat operator-(vfloat a, vfloat b) { return _mm256_sub_ps(a.v, b.v); }
+inline vfloat operator*(vfloat a, vfloat b) { return _mm256_mul_ps(a.v, b.v); }
+inline vfloat operator/(vfloat a, vfloat b) { return _mm256_div_ps(a.v, b.v); }
+inline vfloat vmin(vfloat a, vfloat b) { return _mm256_min_ps(a.v, b.v); }
+inline vfloat vmax(vfloat a, vfloat b) { return _mm256_max_ps(a.v, b.v); }
+inline vfloat vsqrt(vfloat a) { return _mm256_sqrt_ps(a.v); }
+inline vfloat vrcp(vfloat a) { return _mm256_rcp_ps(a.v); } // ~12 бит точности
+inline vfloat vabs(vfloat a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.f), a.v); }
+inline vfloat operator<(vfloat a, vfloat b)  { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+inline vfloat operator<=(vfloat a, vfloat b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ); }
+inline vfloat operator>(vfloat a, vfloat b)  { return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ); }
+inline vfloat operator>=(vfloat a, vfloat b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ); }
+inline vfloat operator&(vfloat a, vfloat b) { return _mm256_and_ps(a.v, b.v); }
+inline vfloat operator|(vfloat a, vfloat b) { return _mm256_or_ps(a.v, b.v); }
+inline vfloat andnot(vfloat m, vfloat a) { return _mm256_andnot_ps(m.v, a.v); } // a & ~m
+inline vfloat select(vfloat m, vfloat a, vfloat b) { return _mm256_blendv_ps(b.v, a.v, m.v); } // m ? a : b
+inline int movemask(vfloat m) { return _mm256_movemask_ps(m.v); }
+// Маска элементов p[0..SIMD_WIDTH), равных x
+#if defined(__AVX2__)
+inline int equal_mask(const uint32_t *p, uint32_t x) {
+    const __m256i eq = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)p), _mm256_set1_epi32(int(x)));
+    return _mm256_movemask_ps(_mm256_castsi256_ps(eq));
+}
+#else // целочисленное сравнение в AVX — только с AVX2
+inline int equal_mask(const uint32_t *p, uint32_t x) {
+    int mask = 0;
+    for (int i = 0; i < SIMD_WIDTH; i++) mask |= int(p[i] == x) << i;
+    return mask;
+}
+#endif
+
+#else
+#include <emmintrin.h>
+constexpr int SIMD_WIDTH = 4;
+#define SIMD_SSE 1 // для #if: SIMD_WIDTH — constexpr, препроцессору он не виден
+
+struct vfloat {
+    __m128 v;
+    vfloat() = default;
+    vfloat(__m128 x) : v(x) {}
+    vfloat(float x) : v(_mm_set1_ps(x)) {}
+    static vfloat load(const float *p) { return _mm_loadu_ps(p); }
+    void store(float *p) const { _mm_storeu_ps(p, v); }
+};
+
+inline vfloat operator+(vfloat a, vfloat b) { return _mm_add_ps(a.v, b.v); }
+inline vfloat operator-(vfloat a, vfloat b) { return _mm_sub_ps(a.v, b.v); }
+inline vfloat operator*(vfloat a, vfloat b) { return _mm_mul_ps(a.v, b.v); }
+inline vfloat operator/(vfloat a, vfloat b) { return _mm_div_ps(a.v, b.v); }
+inline vfloat vmin(vfloat a, vfloat b) { return _mm_min_ps(a.v, b.v); }
+inline vfloat vmax(vfloat a, vfloat b) { return _mm_max_ps(a.v, b.v); }
+inline vfloat vsqrt(vfloat a) { return _mm_sqrt_ps(a.v); }
+inline vfloat vrcp(vfloat a) { return _mm_rcp_ps(a.v); } // ~12 бит точности
+inline vfloat vabs(vfloat a) { return _mm_andnot_ps(_mm_set1_ps(-0.f), a.v); }
+inline vfloat operator<(vfloat a, vfloat b)  { return _mm_cmplt_ps(a.v, b.v); }
+inline vfloat operator<=(vfloat a, vfloat b) { return _mm_cmple_ps(a.v, b.v); }
+inline vfloat operator>(vfloat a, vfloat b)  { return _mm_cmpgt_ps(a.v, b.v); }
+inline vfloat operator>=(vfloat a, vfloat b) { return _mm_cmpge_ps(a.v, b.v); }
+inline vfloat operator&(vfloat a, vfloat b) { return _mm_and_ps(a.v, b.v); }
+inline vfloat operator|(vfloat a, vfloat b) { return _mm_or_ps(a.v, b.v); }
+inline vfloat andnot(vfloat m, vfloat a) { return _mm_andnot_ps(m.v, a.v); } // a & ~m
+inline vfloat select(vfloat m, vfloat a, vfloat b) { return _mm_or_ps(_mm_and_ps(m.v, a.v), _mm_andnot_ps(m.v, b.v)); } // m ? a : b
+inline int movemask(vfloat m) { return _mm_movemask_ps(m.v); }
+inline int equal_mask(const uint32_t *p, uint32_t x) {
+    const __m128i eq = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)p), _mm_set1_epi32(int(x)));
+    return _mm_movemask_ps(_mm_castsi128_ps(eq));
+}
+
+#endif
+
+// Маска из младших SIMD_WIDTH бит
+inline vfloat lane_mask(const int bits) {
+    alignas(32) float m[SIMD_WIDTH];
+    for (int i = 0; i < SIMD_WIDTH; i++) m[i] = (bits >> i & 1) ? -1.f : 0.f;
+    return vfloat::load(m) < vfloat(0.f);
+}
+
+#endif // SIMD_H
@@ -0,0 +1,221 @@
+#include "texture.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <emmintrin.h>
+#include <iostream>
+#include <stb_image.h>
+
+namespace {
+
+inline uint32_t pack_rgba(const unsigned r, const unsigned g, const unsigned b, const unsigned a) {
+    return r | g << 8 | b << 16 | a << 24;
+}
+
+// RGBA8 -> четыре float в [0, 255]
+inline __m128 unpack(const uint32_t t) {
+    __m128i v = _mm_cvtsi32_si128(static_cast<int>(t));
+    v = _mm_unpacklo_epi8(v, _mm_setzero_si128());
+    v = _mm_unpacklo_epi16(v, _mm_setzero_si128());
+    return _mm_cvtepi32_ps(v);
+}
+
+inline int address(int i, const int size, const Wrap wrap) {
+    if (wrap == Wrap::clamp) return std::min(std::max(i, 0), size - 1);
+    i %= size;
+    return i < 0 ? i + size : i;
+}
+
+// Билинейная выборка уровня в регистр RGBA, каналы в [0, 255]
+inline __m128 bilinear(const Texture::Level &level, const float u, const float v, const Wrap wrap_u, const Wrap wrap_v) {
+    float x = u * level.width - .5f, y = v * level.height - .5f;
+    float fx = std::floor(x), fy = std::floor(y);
+    int x0 = static_cast<int>(fx), y0 = static_cast<int>(fy);
+    float tx = x - fx, ty = y - fy;
+    int xa = address(x0, level.width, wrap_u), xb = address(x0 + 1, level.width, wrap_u);
+    int ya = address(y0, level.height, wrap_v), yb = address(y0 + 1, level.height, wrap_v);
+    const uint32_t *t = level.texels.data();
+
+    __m128 top    = _mm_add_ps(_mm_mul_ps(unpack(t[level.index(xa, ya)]), _mm_set1_ps(1 - tx)),
+                               _mm_mul_ps(unpack(t[level.index(xb, ya)]), _mm_set1_ps(tx)));
+    __m128 bottom = _mm_add_ps(_mm_mul_ps(unpack(t[level.index(xa, yb)]), _mm_set1_ps(1 - tx)),
+                               _mm_mul_ps(unpack(t[level.index(xb, yb)]), _mm_set1_ps(tx)));
+    return _mm_add_ps(_mm_mul_ps(top, _mm_set1_ps(1 - ty)), _mm_mul_ps(bottom, _mm_set1_ps(ty)));
+}
+
+// Построчный уровень -> блоки 4x4; тексели за краем изображения повторяют крайние
+Texture::Level tile_level(const uint32_t *rows, const int width, const int height) {
+    Texture::Level level;
+    level.width = width;
+    level.height = height;
+    level.blocks_x = (width + 3) / 4;
+    level.texels.resize(size_t(level.blocks_x) * ((height + 3) / 4) * 16);
+    for (int y = 0; y < (height + 3) / 4 * 4; y++) {
+        const uint32_t *row = rows + size_t(std::min(y, height - 1)) * width;
+        for (int bx = 0; bx < level.blocks_x; bx++) {
+            uint32_t *dst = &level.texels[level.index(bx * 4, y)];
+            if (bx * 4 + 4 <= width) std::memcpy(dst, row + bx * 4, 4 * sizeof(uint32_t));
+            else for (int k = 0; k < 4; k++) dst[k] = row[std::min(bx * 4 + k, width - 1)];
+        }
+    }
+    return level;
+}
+
+inline vec3 to_color(const __m128 rgba) {
+    alignas(16) float c[4];
+    _mm_store_ps(c, _mm_mul_ps(rgba, _mm_set1_ps(1.f / 255.f)));
+    return {c[0], c[1], c[2]};
+}
+
+} // namespace
+
+size_t Texture::bytes() const {
+    size_t total = 0;
+    for (const Level &l : levels) total += l.texels.size() * sizeof(uint32_t);
+    return total;
+}
+
+vec3 Texture::sample_bilinear(const float u, const float v, const int level) const {
+    const int l = std::min(std::max(level, 0), static_cast<int>(levels.size()) - 1);
+    return to_color(bilinear(levels[l], u, v, wrap_u, wrap_v));
+}
+
+vec3 Texture::sample_trilinear(const float u, const float v, const float lod) const {
+    const float max_lod = static_cast<float>(levels.size() - 1);
+    const float l = std::min(std::max(lod, 0.f), max_lod);
+    const int l0 = static_cast<int>(l);
+    const float t = l - l0;
+    __m128 c = bilinear(levels[l0], u, v, wrap_u, wrap_v);
+    if (t > 0 && l0 + 1 < static_cast<int>(levels.size())) {
+        __m128 c1 = bilinear(levels[l0 + 1], u, v, wrap_u, wrap_v);
+        c = _mm_add_ps(c, _mm_mul_ps(_mm_sub_ps(c1, c), _mm_set1_ps(t)));
+    }
+    return to_color(c);
+}
+
+Texture make_texture(const unsigned char *pixels, const int width, const int height, const int channels,
+                     const Wrap wrap_u, const Wrap wrap_v) {
+    Texture tex;
+    tex.wrap_u = wrap_u;
+    tex.wrap_v = wrap_v;
+
+    std::vector<uint32_t> src(size_t(width) * height);
+    for (size_t i = 0; i < src.size(); i++) {
+        const unsigned char *p = pixels + i * channels;
+        src[i] = pack_rgba(p[0], p[1], p[2], channels == 4 ? p[3] : 255);
+    }
+    int w = width, h = height;
+    tex.levels.push_back(tile_level(src.data(), w, h));
+
+    // Каждый следующий уровень — среднее 2x2 предыдущего (у нечётной стороны последний тексель повторяется).
+    // Уменьшение идёт по построчной копии, в блоки раскладывается готовый уровень.
+    while (w > 1 || h > 1) {
+        const int dw = std::max(1, w / 2), dh = std::max(1, h / 2);
+        std::vector<uint32_t> dst(size_t(dw) * dh);
+        for (int j = 0; j < dh; j++) {
+            int j0 = std::min(2 * j, h - 1), j1 = std::min(2 * j + 1, h - 1);
+            for (int i = 0; i < dw; i++) {
+                int i0 = std::min(2 * i, w - 1), i1 = std::min(2 * i + 1, w - 1);
+                __m128 sum = _mm_add_ps(_mm_add_ps(unpack(src[size_t(j0) * w + i0]), unpack(src[size_t(j0) * w + i1])),
+                                        _mm_add_ps(unpack(src[size_t(j1) * w + i0]), unpack(src[size_t(j1) * w + i1])));
+                __m128i q = _mm_cvtps_epi32(_mm_mul_ps(sum, _mm_set1_ps(.25f)));
+                q = _mm_packs_epi32(q, q);
+                q = _mm_packus_epi16(q, q);
+                dst[size_t(j) * dw + i] = static_cast<uint32_t>(_mm_cvtsi128_si32(q));
+            }
+        }
+        src.swap(dst);
+        w = dw;
+        h = dh;
+        tex.levels.push_back(tile_level(src.data(), w, h));
+    }
+    return tex;
+}
+
+Texture make_texture(const CachedImage &image, const Wrap wrap_u, const Wrap wrap_v) {
+    Texture tex;
+    tex.wrap_u = wrap_u;
+    tex.wrap_v = wrap_v;
+    for (const CachedLevel &l : image.levels)
+        tex.levels.push_back(tile_level(reinterpret_cast<const uint32_t *>(l.data), l.width, l.height));
+    return tex;
+}
+
+bool texture_image(const CachedImage &image) {
+    return image.channels == 4 && !image.levels.empty();
+}
+
+CachedImage cached_image(const Texture &tex, std::vector<std::vector<uint32_t>> &storage) {
+    CachedImage image;
+    image.channels = 4;
+    for (const Texture::Level &l : tex.levels) {
+        std::vector<uint32_t> rows(size_t(l.width) * l.height);
+        for (int y = 0; y < l.height; y++)
+            for (int x = 0; x < l.width; x++) rows[size_t(y) * l.width + x] = l.texels[l.index(x, y)];
+        storage.push_back(std::move(rows));
+        image.levels.push_back({l.width, l.height, reinterpret_cast<const unsigned char *>(storage.back().data())});
+    }
+    return image;
+}
+
+Texture load_texture(const char *filename, const Wrap wrap_u, const Wrap wrap_v) {
+    int width, height, n = -1;
+    unsigned char *pixmap = stbi_load(filename, &width, &height, &n, 0);
+    if (!pixmap || (n != 3 && n != 4)) {
+        std::cerr << "Error: unable to load the texture " << filename << std::endl;
+        std::exit(1);
+    }
+    Texture tex = make_texture(pixmap, width, height, n, wrap_u, wrap_v);
+    stbi_image_free(pixmap);
+    return tex;
+}
+
+Texture load_texture_cached(const std::string &filename, const Wrap wrap_u, const Wrap wrap_v) {
+    uint64_t hash;
+    CacheFile cache;
+    const bool hashed = hash_file(filename, hash);
+    const std::string cached = hashed ? cache_path(filename, "texture", hash) : "";
+    if (hashed && open_cache(cached, hash, cache) && cache.images.size() == 1 && texture_image(cache.images[0]))
+        return make_texture(cache.images[0], wrap_u, wrap_v);
+    Texture tex = load_texture(filename.c_str(), wrap_u, wrap_v);
+    std::vector<std::vector<uint32_t>> storage;
+    if (hashed && !write_cache(cached, hash, {cached_image(tex, storage)}))
+        std::cerr << "Error: unable to write the image cache " << cached << std::endl;
+    return tex;
+}
+
+size_t CubeMap::bytes() const {
+    size_t total = 0;
+    for (const Texture &f : faces) total += f.bytes();
+    return total;
+}
+
+vec3 CubeMap::sample(const vec3 &dir, const float lod) const {
+    float u, v;
+    const int face = cube_face(dir, u, v);
+    return faces[face].sample_trilinear(u, v, lod);
+}
+
+CubeMap make_cubemap(const Texture &equirect, const int face_size) {
+    CubeMap cube;
+    std::vector<unsigned char> pixels(size_t(face_size) * face_size * 4);
+    for (int face = 0; face < 6; face++) {
+#pragma omp parallel for
+        for (int j = 0; j < face_size; j++) {
+            for (int i = 0; i < face_size; i++) {
+                float u, v;
+                equirect_uv(cube_face_dir(face, (i + .5f) / face_size, (j + .5f) / face_size).normalized(), u, v);
+                const vec3 c = equirect.sample_bilinear(u, v);
+                unsigned char *p = &pixels[(size_t(j) * face_size + i) * 4];
+                p[0] = static_cast<unsigned char>(std::min(255.f, c.x * 255 + .5f));
+                p[1] = static_cast<unsigned char>(std::min(255.f, c.y * 255 + .5f));
+                p[2] = static_cast<unsigned char>(std::min(255.f, c.z * 255 + .5f));
+                p[3] = 255;
+            }
+        }
+        cube.faces[face] = make_texture(pixels.data(), face_size, face_size, 4, Wrap::clamp, Wrap::clamp);
+    }
+    return cube;
+}
@@ -0,0 +1,107 @@
+#ifndef TEXTURE_H
+#define TEXTURE_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "geometry.h"
+#include "image_cache.h"
+
+// Поведение координаты за пределами [0, 1)
+enum class Wrap { repeat, clamp };
+
+// Текстура RGBA8 (4 байта на тексель вместо 12 у vec3) с полной цепочкой mip-уровней.
+// Выборка билинейная или трилинейная, тексели смешиваются SSE-инструкциями сразу по всем каналам.
+// Тексели уровня лежат блоками 4x4 (64 байта — одна кэш-линия), блоки — строками: четвёрка текселей
+// билинейной выборки почти всегда в одной линии, а соседние по вертикали выборки не прыгают на целую строку.
+struct Texture {
+    struct Level {
+        int width = 0, height = 0;
+        int blocks_x = 0;             // блоков 4x4 в строке, края дополнены до кратного 4
+        std::vector<uint32_t> texels; // R в младшем байте, строки сверху вниз
+
+        size_t index(const int x, const int y) const {
+            return (size_t(y >> 2) * blocks_x + (x >> 2)) * 16 + (y & 3) * 4 + (x & 3);
+        }
+    };
+    std::vector<Level> levels; // levels[0] — исходное изображение
+    Wrap wrap_u = Wrap::repeat, wrap_v = Wrap::repeat;
+
+    int width()  const { return levels.empty() ? 0 : levels[0].width; }
+    int height() const { return levels.empty() ? 0 : levels[0].height; }
+    size_t bytes() const;
+
+    // (u, v) в [0, 1): u — вправо, v — вниз по изображению
+    vec3 sample_bilinear(const float u, const float v, const int level = 0) const;
+    // lod — log2 размера следа выборки в текселях уровня 0
+    vec3 sample_trilinear(const float u, const float v, const float lod) const;
+};
+
+// Координаты панорамы для направления: u — долгота, v — полярный угол от +Y
+inline void equirect_uv(const vec3 &dir, float &u, float &v) {
+    u = (std::atan2(dir.z, dir.x) + M_PI) / (2 * M_PI);
+    v = std::acos(std::max(-1.f, std::min(1.f, dir.y))) / M_PI;
+}
+
+// Грань куба (+X, -X, +Y, -Y, +Z, -Z) по наибольшей по модулю компоненте и (u, v) в [0, 1] на ней
+inline int cube_face(const vec3 &dir, float &u, float &v) {
+    const float ax = std::abs(dir.x), ay = std::abs(dir.y), az = std::abs(dir.z);
+    int face;
+    float sc, tc, ma;
+    if (ax >= ay && ax >= az) { face = dir.x > 0 ? 0 : 1; ma = ax; sc = dir.x > 0 ? -dir.z : dir.z; tc = -dir.y; }
+    else if (ay >= az)        { face = dir.y > 0 ? 2 : 3; ma = ay; sc = dir.x; tc = dir.y > 0 ? dir.z : -dir.z; }
+    else                      { face = dir.z > 0 ? 4 : 5; ma = az; sc = dir.z > 0 ? dir.x : -dir.x; tc = -dir.y; }
+    const float inv = .5f / ma;
+    u = sc * inv + .5f;
+    v = tc * inv + .5f;
+    return face;
+}
+
+// Обратное к cube_face: ненормированное направление на точку (u, v) грани
+inline vec3 cube_face_dir(const int face, const float u, const float v) {
+    const float sc = 2 * u - 1, tc = 2 * v - 1;
+    switch (face) {
+        case 0:  return {1, -tc, -sc};
+        case 1:  return {-1, -tc, sc};
+        case 2:  return {sc, 1, tc};
+        case 3:  return {sc, -1, -tc};
+        case 4:  return {sc, -tc, 1};
+        default: return {-sc, -tc, -1};
+    }
+}
+
+// Кубическая карта окружения: грани +X, -X, +Y, -Y, +Z, -Z (раскладка OpenGL).
+// Грань выбирается по наибольшей по модулю компоненте направления — без atan2/acos, одно деление.
+struct CubeMap {
+    Texture faces[6];
+
+    int face_size() const { return faces[0].width(); }
+    size_t bytes() const;
+    // lod — log2 следа выборки в текселях грани
+    vec3 sample(const vec3 &dir, const float lod) const;
+};
+
+// Пересэмплирование равнопромежуточной панорамы (u — долгота, v — полярный угол от +Y) в грани face_size x face_size.
+// Тригонометрия считается здесь, один раз на тексель грани.
+CubeMap make_cubemap(const Texture &equirect, const int face_size);
+
+// Цепочка уровней из RGB/RGBA-пикселей (channels = 3 или 4), уменьшение фильтром 2x2
+Texture make_texture(const unsigned char *pixels, const int width, const int height, const int channels,
+                     const Wrap wrap_u, const Wrap wrap_v);
+
+// Текстура из записи кэша (channels = 4) и обратно. В кэше уровни построчные,
+// cached_image раскладывает их в storage и ссылается на него.
+Texture make_texture(const CachedImage &image, const Wrap wrap_u, const Wrap wrap_v);
+CachedImage cached_image(const Texture &tex, std::vector<std::vector<uint32_t>> &storage);
+// Запись годится для make_texture: RGBA и хотя бы один уровень; иначе картинка декодируется заново
+bool texture_image(const CachedImage &image);
+
+// Загрузка через stb_image; при ошибке сообщение и выход, как у остальных загрузчиков
+Texture load_texture(const char *filename, const Wrap wrap_u, const Wrap wrap_v);
+
+// То же через кэш декодированных изображений: JPEG разбирается, только если файл изменился
+Texture load_texture_cached(const std::string &filename, const Wrap wrap_u, const Wrap wrap_v);
+
+#endif // TEXTURE_H
@@ -0,0 +1,127 @@
+#include "tiles.h"
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <omp.h>
+
+namespace {
+
+unsigned morton_index(unsigned x, unsigned y) {
+    unsigned d = 0;
+    for (int b = 0; b < 16; b++) d |= ((x >> b & 1) << (2 * b)) | ((y >> b & 1) << (2 * b + 1));
+    return d;
+}
+
+// Номер клетки (x, y) на кривой Гильберта в квадрате n x n, n — степень двойки
+unsigned hilbert_index(unsigned n, unsigned x, unsigned y) {
+    unsigned d = 0;
+    for (unsigned s = n / 2; s > 0; s /= 2) {
+        unsigned rx = (x & s) > 0, ry = (y & s) > 0;
+        d += s * s * ((3 * rx) ^ ry);
+        if (!ry) {
+            if (rx) { x = s - 1 - x; y = s - 1 - y; }
+            std::swap(x, y);
+        }
+    }
+    return d;
+}
+
+// Дека тайлов одного потока; хозяин берёт с начала, воры — с конца
+struct WorkDeque {
+    std::mutex lock;
+    std::deque<int> tiles;
+};
+
+} // namespace
+
+std::vector<Tile> make_tiles(const int width, const int height, const int tile_size, const TileOrder order) {
+    const int tiles_x = (width + tile_size - 1) / tile_size, tiles_y = (height + tile_size - 1) / tile_size;
+    unsigned n = 1;
+    while (n < unsigned(std::max(tiles_x, tiles_y))) n *= 2;
+
+    std::vector<std::pair<unsigned, Tile>> keyed;
+    for (int ty = 0; ty < tiles_y; ty++) {
+        for (int tx = 0; tx < tiles_x; tx++) {
+            Tile t = {tx * tile_size, ty * tile_size,
+                      std::min(width, (tx + 1) * tile_size), std::min(height, (ty + 1) * tile_size)};
+            unsigned key = order == TileOrder::morton  ? morton_index(tx, ty)
+                         : order == TileOrder::hilbert ? hilbert_index(n, tx, ty)
+                         : unsigned(ty * tiles_x + tx);
+            keyed.push_back({key, t});
+        }
+    }
+    std::sort(keyed.begin(), keyed.end(), [](const auto &a, const auto &b) { return a.first < b.first; });
+    std::vector<Tile> tiles;
+    for (const auto &k : keyed) tiles.push_back(k.second);
+    return tiles;
+}
+
+std::vector<TileTiming> render_tiles(const std::vector<Tile> &tiles, const std::function<void(const Tile &)> &render) {
+    const int count = static_cast<int>(tiles.size());
+    const int threads = omp_get_max_threads();
+    std::vector<TileTiming> timings(count);
+    std::vector<WorkDeque> deques(threads);
+    for (int t = 0; t < threads; t++)
+        for (int i = count * t / threads; i < count * (t + 1) / threads; i++) deques[t].tiles.push_back(i);
+
+#pragma omp parallel num_threads(threads)
+    {
+        const int self = omp_get_thread_num();
+        int victim = self;
+        for (;;) {
+            int tile = -1;
+            bool stolen = false;
+            {
+                std::lock_guard<std::mutex> guard(deques[self].lock);
+                if (!deques[self].tiles.empty()) {
+                    tile = deques[self].tiles.front();
+                    deques[self].tiles.pop_front();
+                }
+            }
+            // Своя дека пуста — обходим остальные по кругу (все, включая прошлую жертву) и забираем самый дальний по кривой тайл
+            for (int k = 1; tile < 0 && k <= threads; k++) {
+                victim = (victim + 1) % threads;
+                if (victim == self) continue;
+                std::lock_guard<std::mutex> guard(deques[victim].lock);
+                if (!deques[victim].tiles.empty()) {
+                    tile = deques[victim].tiles.back();
+                    deques[victim].tiles.pop_back();
+                    stolen = true;
+                }
+            }
+            // Все деки пусты, а новые тайлы не появляются: поток выходит, и барьер omp parallel ждёт остальных
+            if (tile < 0) break;
+
+            auto start = std::chrono::steady_clock::now();
+            render(tiles[tile]);
+            timings[tile] = {self, stolen, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count()};
+        }
+    }
+    return timings;
+}
+
+void write_tile_log(const std::string &path, const std::vector<Tile> &tiles, const std::vector<TileTiming> &timings) {
+    std::ofstream log(path);
+    if (!log) {
+        std::cerr << "Error: unable to write the tile log " << path << std::endl;
+        return;
+    }
+    log << "tile,x,y,w,h,thread,stolen,ms\n";
+    for (size_t i = 0; i < tiles.size(); i++) {
+        const Tile &t = tiles[i];
+        log << i << ',' << t.x0 << ',' << t.y0 << ',' << t.x1 - t.x0 << ',' << t.y1 - t.y0 << ','
+            << timings[i].thread << ',' << timings[i].stolen << ',' << timings[i].ms << '\n';
+    }
+}
+
+bool parse_tile_order(const std::string &name, TileOrder &order) {
+    if (name == "scanline") order = TileOrder::scanline;
+    else if (name == "morton") order = TileOrder::morton;
+    else if (name == "hilbert") order = TileOrder::hilbert;
+    else return false;
+    return true;
+}
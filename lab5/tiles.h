@@ -0,0 +1,34 @@
+#ifndef TILES_H
+#define TILES_H
+
+#include <functional>
+#include <string>
+#include <vector>
+
+// Порядок обхода тайлов: построчный или по кривым Мортона/Гильберта (соседние тайлы рядом в очереди)
+enum class TileOrder { scanline, morton, hilbert };
+
+struct Tile {
+    int x0, y0, x1, y1; // пиксели [x0, x1) x [y0, y1)
+};
+
+struct TileTiming {
+    int thread = -1;
+    bool stolen = false;
+    double ms = 0;
+};
+
+// Разбивает кадр на тайлы tile_size x tile_size в заданном порядке
+std::vector<Tile> make_tiles(const int width, const int height, const int tile_size, const TileOrder order);
+
+// Рендер тайлов на всех потоках OpenMP. Каждый поток получает непрерывный кусок кривой в свою деку
+// и берёт работу с её начала; опустевший поток ворует тайлы с конца чужих дек.
+// Возвращает время каждого тайла (в порядке tiles).
+std::vector<TileTiming> render_tiles(const std::vector<Tile> &tiles, const std::function<void(const Tile &)> &render);
+
+// CSV-журнал: tile,x,y,w,h,thread,stolen,ms
+void write_tile_log(const std::string &path, const std::vector<Tile> &tiles, const std::vector<TileTiming> &timings);
+
+bool parse_tile_order(const std::string &name, TileOrder &order);
+
+#endif // TILES_H
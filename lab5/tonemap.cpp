@@ -0,0 +1,123 @@
+#include "tonemap.h"
+
+#include <algorithm>
+#include <vector>
+#include "simd.h"
+
+namespace {
+
+constexpr size_t CHUNK = 1 << 14; // чисел float на итерацию параллельного цикла
+
+// 1/d через rcp вместо деления: его 12 бит точности (ошибка < 0.07 от шага 1/255) хватает для 8-битного результата
+inline vfloat reciprocal(const vfloat d) { return vrcp(d); }
+
+// Кривые сразу в шкале 0..255 (множитель внесён в числитель); функторы, а не функции — указатель на функцию
+// в шаблоне не встраивается
+struct Reinhard {
+    vfloat operator()(const vfloat x) const { return (vfloat(255.f) * x) * reciprocal(vfloat(1.f) + x); }
+};
+
+struct Aces {
+    vfloat operator()(const vfloat x) const {
+        return (x * (vfloat(2.51f * 255) * x + vfloat(0.03f * 255))) * reciprocal(x * (vfloat(2.43f) * x + vfloat(0.59f)) + vfloat(0.14f));
+    }
+};
+
+// Значение кривой + 0.5 для округления; больше 255 обрезается насыщением при упаковке в байты
+template <class Curve>
+inline vfloat to_255(const float *hdr, const float exposure, Curve curve) {
+    const vfloat x = vmax(vfloat::load(hdr) * vfloat(exposure), vfloat(0.f));
+    return curve(x) + vfloat(.5f);
+}
+
+// Четыре регистра со значениями 0..255.5 -> 4 * SIMD_WIDTH байт (с отбрасыванием дробной части)
+inline void store_bytes(const vfloat v[4], unsigned char *out) {
+#if defined(__AVX2__)
+    // packus работает внутри 128-битных половин, перестановка возвращает порядок; больше 255 — насыщение
+    const __m256i lo = _mm256_packus_epi32(_mm256_cvttps_epi32(v[0].v), _mm256_cvttps_epi32(v[1].v));
+    const __m256i hi = _mm256_packus_epi32(_mm256_cvttps_epi32(v[2].v), _mm256_cvttps_epi32(v[3].v));
+    const __m256i bytes = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(lo, hi), _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(out), bytes);
+#elif defined(SIMD_SSE)
+    const __m128i lo = _mm_packs_epi32(_mm_cvttps_epi32(v[0].v), _mm_cvttps_epi32(v[1].v));
+    const __m128i hi = _mm_packs_epi32(_mm_cvttps_epi32(v[2].v), _mm_cvttps_epi32(v[3].v));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out), _mm_packus_epi16(lo, hi));
+#else
+    alignas(32) float mapped[4 * SIMD_WIDTH];
+    for (int k = 0; k < 4; k++) vmin(v[k], vfloat(255.f)).store(mapped + k * SIMD_WIDTH);
+    for (int k = 0; k < 4 * SIMD_WIDTH; k++) out[k] = static_cast<unsigned char>(mapped[k]);
+#endif
+}
+
+constexpr int STEP = 4 * SIMD_WIDTH; // чисел на один store_bytes
+
+template <class Curve>
+void map_channels(const float *hdr, const size_t count, const float exposure, unsigned char *rgb, Curve curve) {
+    const size_t chunks = (count + CHUNK - 1) / CHUNK;
+#pragma omp parallel for schedule(static)
+    for (size_t c = 0; c < chunks; c++) {
+        const size_t begin = c * CHUNK, end = std::min(count, begin + CHUNK);
+        size_t i = begin;
+        for (; i + STEP <= end; i += STEP) {
+            vfloat v[4];
+            for (int k = 0; k < 4; k++) v[k] = to_255(hdr + i + k * SIMD_WIDTH, exposure, curve);
+            store_bytes(v, rgb + i);
+        }
+        alignas(32) float tail[SIMD_WIDTH] = {};
+        for (; i < end; i += SIMD_WIDTH) { // хвост меньше STEP
+            const size_t n = std::min<size_t>(SIMD_WIDTH, end - i);
+            std::copy(hdr + i, hdr + i + n, tail);
+            vmin(to_255(tail, exposure, curve), vfloat(255.f)).store(tail);
+            for (size_t k = 0; k < n; k++) rgb[i + k] = static_cast<unsigned char>(tail[k]);
+        }
+    }
+}
+
+// Деление на наибольший канал смешивает каналы пикселя: сначала скалярно раскладываем знаменатель пикселя
+// на его три канала, дальше буфер снова плоский. Порядок операций тот же, что у скалярного 255 * x / max,
+// поэтому результат совпадает побитно
+void map_max(const float *hdr, const size_t pixels, const float exposure, unsigned char *rgb) {
+    constexpr size_t PIXELS = CHUNK / 4;
+    const size_t chunks = (pixels + PIXELS - 1) / PIXELS;
+#pragma omp parallel
+    {
+        std::vector<float> denom(PIXELS * 3);
+#pragma omp for schedule(static)
+        for (size_t c = 0; c < chunks; c++) {
+            const size_t p0 = c * PIXELS, n = std::min(pixels, p0 + PIXELS) - p0;
+            const float *src = hdr + p0 * 3;
+            unsigned char *dst = rgb + p0 * 3;
+            for (size_t p = 0; p < n; p++) {
+                const float r = std::max(0.f, src[p * 3] * exposure), g = std::max(0.f, src[p * 3 + 1] * exposure),
+                            b = std::max(0.f, src[p * 3 + 2] * exposure);
+                denom[p * 3] = denom[p * 3 + 1] = denom[p * 3 + 2] = std::max(1.f, std::max(r, std::max(g, b)));
+            }
+            size_t i = 0;
+            for (; i + STEP <= n * 3; i += STEP) {
+                vfloat v[4];
+                for (int k = 0; k < 4; k++) {
+                    const vfloat x = vmax(vfloat::load(src + i + k * SIMD_WIDTH) * vfloat(exposure), vfloat(0.f));
+                    v[k] = vfloat(255.f) * x / vfloat::load(&denom[i + k * SIMD_WIDTH]);
+                }
+                store_bytes(v, dst + i);
+            }
+            for (; i < n * 3; i++) dst[i] = static_cast<unsigned char>(255 * std::max(0.f, src[i] * exposure) / denom[i]);
+        }
+    }
+}
+
+} // namespace
+
+bool parse_tone_map(const std::string &name, ToneMap &op) {
+    if (name == "max") op = ToneMap::max;
+    else if (name == "reinhard") op = ToneMap::reinhard;
+    else if (name == "aces") op = ToneMap::aces;
+    else return false;
+    return true;
+}
+
+void tone_map(const float *hdr, const size_t pixels, const ToneMap op, const float exposure, unsigned char *rgb) {
+    if (op == ToneMap::reinhard) return map_channels(hdr, pixels * 3, exposure, rgb, Reinhard{});
+    if (op == ToneMap::aces) return map_channels(hdr, pixels * 3, exposure, rgb, Aces{});
+    map_max(hdr, pixels, exposure, rgb);
+}
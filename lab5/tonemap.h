@@ -0,0 +1,18 @@
+#ifndef TONEMAP_H
+#define TONEMAP_H
+
+#include <cstddef>
+#include <string>
+
+// Перевод линейного HDR-кадра в RGB8:
+// max — деление на наибольший канал пикселя, если он больше 1 (как было до float-буфера);
+// reinhard — x / (1 + x) по каналам; aces — аппроксимация кривой ACES (K. Narkowicz).
+enum class ToneMap { max, reinhard, aces };
+
+bool parse_tone_map(const std::string &name, ToneMap &op);
+
+// pixels пикселей RGB float -> RGB8, параллельно на потоках OpenMP; exposure — множитель перед кривой.
+// reinhard и aces не смешивают каналы, поэтому буфер обрабатывается как плоский массив по SIMD_WIDTH чисел.
+void tone_map(const float *hdr, const size_t pixels, const ToneMap op, const float exposure, unsigned char *rgb);
+
+#endif // TONEMAP_H
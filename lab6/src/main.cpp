@@ -6,6 +6,7 @@
 #include "render.h"  // Для рендеринга
 #include "camera.h"  // Для работы с камерой
 #include "hud.h"     // Для отображения интерфейса
+#include "gl_image.h" // Время до первого кадра
 
 
 // Флаг автоматического вращения
@@ -41,6 +42,7 @@ void setup() {
 
 // Главная функция
 int main(int argc, char** argv) {
+    mark_launch();
     glutInit(&argc, argv);
     glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH);
     glutInitWindowSize(800, 600);